@@ -2,6 +2,10 @@
 #include "agt_stdafx.h"
 #include "agt_utils.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace agt3d
 {
 
@@ -25,6 +29,57 @@ void AABB::calculateFromPoints(const glm::vec3* verts, const uint32_t numVerts)
   }
 }
 
+AABB AABB::transformed(const glm::mat4& tm) const noexcept
+{
+  AABB out;
+  transformAABBs(this, &tm, &out, 1);
+  return out;
+}
+
+bool AABB::operator==(const AABB& other) const noexcept
+{
+  return min == other.min && max == other.max;
+}
+
+void transformAABBs(const AABB* boxes, const glm::mat4* tms, AABB* out,
+                    size_t count) noexcept
+{
+  // Arvo: start from the translation, every column of the matrix scaled by
+  // the min and max of its axis adds its smaller product to min and the
+  // larger one to max
+  for (size_t i = 0; i < count; i++) {
+    const auto& box = boxes[i];
+    const auto& m = tms[i];
+#ifdef __SSE2__
+    __m128 mn = _mm_loadu_ps(&m[3][0]);
+    __m128 mx = mn;
+    for (int j = 0; j < 3; j++) {
+      __m128 col = _mm_loadu_ps(&m[j][0]);
+      __m128 a = _mm_mul_ps(col, _mm_set1_ps(box.min[j]));
+      __m128 b = _mm_mul_ps(col, _mm_set1_ps(box.max[j]));
+      mn = _mm_add_ps(mn, _mm_min_ps(a, b));
+      mx = _mm_add_ps(mx, _mm_max_ps(a, b));
+    }
+    alignas(16) float lo[4], hi[4];
+    _mm_store_ps(lo, mn);
+    _mm_store_ps(hi, mx);
+    out[i].min = {lo[0], lo[1], lo[2]};
+    out[i].max = {hi[0], hi[1], hi[2]};
+#else
+    glm::vec3 mn = glm::vec3(m[3]);
+    glm::vec3 mx = mn;
+    for (int j = 0; j < 3; j++) {
+      glm::vec3 a = glm::vec3(m[j]) * box.min[j];
+      glm::vec3 b = glm::vec3(m[j]) * box.max[j];
+      mn += glm::min(a, b);
+      mx += glm::max(a, b);
+    }
+    out[i].min = mn;
+    out[i].max = mx;
+#endif
+  }
+}
+
 BoundingSphere& BoundingSphere::operator+(const BoundingSphere& a) noexcept
 {
   center = a.center;
@@ -39,4 +94,51 @@ BoundingSphere& BoundingSphere::operator+=(const BoundingSphere& rhs) noexcept
   return *this;
 }
 
+BoundingSphere BoundingSphere::transformed(const glm::mat4& tm) const noexcept
+{
+  float scale2 = std::max(std::max(glm::length2(glm::vec3(tm[0])),
+                                   glm::length2(glm::vec3(tm[1]))),
+                          glm::length2(glm::vec3(tm[2])));
+  return {glm::vec3(tm * glm::vec4(center, 1.0f)), radius * sqrtf(scale2)};
+}
+
+Frustum::Frustum(const glm::mat4& viewProjection)
+{
+  // Gribb-Hartmann, rows of the matrix combined with the w row
+  glm::mat4 m = glm::transpose(viewProjection);
+  planes[0] = m[3] + m[0];
+  planes[1] = m[3] - m[0];
+  planes[2] = m[3] + m[1];
+  planes[3] = m[3] - m[1];
+  planes[4] = m[3] + m[2];
+  planes[5] = m[3] - m[2];
+  for (auto& plane : planes) {
+    plane /= glm::length(glm::vec3(plane));
+  }
+}
+
+bool Frustum::intersects(const AABB& box) const noexcept
+{
+  for (const auto& plane : planes) {
+    // corner furthest along the plane normal
+    glm::vec3 p = {plane.x >= 0 ? box.max.x : box.min.x,
+                   plane.y >= 0 ? box.max.y : box.min.y,
+                   plane.z >= 0 ? box.max.z : box.min.z};
+    if (glm::dot(glm::vec3(plane), p) + plane.w < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Frustum::intersects(const BoundingSphere& sphere) const noexcept
+{
+  for (const auto& plane : planes) {
+    if (glm::dot(glm::vec3(plane), sphere.center) + plane.w < -sphere.radius) {
+      return false;
+    }
+  }
+  return true;
+}
+
 }  // namespace agt3d
@@ -8,6 +8,12 @@ namespace agt3d
 struct AABB {
   AABB();
   void calculateFromPoints(const glm::vec3* verts, const uint32_t numVerts);
+  /**
+   * @brief Exact bounds of the box after an affine transform (Arvo's method),
+   * tight under rotation unlike transforming only min and max.
+   */
+  AABB transformed(const glm::mat4& tm) const noexcept;
+  bool operator==(const AABB& other) const noexcept;
   glm::vec3 min;
   glm::vec3 max;
 };
@@ -19,6 +25,30 @@ struct BoundingSphere {
   BoundingSphere& operator+(const BoundingSphere& a) noexcept;
 
   BoundingSphere& operator+=(const BoundingSphere& rhs) noexcept;
+  /**
+   * @brief Conservative sphere after an affine transform, the radius grows by
+   * the largest axis scale.
+   */
+  BoundingSphere transformed(const glm::mat4& tm) const noexcept;
 };
 
+/**
+ * @brief View frustum as six inward facing planes (xyz normal, w distance),
+ * extracted from a view-projection matrix.
+ */
+struct Frustum {
+  Frustum() = default;
+  Frustum(const glm::mat4& viewProjection);
+  bool intersects(const AABB& box) const noexcept;
+  bool intersects(const BoundingSphere& sphere) const noexcept;
+  glm::vec4 planes[6];
+};
+
+/**
+ * @brief Transform many boxes at once, out[i] = boxes[i].transformed(tms[i]).
+ * Uses SSE when available.
+ */
+void transformAABBs(const AABB* boxes, const glm::mat4* tms, AABB* out,
+                    size_t count) noexcept;
+
 }  // namespace agt3d
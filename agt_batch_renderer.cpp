@@ -0,0 +1,91 @@
+#include "agt_batch_renderer.h"
+
+#include "agt_gl_state.h"
+#include "agt_scene.h"
+#include "agt_stdafx.h"
+#include "agt_texture.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+BatchRenderer::BatchRenderer(int _samples, size_t readbackSlots)
+    : readback(readbackSlots, PixelLayout::RGBA, true), samples(_samples)
+{
+}
+
+void BatchRenderer::add(const RenderJob& job)
+{
+  MY_ASSERT(job.scene, "BatchRenderer: job without scene");
+  jobs.push_back(job);
+}
+
+void BatchRenderer::run()
+{
+  while (!jobs.empty()) {
+    auto t0 = std::chrono::steady_clock::now();
+    render(jobs.front());
+    jobs.pop_front();
+    renderMs += std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - t0)
+                  .count();
+    rendered++;
+  }
+  readback.flush();
+}
+
+void BatchRenderer::render(const RenderJob& job)
+{
+  RenderTargetDesc desc;
+  desc.width = job.width;
+  desc.height = job.height;
+  desc.samples = samples;
+  FBO* target = targets.acquireFramebuffer(desc, true);
+  FBO* resolved = target;
+  if (samples > 0) {
+    desc.samples = 0;
+    resolved = targets.acquireFramebuffer(desc, false);
+  }
+
+  target->bind();
+  glViewport(0, 0, job.width, job.height);
+  GlState::depthMask(true);
+  glClearColor(job.clearColor.r, job.clearColor.g, job.clearColor.b,
+               job.clearColor.a);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  queue.begin(job.view, job.projection);
+  queue.gather(*job.scene);
+  queue.sort();
+  queue.submit();
+  if (resolved != target) {
+    target->blitQuick(*resolved);
+  }
+
+  readback.read(*resolved, [this, path = job.path](ReadbackImage&& image) {
+    if (writeImage(path, image.width, image.height, image.channels,
+                   image.pixels.data())) {
+      written++;
+    } else {
+      failed++;
+    }
+  });
+  readback.poll();
+  // The readback copied the pixels, the targets can serve the next job
+  targets.endFrame();
+}
+
+size_t BatchRenderer::getPending() const noexcept { return jobs.size(); }
+
+BatchRenderer::Stats BatchRenderer::getStats() const
+{
+  Stats stats;
+  stats.jobs = rendered;
+  stats.written = written;
+  stats.failed = failed;
+  stats.renderMs = renderMs;
+  stats.targets = targets.getStats();
+  stats.readback = readback.getStats();
+  return stats;
+}
+
+}  // namespace agt3d
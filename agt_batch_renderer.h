@@ -0,0 +1,76 @@
+#pragma once
+
+#include "agt_readback.h"
+#include "agt_render_queue.h"
+#include "agt_render_target_pool.h"
+
+namespace agt3d
+{
+
+class Scene;
+
+/**
+ * @brief One image rendered by BatchRenderer.
+ */
+struct RenderJob {
+  /// Must stay alive until BatchRenderer::run() returns.
+  agt3d::Scene* scene = nullptr;
+  glm::mat4 view = glm::mat4(1);
+  glm::mat4 projection = glm::mat4(1);
+  int width = 256;
+  int height = 256;
+  glm::vec4 clearColor = {0, 0, 0, 0};
+  /// Written with writeImage(), the extension picks the format.
+  std::string path;
+};
+
+/**
+ * @brief Renders a queue of scene views into FBOs and writes them as images,
+ * e.g. thumbnails on a server with a HeadlessContext.
+ *
+ * All jobs share one RenderQueue, one RenderTargetPool and one AsyncReadback,
+ * so GL objects are created once per target size and reused for every
+ * following job. Jobs are multisampled and resolved before the readback;
+ * encoding and writing the files happens on the readback worker thread
+ * while the next jobs render. Needs a current GL context.
+ */
+class BatchRenderer
+{
+ public:
+  struct Stats {
+    size_t jobs = 0;
+    size_t written = 0;
+    size_t failed = 0;
+    double renderMs = 0;
+    agt3d::RenderTargetPool::Stats targets;
+    agt3d::AsyncReadback::Stats readback;
+  };
+
+  /**
+   * @param samples MSAA samples, 0 to render without multisampling.
+   */
+  explicit BatchRenderer(int _samples = 4, size_t readbackSlots = 3);
+  void add(const agt3d::RenderJob& job);
+  /**
+   * @brief Render all queued jobs, returns once every image is written.
+   */
+  void run();
+  size_t getPending() const noexcept;
+  Stats getStats() const;
+
+ private:
+  void render(const agt3d::RenderJob& job);
+
+ private:
+  std::deque<agt3d::RenderJob> jobs;
+  agt3d::RenderQueue queue;
+  agt3d::RenderTargetPool targets;
+  agt3d::AsyncReadback readback;
+  int samples;
+  size_t rendered = 0;
+  double renderMs = 0;
+  std::atomic<size_t> written = 0;
+  std::atomic<size_t> failed = 0;
+};
+
+}  // namespace agt3d
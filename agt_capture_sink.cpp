@@ -0,0 +1,161 @@
+#include "agt_capture_sink.h"
+
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+using Clock = std::chrono::steady_clock;
+
+static double millisecondsSince(Clock::time_point start)
+{
+  return std::chrono::duration<double, std::milli>(Clock::now() - start)
+    .count();
+}
+
+CaptureSink::CaptureSink(const std::filesystem::path& _directory,
+                         const std::string& _prefix, ImageCodec _codec,
+                         size_t _capacity, size_t encoderCount,
+                         Overflow _overflow)
+    : directory(_directory),
+      prefix(_prefix),
+      codec(_codec),
+      capacity(std::max<size_t>(1, _capacity)),
+      overflow(_overflow)
+{
+  std::error_code error;
+  std::filesystem::create_directories(directory, error);
+  if (encoderCount == 0) {
+    encoderCount = std::max(2u, std::thread::hardware_concurrency()) - 1;
+  }
+  for (size_t i = 0; i < encoderCount; i++) {
+    encoders.emplace_back([this]() { encode(); });
+  }
+  writer = std::thread([this]() { write(); });
+}
+
+CaptureSink::~CaptureSink()
+{
+  finish();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  work.notify_all();
+  encoded.notify_all();
+  for (auto& encoder : encoders) {
+    encoder.join();
+  }
+  writer.join();
+}
+
+bool CaptureSink::submit(ReadbackImage&& image)
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  stats.submitted++;
+  if (inFlight >= capacity) {
+    if (overflow == Overflow::DROP) {
+      stats.dropped++;
+      return false;
+    }
+    auto start = Clock::now();
+    space.wait(lock, [this]() { return inFlight < capacity; });
+    stats.blocked++;
+    stats.blockedMs += millisecondsSince(start);
+  }
+  inFlight++;
+  stats.highWater = std::max(stats.highWater, inFlight);
+  queue.push_back({nextNumber++, std::move(image)});
+  lock.unlock();
+  work.notify_one();
+  return true;
+}
+
+void CaptureSink::finish()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  space.wait(lock, [this]() { return inFlight == 0; });
+}
+
+CaptureSink::Stats CaptureSink::getStats() const
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  return stats;
+}
+
+void CaptureSink::encode()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    work.wait(lock, [this]() { return stopping || !queue.empty(); });
+    if (queue.empty()) {
+      return;
+    }
+    Frame frame = std::move(queue.front());
+    queue.pop_front();
+    lock.unlock();
+
+    auto start = Clock::now();
+    std::vector<uint8_t> file;
+    const auto& image = frame.image;
+    if (!encodeImage(codec, image.width, image.height, image.channels,
+                     image.pixels.data(), file)) {
+      // An empty file tells the writer to skip the frame
+      file.clear();
+    }
+    double ms = millisecondsSince(start);
+
+    lock.lock();
+    stats.encodeMs += ms;
+    files.emplace(frame.number, std::move(file));
+    encoded.notify_one();
+  }
+}
+
+void CaptureSink::write()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    encoded.wait(lock, [this]() {
+      return files.count(nextWrite) || (stopping && inFlight == 0);
+    });
+    auto it = files.find(nextWrite);
+    if (it == files.end()) {
+      return;
+    }
+    std::vector<uint8_t> file = std::move(it->second);
+    files.erase(it);
+    lock.unlock();
+
+    auto start = Clock::now();
+    std::ostringstream name;
+    name << prefix << std::setw(6) << std::setfill('0') << nextWrite
+         << getExtension(codec);
+    bool ok = !file.empty();
+    if (ok) {
+      std::ofstream fp(directory / name.str(),
+                       std::ios::out | std::ios::binary);
+      fp.write(reinterpret_cast<const char*>(file.data()), file.size());
+      ok = fp.good();
+    }
+    if (!ok) {
+      std::cerr << "CaptureSink: failed to write " << name.str() << std::endl;
+    }
+    double ms = millisecondsSince(start);
+
+    lock.lock();
+    stats.writeMs += ms;
+    if (ok) {
+      stats.written++;
+      stats.bytesWritten += file.size();
+    } else {
+      stats.failed++;
+    }
+    nextWrite++;
+    inFlight--;
+    space.notify_all();
+  }
+}
+
+}  // namespace agt3d
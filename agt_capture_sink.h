@@ -0,0 +1,97 @@
+#pragma once
+
+#include "agt_readback.h"
+#include "agt_texture.h"
+
+namespace agt3d
+{
+
+/**
+ * @brief Encodes captured frames on a pool of threads and writes them to
+ * numbered files in submission order.
+ *
+ * Frames go through a bounded pipeline: submit() hands a frame over, encoder
+ * threads turn it into PNG or QOI in memory, and a single writer thread
+ * stores the files one after the other, named prefix + 6-digit frame number
+ * + extension. At most capacity frames are between submit() and their file
+ * being written. When the pipeline is full submit() waits (BLOCK) or drops
+ * the frame (DROP); both are counted, so the stats show whether the encoders
+ * or the disk keep up. Suited as the AsyncReadback callback.
+ */
+class CaptureSink
+{
+ public:
+  enum class Overflow { BLOCK, DROP };
+
+  struct Stats {
+    size_t submitted = 0;
+    size_t written = 0;
+    size_t dropped = 0;
+    size_t failed = 0;
+    /// submit() calls that had to wait for space, and how long in total.
+    size_t blocked = 0;
+    double blockedMs = 0;
+    /// Most frames in the pipeline at once.
+    size_t highWater = 0;
+    double encodeMs = 0;
+    double writeMs = 0;
+    size_t bytesWritten = 0;
+  };
+
+  /**
+   * @param encoderCount 0 for one less than the hardware concurrency.
+   */
+  CaptureSink(const std::filesystem::path& _directory,
+              const std::string& _prefix,
+              agt3d::ImageCodec _codec = agt3d::ImageCodec::PNG,
+              size_t _capacity = 8, size_t encoderCount = 0,
+              Overflow _overflow = Overflow::BLOCK);
+  /**
+   * @brief Writes the frames still in the pipeline.
+   */
+  ~CaptureSink();
+  CaptureSink& operator=(const CaptureSink& other) = delete;
+  CaptureSink(CaptureSink&) = delete;
+
+  /**
+   * @brief Queue an RGB or RGBA frame, top row first.
+   * @return false if it was dropped.
+   */
+  bool submit(agt3d::ReadbackImage&& image);
+  /**
+   * @brief Wait until every submitted frame is written.
+   */
+  void finish();
+  Stats getStats() const;
+
+ private:
+  struct Frame {
+    uint64_t number = 0;
+    agt3d::ReadbackImage image;
+  };
+  void encode();
+  void write();
+
+ private:
+  std::filesystem::path directory;
+  std::string prefix;
+  agt3d::ImageCodec codec;
+  size_t capacity;
+  Overflow overflow;
+
+  mutable std::mutex mutex;
+  std::condition_variable work;
+  std::condition_variable encoded;
+  std::condition_variable space;
+  std::deque<Frame> queue;
+  std::map<uint64_t, std::vector<uint8_t>> files;
+  uint64_t nextNumber = 0;
+  uint64_t nextWrite = 0;
+  size_t inFlight = 0;
+  bool stopping = false;
+  Stats stats;
+  std::vector<std::thread> encoders;
+  std::thread writer;
+};
+
+}  // namespace agt3d
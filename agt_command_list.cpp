@@ -0,0 +1,519 @@
+#include "agt_command_list.h"
+
+#include "agt_gl_state.h"
+#include "agt_material.h"
+#include "agt_mesh.h"
+#include "agt_object.h"
+#include "agt_object_instance.h"
+#include "agt_scene.h"
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+static constexpr UniformId viewId("view");
+static constexpr UniformId projectionId("projection");
+static constexpr UniformId modelId("model");
+static constexpr UniformId colorId("color");
+static constexpr UniformId borderRadiusId("borderRadius");
+static constexpr UniformId borderColorId("borderColor");
+
+static_assert(std::is_trivially_copyable_v<shader_param_t>);
+
+struct TextureCommand {
+  GLuint unit;
+  GLenum target;
+  GLuint texture;
+};
+
+struct EnableCommand {
+  GLenum cap;
+  bool enabled;
+};
+
+struct BlendCommand {
+  GLenum src;
+  GLenum dst;
+};
+
+struct UniformCommand {
+  const Shader* shader;
+  uint64_t id;
+  shader_param_t value;
+};
+
+struct MaterialBlockCommand {
+  Material* material;
+  const Shader* shader;
+};
+
+struct DrawArraysCommand {
+  GLenum mode;
+  GLint first;
+  GLsizei count;
+  GLsizei instanceCount;
+};
+
+struct DrawElementsCommand {
+  GLenum mode;
+  GLsizei count;
+  GLuint firstIndex;
+  GLint baseVertex;
+  GLsizei instanceCount;
+};
+
+template <typename T>
+void CommandList::push(Op op, const T& payload)
+{
+  static_assert(std::is_trivially_copyable_v<T>);
+  size_t at = stream.size();
+  stream.resize(at + 1 + sizeof(T));
+  stream[at] = static_cast<uint8_t>(op);
+  memcpy(stream.data() + at + 1, &payload, sizeof(T));
+  commandCount++;
+}
+
+void CommandList::clear()
+{
+  stream.clear();
+  objectBlocks.clear();
+  commandCount = 0;
+  drawCount = 0;
+}
+
+void CommandList::useProgram(const Shader& shader)
+{
+  push(Op::USE_PROGRAM, &shader);
+}
+
+void CommandList::bindVertexArray(GLuint vao) { push(Op::BIND_VAO, vao); }
+
+void CommandList::bindTexture(GLuint unit, GLenum target, GLuint texture)
+{
+  push(Op::BIND_TEXTURE, TextureCommand{unit, target, texture});
+}
+
+void CommandList::setEnabled(GLenum cap, bool enabled)
+{
+  push(Op::SET_ENABLED, EnableCommand{cap, enabled});
+}
+
+void CommandList::blendFunc(GLenum src, GLenum dst)
+{
+  push(Op::BLEND_FUNC, BlendCommand{src, dst});
+}
+
+void CommandList::lineWidth(float width) { push(Op::LINE_WIDTH, width); }
+
+void CommandList::setUniform(const Shader& shader, UniformId id,
+                             const shader_param_t& value)
+{
+  if (!hasUniform(shader, id)) {
+    return;
+  }
+  push(Op::SET_UNIFORM, UniformCommand{&shader, id.hash, value});
+}
+
+void CommandList::bindMaterialBlock(Material& material, const Shader& shader)
+{
+  push(Op::BIND_MATERIAL_BLOCK, MaterialBlockCommand{&material, &shader});
+}
+
+void CommandList::bindObjectBlock(const ObjectBlock& block)
+{
+  push(Op::BIND_OBJECT_BLOCK, static_cast<uint32_t>(objectBlocks.size()));
+  objectBlocks.push_back(block);
+}
+
+void CommandList::draw(const Mesh& mesh, GLenum mode, GLsizei instanceCount)
+{
+  auto count = static_cast<GLsizei>(mesh.getIndexCount());
+  if (count == 0) {
+    push(Op::DRAW_ARRAYS,
+         DrawArraysCommand{mode, static_cast<GLint>(mesh.baseVertex),
+                           static_cast<GLsizei>(mesh.getVertexCount()),
+                           instanceCount});
+  } else {
+    push(Op::DRAW_ELEMENTS,
+         DrawElementsCommand{mode, count, mesh.firstIndex,
+                             static_cast<GLint>(mesh.baseVertex),
+                             instanceCount});
+  }
+  drawCount++;
+}
+
+size_t CommandList::getCommandCount() const noexcept { return commandCount; }
+
+size_t CommandList::getDrawCount() const noexcept { return drawCount; }
+
+size_t CommandList::getByteSize() const noexcept
+{
+  return stream.size() + objectBlocks.size() * sizeof(ObjectBlock);
+}
+
+template <typename T>
+static T read(const uint8_t*& p) noexcept
+{
+  T value;
+  memcpy(&value, p, sizeof(T));
+  p += sizeof(T);
+  return value;
+}
+
+void CommandReplay::setFrame(const FrameBlock& frame)
+{
+  frameBuffer.update(&frame, sizeof(FrameBlock));
+  frameBuffer.bind(frameBlockBinding);
+}
+
+void CommandReplay::execute(const CommandList& list)
+{
+  size_t objectBase = 0;
+  size_t objectStride = 0;
+  if (!list.objectBlocks.empty()) {
+    objectBase = objectRing.write(list.objectBlocks.data(), sizeof(ObjectBlock),
+                                  list.objectBlocks.size());
+    objectStride = objectRing.getStride(sizeof(ObjectBlock));
+  }
+
+  using Op = CommandList::Op;
+  const uint8_t* p = list.stream.data();
+  const uint8_t* end = p + list.stream.size();
+  while (p < end) {
+    auto op = static_cast<Op>(*p++);
+    switch (op) {
+      case Op::USE_PROGRAM: {
+        auto shader = read<const Shader*>(p);
+        GlState::useProgram(shader->program);
+        if (std::find(programsWithBlocks.begin(), programsWithBlocks.end(),
+                      shader->program) == programsWithBlocks.end()) {
+          bindUniformBlock(*shader, "Frame", frameBlockBinding);
+          bindUniformBlock(*shader, "Object", objectBlockBinding);
+          programsWithBlocks.push_back(shader->program);
+        }
+        break;
+      }
+      case Op::BIND_VAO:
+        GlState::bindVertexArray(read<GLuint>(p));
+        break;
+      case Op::BIND_TEXTURE: {
+        auto cmd = read<TextureCommand>(p);
+        GlState::bindTexture(cmd.target, cmd.texture, cmd.unit);
+        break;
+      }
+      case Op::SET_ENABLED: {
+        auto cmd = read<EnableCommand>(p);
+        GlState::setEnabled(cmd.cap, cmd.enabled);
+        break;
+      }
+      case Op::BLEND_FUNC: {
+        auto cmd = read<BlendCommand>(p);
+        GlState::blendFunc(cmd.src, cmd.dst);
+        break;
+      }
+      case Op::LINE_WIDTH:
+        glLineWidth(read<float>(p));
+        break;
+      case Op::SET_UNIFORM: {
+        auto cmd = read<UniformCommand>(p);
+        agt3d::setUniform(*cmd.shader, UniformId(cmd.id), cmd.value);
+        break;
+      }
+      case Op::BIND_MATERIAL_BLOCK: {
+        auto cmd = read<MaterialBlockCommand>(p);
+        materialBlocks.bind(*cmd.material, *cmd.shader);
+        break;
+      }
+      case Op::BIND_OBJECT_BLOCK: {
+        auto index = read<uint32_t>(p);
+        objectRing.bind(objectBlockBinding, objectBase + index * objectStride,
+                        sizeof(ObjectBlock));
+        break;
+      }
+      case Op::DRAW_ARRAYS: {
+        auto cmd = read<DrawArraysCommand>(p);
+        if (cmd.instanceCount == 1) {
+          glDrawArrays(cmd.mode, cmd.first, cmd.count);
+        } else {
+          glDrawArraysInstanced(cmd.mode, cmd.first, cmd.count,
+                                cmd.instanceCount);
+        }
+        break;
+      }
+      case Op::DRAW_ELEMENTS: {
+        auto cmd = read<DrawElementsCommand>(p);
+        auto offset = reinterpret_cast<const GLvoid*>(cmd.firstIndex *
+                                                      sizeof(unsigned int));
+        if (cmd.instanceCount == 1) {
+          glDrawElementsBaseVertex(cmd.mode, cmd.count, GL_UNSIGNED_INT,
+                                   offset, cmd.baseVertex);
+        } else {
+          glDrawElementsInstancedBaseVertex(cmd.mode, cmd.count,
+                                            GL_UNSIGNED_INT, offset,
+                                            cmd.instanceCount, cmd.baseVertex);
+        }
+        break;
+      }
+      default:
+        MY_ABORT("Corrupt command list");
+    }
+  }
+}
+
+void CommandReplay::execute(const std::vector<CommandList>& lists)
+{
+  for (const auto& list : lists) {
+    execute(list);
+  }
+  checkOpenGLErrors();
+}
+
+void SceneRecorder::record(Scene& scene, const glm::mat4& view,
+                           const glm::mat4& projection, unsigned threads)
+{
+  auto t0 = std::chrono::steady_clock::now();
+  stats = Stats();
+  stats.instances = scene.ois.size();
+  frame.view = view;
+  frame.projection = projection;
+  frame.viewProjection = projection * view;
+  frame.cameraPosition = glm::inverse(view)[3];
+  frustum = Frustum(frame.viewProjection);
+
+  // Serial: transforms and bounds are cached lazily in the instances
+  scene.updateWorldBounds();
+  snapshots.clear();
+  for (auto& oi : scene.ois) {
+    if (!oi->isEnabled() || !oi->isRenderable()) {
+      continue;
+    }
+    auto obj = oi->getObject();
+    Snapshot snapshot;
+    snapshot.oi = oi.get();
+    snapshot.mesh = obj->getMesh();
+    snapshot.material = obj->getMaterial();
+    if (!snapshot.mesh || !snapshot.material ||
+        !snapshot.material->getShader()) {
+      continue;
+    }
+    snapshot.shader = snapshot.material->getShader();
+    snapshot.technique = &oi->getRenderTechnique();
+    snapshot.model = oi->getTm();
+    snapshot.bounds = oi->getWorldAABB();
+    snapshot.center = oi->getBoundingSphere().center;
+    snapshot.pass = getRenderPass(*snapshot.technique);
+    snapshots.push_back(snapshot);
+  }
+  auto t1 = std::chrono::steady_clock::now();
+
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  lists.resize(threads + 1);
+  for (auto& list : lists) {
+    list.clear();
+  }
+  size_t chunk = (snapshots.size() + threads - 1) / threads;
+  std::vector<size_t> culled(threads, 0);
+  std::vector<std::vector<uint32_t>> solid(threads);
+  std::vector<std::vector<uint32_t>> deferred(threads);
+  auto work = [this, &solid, &deferred, &culled](unsigned t, size_t begin,
+                                                 size_t end) {
+    cullSlice(begin, end, solid[t], deferred[t], culled[t]);
+    // Group state within the slice, the lists are replayed one after another
+    sortByState(solid[t]);
+    recordDraws(lists[t], solid[t]);
+  };
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; t++) {
+    size_t begin = std::min(snapshots.size(), t * chunk);
+    size_t end = std::min(snapshots.size(), begin + chunk);
+    workers.emplace_back(work, t, begin, end);
+  }
+  work(0, 0, std::min(snapshots.size(), chunk));
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  recordDeferred(deferred);
+  auto t2 = std::chrono::steady_clock::now();
+
+  for (unsigned t = 0; t < threads; t++) {
+    stats.culled += culled[t];
+  }
+  for (const auto& list : lists) {
+    stats.draws += list.getDrawCount();
+    stats.commands += list.getCommandCount();
+  }
+  stats.snapshotMs =
+    std::chrono::duration<double, std::milli>(t1 - t0).count();
+  stats.recordMs = std::chrono::duration<double, std::milli>(t2 - t1).count();
+}
+
+void SceneRecorder::cullSlice(size_t begin, size_t end,
+                              std::vector<uint32_t>& solid,
+                              std::vector<uint32_t>& deferred,
+                              size_t& culled) const
+{
+  solid.clear();
+  deferred.clear();
+  for (size_t i = begin; i < end; i++) {
+    if (!frustum.intersects(snapshots[i].bounds)) {
+      culled++;
+    } else if (snapshots[i].pass == RenderPass::SOLID) {
+      solid.push_back(static_cast<uint32_t>(i));
+    } else {
+      deferred.push_back(static_cast<uint32_t>(i));
+    }
+  }
+}
+
+void SceneRecorder::sortByState(std::vector<uint32_t>& indices) const
+{
+  std::sort(indices.begin(), indices.end(), [this](uint32_t a, uint32_t b) {
+    const auto& sa = snapshots[a];
+    const auto& sb = snapshots[b];
+    return std::make_tuple(sa.shader->program, sa.material,
+                           sa.mesh->getVertexArray(), a) <
+           std::make_tuple(sb.shader->program, sb.material,
+                           sb.mesh->getVertexArray(), b);
+  });
+}
+
+void SceneRecorder::recordDeferred(std::vector<std::vector<uint32_t>>& deferred)
+{
+  // Slices are in scene order, which keeps the sorter's ids stable for its
+  // frame coherence
+  blended.clear();
+  overlay.clear();
+  for (const auto& slice : deferred) {
+    for (auto index : slice) {
+      auto& target =
+        snapshots[index].pass == RenderPass::BLENDED ? blended : overlay;
+      target.push_back(index);
+    }
+  }
+  stats.blended = blended.size();
+
+  blendedIds.resize(blended.size());
+  blendedCenters.resize(blended.size());
+  for (size_t i = 0; i < blended.size(); i++) {
+    blendedIds[i] = reinterpret_cast<uintptr_t>(snapshots[blended[i]].oi);
+    blendedCenters[i] = snapshots[blended[i]].center;
+  }
+  const auto& sorted = depthSorter.sort(blendedIds, blendedCenters, frame.view);
+
+  // Far to near, then the overlays
+  deferredOrder.clear();
+  for (auto i : sorted) {
+    deferredOrder.push_back(blended[i]);
+  }
+  sortByState(overlay);
+  deferredOrder.insert(deferredOrder.end(), overlay.begin(), overlay.end());
+  recordDraws(lists.back(), deferredOrder);
+}
+
+void SceneRecorder::recordDraws(CommandList& list,
+                                const std::vector<uint32_t>& indices) const
+{
+  constexpr GLuint unknown = std::numeric_limits<GLuint>::max();
+  GLuint program = unknown;
+  GLuint vao = unknown;
+  const Material* material = nullptr;
+  int depthTest = -1;
+  int blend = -1;
+  std::pair<GLenum, GLenum> blendMode = {unknown, unknown};
+  float lineWidth = -1.0f;
+  bool pointSize = false;
+
+  for (auto index : indices) {
+    const auto& s = snapshots[index];
+    const auto& technique = *s.technique;
+    const auto& shader = *s.shader;
+
+    if (depthTest != !technique.disableDepthTest) {
+      depthTest = !technique.disableDepthTest;
+      list.setEnabled(GL_DEPTH_TEST, depthTest);
+    }
+    if (blend != technique.enableAlphaBlending) {
+      blend = technique.enableAlphaBlending;
+      list.setEnabled(GL_BLEND, blend);
+    }
+    if (technique.enableAlphaBlending &&
+        blendMode != std::make_pair(GLenum(technique.alphaSrc),
+                                    GLenum(technique.alphaDst))) {
+      blendMode = {technique.alphaSrc, technique.alphaDst};
+      list.blendFunc(blendMode.first, blendMode.second);
+    }
+
+    if (shader.program != program) {
+      list.useProgram(shader);
+      list.setUniform(shader, viewId, frame.view);
+      list.setUniform(shader, projectionId, frame.projection);
+      program = shader.program;
+      material = nullptr;
+    }
+
+    if (s.material != material) {
+      if (hasUniformBlock(shader, "Material")) {
+        list.bindMaterialBlock(*s.material, shader);
+      }
+      for (auto& [name, param] : s.material->getShaderParams()) {
+        list.setUniform(shader, name, param.second);
+      }
+      const auto& textures = s.material->textures;
+      for (size_t unit = 0; unit < textures.size(); unit++) {
+        list.bindTexture(static_cast<GLuint>(unit), GL_TEXTURE_2D,
+                         textures[unit]->getTexture());
+        list.setUniform(shader, textures[unit]->getType(),
+                        static_cast<int>(unit));
+      }
+      material = s.material;
+    }
+
+    list.setUniform(shader, colorId, technique.color);
+    list.setUniform(shader, borderRadiusId, technique.borderRadius);
+    list.setUniform(shader, borderColorId, technique.borderColor);
+
+    GLuint meshVao = s.mesh->getVertexArray();
+    if (meshVao != vao) {
+      list.bindVertexArray(meshVao);
+      vao = meshVao;
+    }
+
+    GLenum mode = toGlPrimitive(technique.primitiveType);
+    if (mode == GL_POINTS && !pointSize) {
+      list.setEnabled(GL_PROGRAM_POINT_SIZE, true);
+      pointSize = true;
+    }
+    if ((mode == GL_LINES || mode == GL_LINE_STRIP) &&
+        technique.lineWidth != lineWidth) {
+      list.lineWidth(technique.lineWidth);
+      lineWidth = technique.lineWidth;
+    }
+
+    if (hasUniformBlock(shader, "Object")) {
+      list.bindObjectBlock({s.model, technique.color});
+    } else {
+      list.setUniform(shader, modelId, s.model);
+    }
+    list.draw(*s.mesh, mode);
+  }
+  if (pointSize) {
+    list.setEnabled(GL_PROGRAM_POINT_SIZE, false);
+  }
+}
+
+const std::vector<CommandList>& SceneRecorder::getLists() const noexcept
+{
+  return lists;
+}
+
+const FrameBlock& SceneRecorder::getFrame() const noexcept { return frame; }
+
+const SceneRecorder::Stats& SceneRecorder::getStats() const noexcept
+{
+  return stats;
+}
+
+}  // namespace agt3d
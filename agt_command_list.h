@@ -0,0 +1,187 @@
+#pragma once
+
+#include "agt_AABB.h"
+#include "agt_depth_sorter.h"
+#include "agt_glsl_shader.h"
+#include "agt_render_queue.h"
+#include "agt_uniform_buffer.h"
+
+namespace agt3d
+{
+
+class Mesh;
+class Material;
+class Scene;
+class ObjectInstance;
+class RenderTechnique;
+
+/**
+ * @brief Draw commands recorded without a GL context, replayed later by
+ * CommandReplay on the GL thread.
+ *
+ * Recording only reads CPU side data (uniform tables, mesh counts, VAO
+ * names), so several lists can be recorded in parallel as long as nothing
+ * they reference changes before the replay. Commands are packed into one
+ * byte stream as an opcode followed by a fixed-size payload.
+ */
+class CommandList
+{
+ public:
+  void clear();
+  void useProgram(const agt3d::Shader& shader);
+  void bindVertexArray(GLuint vao);
+  void bindTexture(GLuint unit, GLenum target, GLuint texture);
+  void setEnabled(GLenum cap, bool enabled);
+  void blendFunc(GLenum src, GLenum dst);
+  void lineWidth(float width);
+  /**
+   * @brief Set a uniform of the program in use at this point of the list.
+   * Uniforms the shader doesn't have are not recorded.
+   */
+  void setUniform(const agt3d::Shader& shader, agt3d::UniformId id,
+                  const agt3d::shader_param_t& value);
+  /**
+   * @brief Bind the Material block of a material, built on replay.
+   */
+  void bindMaterialBlock(agt3d::Material& material,
+                         const agt3d::Shader& shader);
+  /**
+   * @brief Bind an Object block, all blocks of a list are uploaded with one
+   * write on replay.
+   */
+  void bindObjectBlock(const agt3d::ObjectBlock& block);
+  /**
+   * @brief Draw a mesh with the current VAO, which must be the mesh's.
+   */
+  void draw(const agt3d::Mesh& mesh, GLenum mode, GLsizei instanceCount = 1);
+  size_t getCommandCount() const noexcept;
+  size_t getDrawCount() const noexcept;
+  size_t getByteSize() const noexcept;
+
+ private:
+  enum class Op : uint8_t {
+    USE_PROGRAM,
+    BIND_VAO,
+    BIND_TEXTURE,
+    SET_ENABLED,
+    BLEND_FUNC,
+    LINE_WIDTH,
+    SET_UNIFORM,
+    BIND_MATERIAL_BLOCK,
+    BIND_OBJECT_BLOCK,
+    DRAW_ARRAYS,
+    DRAW_ELEMENTS
+  };
+  template <typename T>
+  void push(Op op, const T& payload);
+
+ private:
+  std::vector<uint8_t> stream;
+  std::vector<agt3d::ObjectBlock> objectBlocks;
+  size_t commandCount = 0;
+  size_t drawCount = 0;
+
+  friend class CommandReplay;
+};
+
+/**
+ * @brief Executes command lists on the GL thread through GlState and owns
+ * the buffers their uniform blocks need.
+ */
+class CommandReplay
+{
+ public:
+  /**
+   * @brief Upload the Frame block and bind it to frameBlockBinding.
+   */
+  void setFrame(const agt3d::FrameBlock& frame);
+  void execute(const agt3d::CommandList& list);
+  void execute(const std::vector<agt3d::CommandList>& lists);
+
+ private:
+  agt3d::UniformBuffer frameBuffer;
+  agt3d::UniformRing objectRing;
+  agt3d::MaterialBlocks materialBlocks;
+  std::vector<GLuint> programsWithBlocks;
+};
+
+/**
+ * @brief Records the draws of a scene into one command list per worker
+ * thread, plus a last list for blended and overlay draws.
+ *
+ * Transforms and world bounds are evaluated on the calling thread first,
+ * since ObjectInstance caches them lazily. The workers then cull their slice
+ * of Scene::ois against the frustum, sort the solid instances (see
+ * agt3d::RenderPass) by program, material and VAO, and record them the way
+ * RenderQueue submits: the uniforms view, projection, model, color,
+ * borderRadius and borderColor, material params and textures, and the Frame,
+ * Material and Object blocks when a shader declares them.
+ *
+ * Blended and overlay instances need one order over the whole scene, so the
+ * calling thread records them into the last list after the workers are
+ * done: blended ones back to front with a DepthSorter, then overlays grouped
+ * by state. Replaying the lists in order draws every visible instance once,
+ * in the pass order of RenderQueue.
+ */
+class SceneRecorder
+{
+ public:
+  struct Stats {
+    size_t instances = 0;
+    size_t culled = 0;
+    size_t draws = 0;
+    size_t commands = 0;
+    size_t blended = 0;
+    double snapshotMs = 0;
+    double recordMs = 0;
+  };
+
+  /**
+   * @param threads number of workers and solid lists, 0 for the hardware
+   * concurrency.
+   */
+  void record(agt3d::Scene& scene, const glm::mat4& view,
+              const glm::mat4& projection, unsigned threads = 0);
+  const std::vector<agt3d::CommandList>& getLists() const noexcept;
+  const agt3d::FrameBlock& getFrame() const noexcept;
+  const Stats& getStats() const noexcept;
+
+ private:
+  struct Snapshot {
+    const agt3d::ObjectInstance* oi = nullptr;
+    agt3d::Mesh* mesh = nullptr;
+    agt3d::Material* material = nullptr;
+    agt3d::Shader* shader = nullptr;
+    const agt3d::RenderTechnique* technique = nullptr;
+    glm::mat4 model;
+    agt3d::AABB bounds;
+    /// Bounding sphere center in world space.
+    glm::vec3 center = {0, 0, 0};
+    agt3d::RenderPass pass = agt3d::RenderPass::SOLID;
+  };
+  /**
+   * @brief Cull a slice of the snapshots, visible solid ones go to solid and
+   * the others to deferred.
+   */
+  void cullSlice(size_t begin, size_t end, std::vector<uint32_t>& solid,
+                 std::vector<uint32_t>& deferred, size_t& culled) const;
+  void sortByState(std::vector<uint32_t>& indices) const;
+  void recordDraws(agt3d::CommandList& list,
+                   const std::vector<uint32_t>& indices) const;
+  void recordDeferred(std::vector<std::vector<uint32_t>>& deferred);
+
+ private:
+  agt3d::FrameBlock frame;
+  agt3d::Frustum frustum;
+  std::vector<Snapshot> snapshots;
+  std::vector<agt3d::CommandList> lists;
+  agt3d::DepthSorter depthSorter;
+  std::vector<uint32_t> blended;
+  std::vector<uint32_t> overlay;
+  std::vector<uintptr_t> blendedIds;
+  std::vector<glm::vec3> blendedCenters;
+  std::vector<uint32_t> deferredOrder;
+  Stats stats;
+};
+
+}  // namespace agt3d
@@ -0,0 +1,131 @@
+#include "agt_depth_sorter.h"
+
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+static constexpr uint32_t radixBits = 11;
+static constexpr uint32_t radixSize = 1u << radixBits;
+static constexpr uint32_t radixMask = radixSize - 1;
+
+/**
+ * @brief Key that sorts far before near, the float bits made unsigned
+ * comparable and inverted.
+ */
+static uint32_t farToNearKey(float depth) noexcept
+{
+  uint32_t bits;
+  memcpy(&bits, &depth, sizeof(bits));
+  uint32_t ascending = (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+  return ~ascending;
+}
+
+const std::vector<uint32_t>& DepthSorter::sort(
+  std::span<const uintptr_t> ids, std::span<const glm::vec3> centers,
+  const glm::mat4& view)
+{
+  MY_ASSERT(ids.size() == centers.size(), "DepthSorter: size mismatch");
+  auto t0 = std::chrono::steady_clock::now();
+  const size_t count = ids.size();
+  stats = Stats();
+  stats.points = count;
+
+  depths.resize(count);
+  keys.resize(count);
+  const glm::vec4 row = {view[0][2], view[1][2], view[2][2], view[3][2]};
+  for (size_t i = 0; i < count; i++) {
+    const auto& c = centers[i];
+    float depth = -(row.x * c.x + row.y * c.y + row.z * c.z + row.w);
+    depths[i] = depth;
+    keys[i] = farToNearKey(depth);
+  }
+
+  stats.coherent = order.size() == count && previousIds.size() == count &&
+                   std::equal(ids.begin(), ids.end(), previousIds.begin());
+  if (!stats.coherent) {
+    order.resize(count);
+    std::iota(order.begin(), order.end(), 0u);
+  }
+  if (!stats.coherent || !repair()) {
+    radixSort();
+    stats.radixSorted = true;
+  }
+  previousIds.assign(ids.begin(), ids.end());
+  stats.ms = std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - t0)
+               .count();
+  return order;
+}
+
+bool DepthSorter::repair()
+{
+  const size_t budget = order.size() + 64;
+  for (size_t i = 1; i < order.size(); i++) {
+    uint32_t index = order[i];
+    uint32_t key = keys[index];
+    size_t j = i;
+    while (j > 0 && keys[order[j - 1]] > key) {
+      order[j] = order[j - 1];
+      j--;
+      if (++stats.moves > budget) {
+        order[j] = index;
+        return false;
+      }
+    }
+    order[j] = index;
+  }
+  return true;
+}
+
+void DepthSorter::radixSort()
+{
+  const size_t count = order.size();
+  sortKeys.resize(count);
+  sortKeysTemp.resize(count);
+  orderTemp.resize(count);
+  std::array<uint32_t, 3 * radixSize> histograms{};
+  for (size_t i = 0; i < count; i++) {
+    uint32_t key = keys[order[i]];
+    sortKeys[i] = key;
+    histograms[key & radixMask]++;
+    histograms[radixSize + ((key >> radixBits) & radixMask)]++;
+    histograms[2 * radixSize + (key >> (2 * radixBits))]++;
+  }
+
+  for (uint32_t pass = 0; pass < 3; pass++) {
+    uint32_t* histogram = histograms.data() + pass * radixSize;
+    uint32_t shift = pass * radixBits;
+    // Skip digits that are the same in every key
+    if (count == 0 || histogram[(sortKeys[0] >> shift) & radixMask] == count) {
+      continue;
+    }
+    uint32_t offset = 0;
+    for (uint32_t d = 0; d < radixSize; d++) {
+      uint32_t n = histogram[d];
+      histogram[d] = offset;
+      offset += n;
+    }
+    for (size_t i = 0; i < count; i++) {
+      uint32_t key = sortKeys[i];
+      uint32_t dst = histogram[(key >> shift) & radixMask]++;
+      sortKeysTemp[dst] = key;
+      orderTemp[dst] = order[i];
+    }
+    sortKeys.swap(sortKeysTemp);
+    order.swap(orderTemp);
+  }
+}
+
+const std::vector<float>& DepthSorter::getDepths() const noexcept
+{
+  return depths;
+}
+
+const DepthSorter::Stats& DepthSorter::getStats() const noexcept
+{
+  return stats;
+}
+
+}  // namespace agt3d
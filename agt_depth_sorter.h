@@ -0,0 +1,65 @@
+#pragma once
+
+#include "agt_stdafx.h"
+
+namespace agt3d
+{
+
+/**
+ * @brief Sorts points back to front by their exact view depth.
+ *
+ * Depths of all points are computed in one loop, turned into 32-bit keys
+ * that order like the floats and sorted with a three pass LSD radix sort
+ * (11 bits per pass). Buffers are kept between calls. When the ids are the
+ * same as in the previous call, in the same order, the previous result is
+ * the starting point and only repaired by insertion sort, which is linear
+ * for the small depth changes between two frames; if it needs more than
+ * about one move per point the radix sort runs instead.
+ */
+class DepthSorter
+{
+ public:
+  struct Stats {
+    size_t points = 0;
+    /// The previous order was reused.
+    bool coherent = false;
+    /// Elements moved while repairing the previous order.
+    size_t moves = 0;
+    bool radixSorted = false;
+    double ms = 0;
+  };
+
+  /**
+   * @param ids identify the points across calls, e.g. ObjectInstance
+   * addresses.
+   * @param centers world space positions.
+   * @return indices into ids/centers, farthest first.
+   */
+  const std::vector<uint32_t>& sort(std::span<const uintptr_t> ids,
+                                    std::span<const glm::vec3> centers,
+                                    const glm::mat4& view);
+  /**
+   * @brief Distances along the view direction, positive in front of the
+   * camera, by input index.
+   */
+  const std::vector<float>& getDepths() const noexcept;
+  const Stats& getStats() const noexcept;
+
+ private:
+  bool repair();
+  void radixSort();
+
+ private:
+  std::vector<float> depths;
+  /// By input index.
+  std::vector<uint32_t> keys;
+  std::vector<uint32_t> order;
+  /// Scratch of the radix sort.
+  std::vector<uint32_t> sortKeys;
+  std::vector<uint32_t> sortKeysTemp;
+  std::vector<uint32_t> orderTemp;
+  std::vector<uintptr_t> previousIds;
+  Stats stats;
+};
+
+}  // namespace agt3d
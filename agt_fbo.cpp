@@ -1,4 +1,5 @@
 #include "agt_fbo.h"
+#include "agt_gl_state.h"
 #include "agt_utils.h"
 
 using namespace std;
@@ -21,11 +22,14 @@ FBO::FBO(int _width, int _height, bool _multiSampled, int _samples,
 FBO::~FBO()
 {
   for (auto it = textures.begin(); it != textures.end(); ++it) {
+    if (!(*it).owned) {
+      continue;
+    }
     GLuint tex = (*it).texture;
-    glDeleteTextures(1, &tex);
+    GlState::deleteTextures(1, &tex);
   }
-  glDeleteFramebuffers(1, &id);
-  glDeleteRenderbuffers(1, &rboDepth);
+  GlState::deleteFramebuffers(1, &id);
+  GlState::deleteRenderbuffers(1, &rboDepth);
   return;
 }
 
@@ -53,29 +57,29 @@ void agt3d::FBO::resize(int newWidth, int newHeight)
 
   // Resize renderbuffer
   if (rboDepth) {
-    glBindRenderbuffer(GL_RENDERBUFFER, rboDepth);
+    GlState::bindRenderbuffer(rboDepth);
     if (multiSampled) {
       glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples,
                                        GL_DEPTH24_STENCIL8, width, height);
     } else {
       glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
     }
-    glBindRenderbuffer(GL_RENDERBUFFER, 0);
   }
   agt3d::checkOpenGLErrors();
   checkReadiness();
   // Resize all attachments
   for (const auto& desc : textures) {
+    if (!desc.owned) {
+      continue;
+    }
     if (multiSampled) {
-      glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, desc.texture);
+      GlState::bindTexture(GL_TEXTURE_2D_MULTISAMPLE, desc.texture);
       glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, samples,
                               internalFormat, width, height, GL_TRUE);
-      glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
     } else {
-      glBindTexture(GL_TEXTURE_2D, desc.texture);
+      GlState::bindTexture(GL_TEXTURE_2D, desc.texture);
       glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0,
                    desc.format, desc.type, NULL);
-      glBindTexture(GL_TEXTURE_2D, 0);
     }
   }
   checkOpenGLErrors();
@@ -84,26 +88,26 @@ void agt3d::FBO::resize(int newWidth, int newHeight)
 
 void agt3d::FBO::blitQuick(agt3d::FBO& dst, GLuint mask, GLuint filter)
 {
-  glBindFramebuffer(GL_READ_FRAMEBUFFER, id);
-  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, dst.id);
+  GlState::bindFramebuffer(GL_READ_FRAMEBUFFER, id);
+  GlState::bindFramebuffer(GL_DRAW_FRAMEBUFFER, dst.id);
   glBlitFramebuffer(0, 0, width, height, 0, 0, dst.width, dst.height, mask,
                     filter);
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  GlState::bindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
 GLuint FBO::attachRenderBuffer()
 {
   glGenRenderbuffers(1, &rboDepth);
-  glBindRenderbuffer(GL_RENDERBUFFER, rboDepth);
+  GlState::bindRenderbuffer(rboDepth);
   if (multiSampled) {
     glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples,
                                      GL_DEPTH24_STENCIL8, width, height);
-    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    GlState::bindFramebuffer(GL_FRAMEBUFFER, id);
     glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
                               GL_RENDERBUFFER, rboDepth);
   } else {
     glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, width, height);
-    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    GlState::bindFramebuffer(GL_FRAMEBUFFER, id);
     glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
                               GL_RENDERBUFFER, rboDepth);
   }
@@ -114,19 +118,18 @@ GLuint FBO::attachRenderBuffer()
 GLuint FBO::attachTexture(GLuint attachment, GLuint type, GLuint format,
                           GLuint minmagFilter)
 {
-  glBindFramebuffer(GL_FRAMEBUFFER, id);
+  GlState::bindFramebuffer(GL_FRAMEBUFFER, id);
 
   GLuint texture;
   glGenTextures(1, &texture);
   if (multiSampled) {
-    glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, texture);
+    GlState::bindTexture(GL_TEXTURE_2D_MULTISAMPLE, texture);
     glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, samples, internalFormat,
                             width, height, GL_TRUE);
-    glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
     glFramebufferTexture2D(GL_FRAMEBUFFER, attachment,
                            GL_TEXTURE_2D_MULTISAMPLE, texture, 0);
   } else {
-    glBindTexture(GL_TEXTURE_2D, texture);
+    GlState::bindTexture(GL_TEXTURE_2D, texture);
     glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format,
                  type, NULL);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minmagFilter);
@@ -142,15 +145,26 @@ GLuint FBO::attachTexture(GLuint attachment, GLuint type, GLuint format,
   return texture;
 }
 
+void FBO::attachExternalTexture(GLuint attachment, GLuint texture,
+                                GLuint type, GLuint format)
+{
+  GlState::bindFramebuffer(GL_FRAMEBUFFER, id);
+  glFramebufferTexture2D(
+    GL_FRAMEBUFFER, attachment,
+    multiSampled ? GL_TEXTURE_2D_MULTISAMPLE : GL_TEXTURE_2D, texture, 0);
+  textures.push_back({format, type, texture, false});
+  checkOpenGLErrors();
+}
+
 void FBO::bind() const
 {
-  glBindFramebuffer(GL_FRAMEBUFFER, id);
+  GlState::bindFramebuffer(GL_FRAMEBUFFER, id);
   return;
 }
 
 void FBO::unbind() const
 {
-  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  GlState::bindFramebuffer(GL_FRAMEBUFFER, 0);
   return;
 }
 
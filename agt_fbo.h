@@ -8,6 +8,8 @@ struct TexDesc {
   GLuint format;
   GLuint type;
   GLuint texture;
+  /// false for textures attached with attachExternalTexture().
+  bool owned = true;
 };
 
 class FBO
@@ -21,6 +23,13 @@ class FBO
   GLuint attachTexture(GLuint attachment, GLuint type = GL_UNSIGNED_BYTE,
                        GLuint format = GL_RGB,
                        GLuint minmagFilter = GL_NEAREST);
+  /**
+   * @brief Attach a texture owned by someone else, e.g. a RenderGraph. The
+   * FBO neither resizes nor deletes it.
+   */
+  void attachExternalTexture(GLuint attachment, GLuint texture,
+                             GLuint type = GL_UNSIGNED_BYTE,
+                             GLuint format = GL_RGB);
   GLuint attachRenderBuffer();
   void bind() const;
   void unbind() const;
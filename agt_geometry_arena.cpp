@@ -0,0 +1,550 @@
+#include "agt_geometry_arena.h"
+#include "agt_gl_state.h"
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+FreeListAllocator::FreeListAllocator(size_t _capacity) : cap(_capacity)
+{
+  if (cap) {
+    freeBlocks[0] = cap;
+  }
+}
+
+std::optional<size_t> FreeListAllocator::allocate(size_t count)
+{
+  if (count == 0) {
+    return 0;
+  }
+  for (auto it = freeBlocks.begin(); it != freeBlocks.end(); ++it) {
+    if (it->second < count) {
+      continue;
+    }
+    size_t offset = it->first;
+    size_t remaining = it->second - count;
+    freeBlocks.erase(it);
+    if (remaining) {
+      freeBlocks[offset + count] = remaining;
+    }
+    usedCount += count;
+    return offset;
+  }
+  return std::nullopt;
+}
+
+void FreeListAllocator::release(size_t offset, size_t count)
+{
+  if (count == 0) {
+    return;
+  }
+  usedCount -= count;
+
+  auto next = freeBlocks.lower_bound(offset);
+  if (next != freeBlocks.end() && offset + count == next->first) {
+    count += next->second;
+    next = freeBlocks.erase(next);
+  }
+  if (next != freeBlocks.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      prev->second += count;
+      return;
+    }
+  }
+  freeBlocks[offset] = count;
+}
+
+void FreeListAllocator::grow(size_t newCapacity)
+{
+  if (newCapacity <= cap) {
+    return;
+  }
+  size_t oldCapacity = cap;
+  cap = newCapacity;
+  // Account the new tail as used so release() can merge it like any block
+  usedCount += newCapacity - oldCapacity;
+  release(oldCapacity, newCapacity - oldCapacity);
+}
+
+void FreeListAllocator::reset(size_t _usedCount)
+{
+  freeBlocks.clear();
+  usedCount = _usedCount;
+  if (cap > usedCount) {
+    freeBlocks[usedCount] = cap - usedCount;
+  }
+}
+
+size_t FreeListAllocator::capacity() const noexcept { return cap; }
+
+size_t FreeListAllocator::used() const noexcept { return usedCount; }
+
+size_t FreeListAllocator::largestFreeBlock() const noexcept
+{
+  size_t largest = 0;
+  for (const auto& [offset, count] : freeBlocks) {
+    largest = std::max(largest, count);
+  }
+  return largest;
+}
+
+bool GeometryArena::Format::operator==(const Format& other) const noexcept
+{
+  if (streams != other.streams) {
+    return false;
+  }
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if ((streams & (1 << i)) && desc[i] != other.desc[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+GeometryArena::GeometryArena(size_t _initialVertices, size_t _initialIndices)
+    : initialVertices(_initialVertices), initialIndices(_initialIndices)
+{
+}
+
+GeometryArena::~GeometryArena()
+{
+  for (auto& pool : pools) {
+    for (auto mesh : pool.meshes) {
+      detach(*mesh);
+    }
+    GlState::deleteVertexArrays(1, &pool.vao);
+    GlState::deleteVertexArrays(1, &pool.depthVao);
+    GlState::deleteBuffers(static_cast<int>(DataStream::LAST), pool.vbos);
+    GlState::deleteBuffers(1, &pool.ibo);
+  }
+}
+
+void GeometryArena::detach(Mesh& mesh)
+{
+  // Bring the data back before the arena storage goes away
+  mesh.makeResident();
+  mesh.arena = nullptr;
+  mesh.needsUpdate = true;
+  mesh.layoutDirty = true;
+}
+
+GeometryArena::Format GeometryArena::formatOf(const Mesh& mesh) const
+{
+  Format format;
+  format.streams = mesh.streams;
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if (mesh.streams & (1 << i)) {
+      format.desc[i] = mesh.rawBufferDesc[i];
+    }
+  }
+  return format;
+}
+
+uint32_t GeometryArena::findOrCreatePool(const Format& format)
+{
+  for (size_t i = 0; i < pools.size(); i++) {
+    if (pools[i].format == format) {
+      return static_cast<uint32_t>(i);
+    }
+  }
+
+  pools.emplace_back();
+  auto& pool = pools.back();
+  pool.format = format;
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if (format.streams & (1 << i)) {
+      pool.elementSizes[i] =
+        format.desc[i].second * getGlTypeSize(format.desc[i].first);
+    }
+  }
+  glGenVertexArrays(1, &pool.vao);
+  glGenVertexArrays(1, &pool.depthVao);
+  growVertices(pool, initialVertices);
+  growIndices(pool, initialIndices);
+  return static_cast<uint32_t>(pools.size() - 1);
+}
+
+void GeometryArena::growVertices(Pool& pool, size_t newCapacity)
+{
+  size_t oldCapacity = pool.vertices.capacity();
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if (!(pool.format.streams & (1 << i))) {
+      continue;
+    }
+    GLuint buffer = 0;
+    glGenBuffers(1, &buffer);
+    GlState::bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+    glBufferData(GL_COPY_WRITE_BUFFER, newCapacity * pool.elementSizes[i],
+                 nullptr, GL_STATIC_DRAW);
+    if (pool.vbos[i]) {
+      GlState::bindBuffer(GL_COPY_READ_BUFFER, pool.vbos[i]);
+      glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                          oldCapacity * pool.elementSizes[i]);
+      GlState::deleteBuffers(1, &pool.vbos[i]);
+    }
+    pool.vbos[i] = buffer;
+  }
+  pool.vertices.grow(newCapacity);
+  setupVertexArray(pool);
+}
+
+void GeometryArena::growIndices(Pool& pool, size_t newCapacity)
+{
+  size_t oldCapacity = pool.indices.capacity();
+  GLuint buffer = 0;
+  glGenBuffers(1, &buffer);
+  GlState::bindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+  glBufferData(GL_COPY_WRITE_BUFFER, newCapacity * sizeof(unsigned int),
+               nullptr, GL_STATIC_DRAW);
+  if (pool.ibo) {
+    GlState::bindBuffer(GL_COPY_READ_BUFFER, pool.ibo);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                        oldCapacity * sizeof(unsigned int));
+    GlState::deleteBuffers(1, &pool.ibo);
+  }
+  pool.ibo = buffer;
+  pool.indices.grow(newCapacity);
+  setupVertexArray(pool);
+}
+
+void GeometryArena::setupVertexArray(Pool& pool)
+{
+  GLuint previous = GlState::getVertexArray();
+  GlState::bindVertexArray(pool.vao);
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if (!(pool.format.streams & (1 << i))) {
+      continue;
+    }
+    GlState::bindBuffer(GL_ARRAY_BUFFER, pool.vbos[i]);
+    glEnableVertexAttribArray(i);
+    glVertexAttribPointer(i, pool.format.desc[i].second,
+                          pool.format.desc[i].first, GL_FALSE, 0, nullptr);
+  }
+  GlState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.ibo);
+
+  // Same buffers, positions only
+  const int vertex = static_cast<int>(DataStream::VERTEX);
+  GlState::bindVertexArray(pool.depthVao);
+  if (pool.format.streams & (1 << vertex)) {
+    GlState::bindBuffer(GL_ARRAY_BUFFER, pool.vbos[vertex]);
+    glEnableVertexAttribArray(vertex);
+    glVertexAttribPointer(vertex, pool.format.desc[vertex].second,
+                          pool.format.desc[vertex].first, GL_FALSE, 0,
+                          nullptr);
+  }
+  GlState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, pool.ibo);
+  GlState::bindVertexArray(previous);
+  checkOpenGLErrors();
+}
+
+bool GeometryArena::allocate(Pool& pool, Mesh& mesh)
+{
+  size_t vertexCount = mesh.getVertexCount();
+  size_t indexCount = mesh.getIndexCount();
+
+  auto vertexOffset = pool.vertices.allocate(vertexCount);
+  if (!vertexOffset) {
+    auto capacity = pool.vertices.capacity();
+    growVertices(pool, std::max(capacity * 2, capacity + vertexCount));
+    vertexOffset = pool.vertices.allocate(vertexCount);
+  }
+  auto indexOffset = pool.indices.allocate(indexCount);
+  if (!indexOffset) {
+    auto capacity = pool.indices.capacity();
+    growIndices(pool, std::max(capacity * 2, capacity + indexCount));
+    indexOffset = pool.indices.allocate(indexCount);
+  }
+  if (!vertexOffset || !indexOffset) {
+    if (vertexOffset) {
+      pool.vertices.release(*vertexOffset, vertexCount);
+    }
+    return false;
+  }
+
+  mesh.baseVertex = static_cast<uint32_t>(*vertexOffset);
+  mesh.firstIndex = static_cast<uint32_t>(*indexOffset);
+  mesh.arenaVertexCount = vertexCount;
+  mesh.arenaIndexCount = indexCount;
+  return true;
+}
+
+void GeometryArena::upload(Pool& pool, Mesh& mesh)
+{
+  // Only dirty ranges when the layout is unchanged, everything otherwise
+  bool partial = !mesh.layoutDirty && mesh.hasDirtyRanges();
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if (!(pool.format.streams & (1 << i))) {
+      continue;
+    }
+    size_t begin = 0;
+    size_t end = mesh.streamSizes[i];
+    if (partial) {
+      begin = mesh.dirtyRanges[i].first;
+      end = mesh.dirtyRanges[i].second;
+      if (begin >= end) {
+        continue;
+      }
+    }
+    GlState::bindBuffer(GL_COPY_WRITE_BUFFER, pool.vbos[i]);
+    glBufferSubData(GL_COPY_WRITE_BUFFER,
+                    mesh.baseVertex * pool.elementSizes[i] + begin,
+                    end - begin, mesh.streamData(i) + begin);
+  }
+
+  if (mesh.indices.size() && (!partial || mesh.indicesDirty)) {
+    GlState::bindBuffer(GL_COPY_WRITE_BUFFER, pool.ibo);
+    glBufferSubData(GL_COPY_WRITE_BUFFER,
+                    mesh.firstIndex * sizeof(unsigned int),
+                    mesh.indices.size() * sizeof(unsigned int),
+                    mesh.indices.data());
+  }
+
+  mesh.layoutDirty = false;
+  mesh.indicesDirty = false;
+  mesh.clearDirtyRanges();
+  mesh.applyResidency();
+  checkOpenGLErrors();
+}
+
+bool GeometryArena::add(Mesh& mesh)
+{
+  if (mesh.arena == this) {
+    update(mesh);
+    return true;
+  }
+  if (mesh.arena) {
+    mesh.arena->remove(mesh);
+  }
+  if (mesh.getUsage() == MeshUsage::PERSISTENT) {
+    std::cerr << "GeometryArena: persistent meshes can't be suballocated"
+              << std::endl;
+    return false;
+  }
+  if (!mesh.hasDataBuffer(DataStream::VERTEX)) {
+    return false;
+  }
+
+  // Every stream has to describe the same number of vertices
+  auto format = formatOf(mesh);
+  size_t vertexCount = mesh.getVertexCount();
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if ((format.streams & (1 << i)) &&
+        mesh.streamSizes[i] != vertexCount * mesh.getElementSize(
+                                               static_cast<DataStream>(i))) {
+      std::cerr << "GeometryArena: stream " << i
+                << " doesn't match the vertex count" << std::endl;
+      return false;
+    }
+  }
+
+  mesh.makeResident();
+  auto poolId = findOrCreatePool(format);
+  auto& pool = pools[poolId];
+  if (!allocate(pool, mesh)) {
+    return false;
+  }
+  mesh.arena = this;
+  mesh.arenaPool = poolId;
+  pool.meshes.push_back(&mesh);
+  mesh.layoutDirty = true;
+  upload(pool, mesh);
+
+  // The arena holds the geometry now, drop the storage of the mesh buffers
+  GlState::bindBuffer(GL_COPY_WRITE_BUFFER, mesh.vbo);
+  glBufferData(GL_COPY_WRITE_BUFFER, 0, nullptr, GL_STATIC_DRAW);
+  GlState::bindBuffer(GL_COPY_WRITE_BUFFER, mesh.vib);
+  glBufferData(GL_COPY_WRITE_BUFFER, 0, nullptr, GL_STATIC_DRAW);
+  mesh.uploadedSize = 0;
+  return true;
+}
+
+size_t GeometryArena::add(const std::vector<Mesh*>& meshes)
+{
+  // Size every pool for the whole batch up front
+  std::map<uint32_t, std::pair<size_t, size_t>> required;
+  for (auto mesh : meshes) {
+    if (mesh->arena || !mesh->hasDataBuffer(DataStream::VERTEX)) {
+      continue;
+    }
+    auto& [vertexCount, indexCount] = required[findOrCreatePool(formatOf(*mesh))];
+    vertexCount += mesh->getVertexCount();
+    indexCount += mesh->getIndexCount();
+  }
+  for (const auto& [poolId, counts] : required) {
+    auto& pool = pools[poolId];
+    if (pool.vertices.largestFreeBlock() < counts.first) {
+      growVertices(pool, pool.vertices.capacity() + counts.first);
+    }
+    if (pool.indices.largestFreeBlock() < counts.second) {
+      growIndices(pool, pool.indices.capacity() + counts.second);
+    }
+  }
+
+  size_t added = 0;
+  for (auto mesh : meshes) {
+    if (add(*mesh)) {
+      added++;
+    }
+  }
+  return added;
+}
+
+void GeometryArena::remove(Mesh& mesh, bool readBackData)
+{
+  if (mesh.arena != this) {
+    return;
+  }
+  if (readBackData) {
+    mesh.makeResident();
+  }
+  auto& pool = pools[mesh.arenaPool];
+  pool.vertices.release(mesh.baseVertex, mesh.arenaVertexCount);
+  pool.indices.release(mesh.firstIndex, mesh.arenaIndexCount);
+  pool.meshes.erase(std::remove(pool.meshes.begin(), pool.meshes.end(), &mesh),
+                    pool.meshes.end());
+  mesh.arena = nullptr;
+  mesh.baseVertex = 0;
+  mesh.firstIndex = 0;
+  mesh.needsUpdate = true;
+  mesh.layoutDirty = true;
+}
+
+void GeometryArena::update(Mesh& mesh)
+{
+  if (mesh.arena != this) {
+    return;
+  }
+  auto& pool = pools[mesh.arenaPool];
+  bool sameFormat = formatOf(mesh) == pool.format &&
+                    mesh.getVertexCount() == mesh.arenaVertexCount &&
+                    mesh.getIndexCount() == mesh.arenaIndexCount;
+  if (!sameFormat) {
+    remove(mesh);
+    add(mesh);
+    return;
+  }
+  if (mesh.layoutDirty || !mesh.hasDirtyRanges()) {
+    mesh.makeResident();
+  }
+  upload(pool, mesh);
+}
+
+void GeometryArena::compact(Pool& pool)
+{
+  std::sort(pool.meshes.begin(), pool.meshes.end(),
+            [](const Mesh* a, const Mesh* b) {
+              return a->baseVertex < b->baseVertex;
+            });
+
+  // Overlapping copies within one buffer are not allowed, so the live ranges
+  // are packed into fresh buffers of the same capacity
+  size_t vertexCapacity = pool.vertices.capacity();
+  size_t indexCapacity = pool.indices.capacity();
+  GLuint newVbos[static_cast<int>(DataStream::LAST)] = {};
+  GLuint newIbo = 0;
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if (pool.format.streams & (1 << i)) {
+      glGenBuffers(1, &newVbos[i]);
+      GlState::bindBuffer(GL_COPY_WRITE_BUFFER, newVbos[i]);
+      glBufferData(GL_COPY_WRITE_BUFFER, vertexCapacity * pool.elementSizes[i],
+                   nullptr, GL_STATIC_DRAW);
+    }
+  }
+  glGenBuffers(1, &newIbo);
+  GlState::bindBuffer(GL_COPY_WRITE_BUFFER, newIbo);
+  glBufferData(GL_COPY_WRITE_BUFFER, indexCapacity * sizeof(unsigned int),
+               nullptr, GL_STATIC_DRAW);
+
+  size_t vertexOffset = 0;
+  size_t indexOffset = 0;
+  for (auto mesh : pool.meshes) {
+    for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+      if (!(pool.format.streams & (1 << i)) || mesh->arenaVertexCount == 0) {
+        continue;
+      }
+      GlState::bindBuffer(GL_COPY_READ_BUFFER, pool.vbos[i]);
+      GlState::bindBuffer(GL_COPY_WRITE_BUFFER, newVbos[i]);
+      glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                          mesh->baseVertex * pool.elementSizes[i],
+                          vertexOffset * pool.elementSizes[i],
+                          mesh->arenaVertexCount * pool.elementSizes[i]);
+    }
+    if (mesh->arenaIndexCount) {
+      GlState::bindBuffer(GL_COPY_READ_BUFFER, pool.ibo);
+      GlState::bindBuffer(GL_COPY_WRITE_BUFFER, newIbo);
+      glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                          mesh->firstIndex * sizeof(unsigned int),
+                          indexOffset * sizeof(unsigned int),
+                          mesh->arenaIndexCount * sizeof(unsigned int));
+    }
+    mesh->baseVertex = static_cast<uint32_t>(vertexOffset);
+    mesh->firstIndex = static_cast<uint32_t>(indexOffset);
+    vertexOffset += mesh->arenaVertexCount;
+    indexOffset += mesh->arenaIndexCount;
+  }
+
+  GlState::deleteBuffers(static_cast<int>(DataStream::LAST), pool.vbos);
+  GlState::deleteBuffers(1, &pool.ibo);
+  std::copy(std::begin(newVbos), std::end(newVbos), std::begin(pool.vbos));
+  pool.ibo = newIbo;
+  pool.vertices.reset(vertexOffset);
+  pool.indices.reset(indexOffset);
+  setupVertexArray(pool);
+}
+
+void GeometryArena::defragment()
+{
+  for (auto& pool : pools) {
+    compact(pool);
+  }
+}
+
+GLuint GeometryArena::getVertexArray(uint32_t pool) const noexcept
+{
+  return pools[pool].vao;
+}
+
+GLuint GeometryArena::getDepthVertexArray(uint32_t pool) const noexcept
+{
+  return pools[pool].depthVao;
+}
+
+void GeometryArena::readBack(const Mesh& mesh, int stream, uint8_t* dst) const
+{
+  const auto& pool = pools[mesh.arenaPool];
+  GlState::bindBuffer(GL_COPY_READ_BUFFER, pool.vbos[stream]);
+  glGetBufferSubData(GL_COPY_READ_BUFFER,
+                     mesh.baseVertex * pool.elementSizes[stream],
+                     mesh.arenaVertexCount * pool.elementSizes[stream], dst);
+}
+
+void GeometryArena::readBackIndices(const Mesh& mesh, unsigned int* dst) const
+{
+  const auto& pool = pools[mesh.arenaPool];
+  GlState::bindBuffer(GL_COPY_READ_BUFFER, pool.ibo);
+  glGetBufferSubData(GL_COPY_READ_BUFFER,
+                     mesh.firstIndex * sizeof(unsigned int),
+                     mesh.arenaIndexCount * sizeof(unsigned int), dst);
+}
+
+GeometryArena::Stats GeometryArena::getStats() const noexcept
+{
+  Stats stats;
+  stats.pools = pools.size();
+  for (const auto& pool : pools) {
+    stats.meshes += pool.meshes.size();
+    stats.vertexCapacity += pool.vertices.capacity();
+    stats.verticesUsed += pool.vertices.used();
+    stats.indexCapacity += pool.indices.capacity();
+    stats.indicesUsed += pool.indices.used();
+    for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+      stats.bytes += pool.vertices.capacity() * pool.elementSizes[i];
+    }
+    stats.bytes += pool.indices.capacity() * sizeof(unsigned int);
+  }
+  return stats;
+}
+
+}  // namespace agt3d
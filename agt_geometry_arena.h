@@ -0,0 +1,134 @@
+#pragma once
+
+#include "agt_mesh.h"
+
+namespace agt3d
+{
+
+/**
+ * @brief First fit free-list allocator over a linear range of elements.
+ * Neighbouring free blocks are merged when released.
+ */
+class FreeListAllocator
+{
+ public:
+  FreeListAllocator(size_t _capacity = 0);
+  std::optional<size_t> allocate(size_t count);
+  void release(size_t offset, size_t count);
+  /**
+   * @brief Extend the range, the new tail becomes free.
+   */
+  void grow(size_t newCapacity);
+  /**
+   * @brief Mark [0, usedCount) as allocated and the rest as free. Used after
+   * compaction.
+   */
+  void reset(size_t usedCount);
+  size_t capacity() const noexcept;
+  size_t used() const noexcept;
+  size_t largestFreeBlock() const noexcept;
+
+ private:
+  /// offset -> count
+  std::map<size_t, size_t> freeBlocks;
+  size_t cap = 0;
+  size_t usedCount = 0;
+};
+
+/**
+ * @brief Suballocates vertex and index ranges for many meshes from a few large
+ * GL buffers. Meshes with the same vertex format (streams, types and component
+ * counts) share a pool with one VAO, one buffer per stream and one index
+ * buffer. Each mesh records its pool, base vertex and first index, so a whole
+ * pool can be drawn with a single VAO bind through Mesh::draw().
+ * The arena has to outlive the meshes added to it, or it reads their data back
+ * into the meshes when destroyed.
+ */
+class GeometryArena
+{
+ public:
+  struct Stats {
+    size_t pools = 0;
+    size_t meshes = 0;
+    size_t vertexCapacity = 0;
+    size_t verticesUsed = 0;
+    size_t indexCapacity = 0;
+    size_t indicesUsed = 0;
+    size_t bytes = 0;
+  };
+
+  GeometryArena(size_t _initialVertices = 1 << 16,
+                size_t _initialIndices = 3 << 16);
+  ~GeometryArena();
+  GeometryArena& operator=(const GeometryArena& other) = delete;
+  GeometryArena(GeometryArena&) = delete;
+  /**
+   * @brief Move the mesh geometry into the arena. Meshes using
+   * MeshUsage::PERSISTENT are rejected.
+   * @return true if the mesh is now drawn from the arena.
+   */
+  bool add(Mesh& mesh);
+  /**
+   * @brief Add many meshes at once, every pool grows at most once.
+   * @return number of meshes added.
+   */
+  size_t add(const std::vector<Mesh*>& meshes);
+  /**
+   * @brief Release the ranges of the mesh, the mesh goes back to its own
+   * buffers on the next updateVAO().
+   * @param readBackData read released streams back into the mesh first.
+   */
+  void remove(Mesh& mesh, bool readBackData = true);
+  /**
+   * @brief Upload the current data of a mesh that is already in the arena.
+   */
+  void update(Mesh& mesh);
+  /**
+   * @brief Compact every pool so all free space ends up at the tail.
+   */
+  void defragment();
+  GLuint getVertexArray(uint32_t pool) const noexcept;
+  /**
+   * @brief VAO of the pool that only enables the VERTEX stream.
+   */
+  GLuint getDepthVertexArray(uint32_t pool) const noexcept;
+  void readBack(const Mesh& mesh, int stream, uint8_t* dst) const;
+  void readBackIndices(const Mesh& mesh, unsigned int* dst) const;
+  Stats getStats() const noexcept;
+
+ private:
+  struct Format {
+    uint32_t streams = 0;
+    std::pair<int, int> desc[static_cast<int>(DataStream::LAST)];
+    bool operator==(const Format& other) const noexcept;
+  };
+
+  struct Pool {
+    Format format;
+    size_t elementSizes[static_cast<int>(DataStream::LAST)] = {};
+    GLuint vao = 0;
+    GLuint depthVao = 0;
+    GLuint vbos[static_cast<int>(DataStream::LAST)] = {};
+    GLuint ibo = 0;
+    FreeListAllocator vertices;
+    FreeListAllocator indices;
+    std::vector<Mesh*> meshes;
+  };
+
+  Format formatOf(const Mesh& mesh) const;
+  uint32_t findOrCreatePool(const Format& format);
+  void growVertices(Pool& pool, size_t newCapacity);
+  void growIndices(Pool& pool, size_t newCapacity);
+  void setupVertexArray(Pool& pool);
+  bool allocate(Pool& pool, Mesh& mesh);
+  void upload(Pool& pool, Mesh& mesh);
+  void compact(Pool& pool);
+  void detach(Mesh& mesh);
+
+ private:
+  std::vector<Pool> pools;
+  size_t initialVertices;
+  size_t initialIndices;
+};
+
+}  // namespace agt3d
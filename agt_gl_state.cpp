@@ -0,0 +1,401 @@
+#include "agt_gl_state.h"
+
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+static constexpr GLuint unknown = std::numeric_limits<GLuint>::max();
+
+static constexpr GLenum bufferTargets[] = {
+  GL_ARRAY_BUFFER,          GL_COPY_READ_BUFFER,    GL_COPY_WRITE_BUFFER,
+  GL_DRAW_INDIRECT_BUFFER,  GL_SHADER_STORAGE_BUFFER, GL_UNIFORM_BUFFER,
+  GL_PIXEL_PACK_BUFFER,     GL_PIXEL_UNPACK_BUFFER, GL_DISPATCH_INDIRECT_BUFFER,
+  GL_ATOMIC_COUNTER_BUFFER, GL_TEXTURE_BUFFER};
+static constexpr size_t bufferTargetCount =
+  sizeof(bufferTargets) / sizeof(*bufferTargets);
+
+static constexpr GLenum textureTargets[] = {
+  GL_TEXTURE_2D, GL_TEXTURE_2D_MULTISAMPLE, GL_TEXTURE_CUBE_MAP};
+static constexpr size_t textureTargetCount =
+  sizeof(textureTargets) / sizeof(*textureTargets);
+
+static constexpr GLenum capabilities[] = {
+  GL_DEPTH_TEST,   GL_BLEND,        GL_CULL_FACE,       GL_PROGRAM_POINT_SIZE,
+  GL_SCISSOR_TEST, GL_STENCIL_TEST, GL_MULTISAMPLE,     GL_FRAMEBUFFER_SRGB,
+  GL_POLYGON_OFFSET_FILL,           GL_RASTERIZER_DISCARD};
+static constexpr size_t capabilityCount =
+  sizeof(capabilities) / sizeof(*capabilities);
+
+struct IndexedBinding {
+  GLuint buffer = unknown;
+  GLintptr offset = 0;
+  GLsizeiptr size = 0;
+
+  bool operator==(const IndexedBinding& other) const noexcept
+  {
+    return buffer == other.buffer && offset == other.offset &&
+           size == other.size;
+  }
+};
+
+struct TrackedState {
+  GLuint program = unknown;
+  GLuint vao = unknown;
+  /// Element buffer binding is part of the VAO.
+  GLuint elementBuffer = unknown;
+  GLuint buffers[bufferTargetCount];
+  IndexedBinding uniformBindings[GlState::maxIndexedBindings];
+  IndexedBinding storageBindings[GlState::maxIndexedBindings];
+  GLuint activeUnit = unknown;
+  GLuint textures[GlState::maxTextureUnits][textureTargetCount];
+  GLuint drawFramebuffer = unknown;
+  GLuint readFramebuffer = unknown;
+  GLuint renderbuffer = unknown;
+  /// 0 disabled, 1 enabled, -1 unknown.
+  int8_t enabled[capabilityCount];
+  std::pair<GLenum, GLenum> blend = {unknown, unknown};
+  GLenum depthFunc = unknown;
+  int depthMask = -1;
+
+  TrackedState()
+  {
+    std::fill(std::begin(buffers), std::end(buffers), unknown);
+    for (auto& unit : textures) {
+      std::fill(std::begin(unit), std::end(unit), unknown);
+    }
+    std::fill(std::begin(enabled), std::end(enabled), -1);
+  }
+};
+
+static TrackedState state;
+static GlStateStats stats;
+
+template <typename T>
+static int indexOf(const T& list, GLenum value) noexcept
+{
+  for (size_t i = 0; i < std::size(list); i++) {
+    if (list[i] == value) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Store the new value if it differs.
+ * @return true if the call has to be issued.
+ */
+template <typename T>
+static bool update(T& cached, const T& value) noexcept
+{
+  if (cached == value) {
+    stats.elided++;
+    return false;
+  }
+  cached = value;
+  stats.issued++;
+  return true;
+}
+
+static IndexedBinding* indexedBinding(GLenum target, GLuint index) noexcept
+{
+  if (index >= GlState::maxIndexedBindings) {
+    return nullptr;
+  }
+  if (target == GL_UNIFORM_BUFFER) {
+    return &state.uniformBindings[index];
+  }
+  if (target == GL_SHADER_STORAGE_BUFFER) {
+    return &state.storageBindings[index];
+  }
+  return nullptr;
+}
+
+void GlState::useProgram(GLuint program) noexcept
+{
+  if (update(state.program, program)) {
+    glUseProgram(program);
+  }
+}
+
+void GlState::bindVertexArray(GLuint vao) noexcept
+{
+  if (update(state.vao, vao)) {
+    glBindVertexArray(vao);
+    state.elementBuffer = unknown;
+  }
+}
+
+void GlState::bindBuffer(GLenum target, GLuint buffer) noexcept
+{
+  if (target == GL_ELEMENT_ARRAY_BUFFER) {
+    if (update(state.elementBuffer, buffer)) {
+      glBindBuffer(target, buffer);
+    }
+    return;
+  }
+  int slot = indexOf(bufferTargets, target);
+  if (slot < 0) {
+    stats.issued++;
+    glBindBuffer(target, buffer);
+  } else if (update(state.buffers[slot], buffer)) {
+    glBindBuffer(target, buffer);
+  }
+}
+
+void GlState::bindBufferBase(GLenum target, GLuint index,
+                             GLuint buffer) noexcept
+{
+  // Indexed binds also bind the generic target
+  int slot = indexOf(bufferTargets, target);
+  if (slot >= 0) {
+    state.buffers[slot] = buffer;
+  }
+  auto binding = indexedBinding(target, index);
+  if (!binding) {
+    stats.issued++;
+    glBindBufferBase(target, index, buffer);
+  } else if (update(*binding, IndexedBinding{buffer, 0, -1})) {
+    glBindBufferBase(target, index, buffer);
+  }
+}
+
+void GlState::bindBufferRange(GLenum target, GLuint index, GLuint buffer,
+                              GLintptr offset, GLsizeiptr size) noexcept
+{
+  int slot = indexOf(bufferTargets, target);
+  if (slot >= 0) {
+    state.buffers[slot] = buffer;
+  }
+  auto binding = indexedBinding(target, index);
+  if (!binding) {
+    stats.issued++;
+    glBindBufferRange(target, index, buffer, offset, size);
+  } else if (update(*binding, IndexedBinding{buffer, offset, size})) {
+    glBindBufferRange(target, index, buffer, offset, size);
+  }
+}
+
+void GlState::activeTexture(GLuint unit) noexcept
+{
+  if (update(state.activeUnit, unit)) {
+    glActiveTexture(GL_TEXTURE0 + unit);
+  }
+}
+
+void GlState::bindTexture(GLenum target, GLuint texture, GLuint unit) noexcept
+{
+  int slot = indexOf(textureTargets, target);
+  if (slot < 0 || unit >= maxTextureUnits) {
+    activeTexture(unit);
+    stats.issued++;
+    glBindTexture(target, texture);
+    return;
+  }
+  if (update(state.textures[unit][slot], texture)) {
+    activeTexture(unit);
+    glBindTexture(target, texture);
+  }
+}
+
+void GlState::bindTexture(GLenum target, GLuint texture) noexcept
+{
+  if (state.activeUnit == unknown) {
+    activeTexture(0);
+  }
+  bindTexture(target, texture, state.activeUnit);
+}
+
+void GlState::bindFramebuffer(GLenum target, GLuint fbo) noexcept
+{
+  if (target == GL_FRAMEBUFFER) {
+    if (state.drawFramebuffer == fbo && state.readFramebuffer == fbo) {
+      stats.elided++;
+      return;
+    }
+    state.drawFramebuffer = fbo;
+    state.readFramebuffer = fbo;
+    stats.issued++;
+    glBindFramebuffer(target, fbo);
+  } else if (target == GL_DRAW_FRAMEBUFFER) {
+    if (update(state.drawFramebuffer, fbo)) {
+      glBindFramebuffer(target, fbo);
+    }
+  } else if (update(state.readFramebuffer, fbo)) {
+    glBindFramebuffer(target, fbo);
+  }
+}
+
+void GlState::bindRenderbuffer(GLuint rbo) noexcept
+{
+  if (update(state.renderbuffer, rbo)) {
+    glBindRenderbuffer(GL_RENDERBUFFER, rbo);
+  }
+}
+
+void GlState::setEnabled(GLenum cap, bool enabled) noexcept
+{
+  int slot = indexOf(capabilities, cap);
+  if (slot < 0) {
+    stats.issued++;
+  } else if (!update(state.enabled[slot], static_cast<int8_t>(enabled))) {
+    return;
+  }
+  enabled ? glEnable(cap) : glDisable(cap);
+}
+
+void GlState::blendFunc(GLenum src, GLenum dst) noexcept
+{
+  if (update(state.blend, std::make_pair(src, dst))) {
+    glBlendFunc(src, dst);
+  }
+}
+
+void GlState::depthFunc(GLenum func) noexcept
+{
+  if (update(state.depthFunc, func)) {
+    glDepthFunc(func);
+  }
+}
+
+void GlState::depthMask(bool write) noexcept
+{
+  if (update(state.depthMask, static_cast<int>(write))) {
+    glDepthMask(write ? GL_TRUE : GL_FALSE);
+  }
+}
+
+void GlState::deleteProgram(GLuint program) noexcept
+{
+  // A program in use is only deleted once it is replaced, its name can't be
+  // trusted any more
+  if (state.program == program) {
+    state.program = unknown;
+  }
+  glDeleteProgram(program);
+}
+
+void GlState::deleteVertexArrays(GLsizei count, const GLuint* vaos) noexcept
+{
+  for (GLsizei i = 0; i < count; i++) {
+    if (vaos[i] && state.vao == vaos[i]) {
+      state.vao = 0;
+      state.elementBuffer = unknown;
+    }
+  }
+  glDeleteVertexArrays(count, vaos);
+}
+
+void GlState::deleteBuffers(GLsizei count, const GLuint* buffers) noexcept
+{
+  for (GLsizei i = 0; i < count; i++) {
+    if (!buffers[i]) {
+      continue;
+    }
+    // Deleting unbinds from the generic targets
+    for (auto& bound : state.buffers) {
+      if (bound == buffers[i]) {
+        bound = 0;
+      }
+    }
+    if (state.elementBuffer == buffers[i]) {
+      state.elementBuffer = unknown;
+    }
+    for (GLuint index = 0; index < maxIndexedBindings; index++) {
+      if (state.uniformBindings[index].buffer == buffers[i]) {
+        state.uniformBindings[index] = IndexedBinding();
+      }
+      if (state.storageBindings[index].buffer == buffers[i]) {
+        state.storageBindings[index] = IndexedBinding();
+      }
+    }
+  }
+  glDeleteBuffers(count, buffers);
+}
+
+void GlState::deleteTextures(GLsizei count, const GLuint* textures) noexcept
+{
+  for (GLsizei i = 0; i < count; i++) {
+    if (!textures[i]) {
+      continue;
+    }
+    for (auto& unit : state.textures) {
+      for (auto& bound : unit) {
+        if (bound == textures[i]) {
+          bound = 0;
+        }
+      }
+    }
+  }
+  glDeleteTextures(count, textures);
+}
+
+void GlState::deleteFramebuffers(GLsizei count, const GLuint* fbos) noexcept
+{
+  for (GLsizei i = 0; i < count; i++) {
+    if (!fbos[i]) {
+      continue;
+    }
+    if (state.drawFramebuffer == fbos[i]) {
+      state.drawFramebuffer = 0;
+    }
+    if (state.readFramebuffer == fbos[i]) {
+      state.readFramebuffer = 0;
+    }
+  }
+  glDeleteFramebuffers(count, fbos);
+}
+
+void GlState::deleteRenderbuffers(GLsizei count, const GLuint* rbos) noexcept
+{
+  for (GLsizei i = 0; i < count; i++) {
+    if (rbos[i] && state.renderbuffer == rbos[i]) {
+      state.renderbuffer = 0;
+    }
+  }
+  glDeleteRenderbuffers(count, rbos);
+}
+
+static GLuint known(GLuint value) noexcept
+{
+  return value == unknown ? 0 : value;
+}
+
+GLuint GlState::getProgram() noexcept { return known(state.program); }
+
+GLuint GlState::getVertexArray() noexcept { return known(state.vao); }
+
+GLuint GlState::getBuffer(GLenum target) noexcept
+{
+  if (target == GL_ELEMENT_ARRAY_BUFFER) {
+    return known(state.elementBuffer);
+  }
+  int slot = indexOf(bufferTargets, target);
+  return slot < 0 ? 0 : known(state.buffers[slot]);
+}
+
+GLuint GlState::getTexture(GLenum target) noexcept
+{
+  int slot = indexOf(textureTargets, target);
+  if (slot < 0 || state.activeUnit == unknown ||
+      state.activeUnit >= maxTextureUnits) {
+    return 0;
+  }
+  return known(state.textures[state.activeUnit][slot]);
+}
+
+GLuint GlState::getFramebuffer(GLenum target) noexcept
+{
+  return known(target == GL_READ_FRAMEBUFFER ? state.readFramebuffer
+                                             : state.drawFramebuffer);
+}
+
+void GlState::invalidate() noexcept { state = TrackedState(); }
+
+const GlStateStats& GlState::getStats() noexcept { return stats; }
+
+void GlState::resetStats() noexcept { stats = GlStateStats(); }
+
+}  // namespace agt3d
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "agt_stdafx.h"
+
+namespace agt3d
+{
+
+/**
+ * @brief Calls that went to GL and calls skipped because the state already
+ * matched.
+ */
+struct GlStateStats {
+  size_t issued = 0;
+  size_t elided = 0;
+};
+
+/**
+ * @brief Shadow of the GL binding and capability state of the one context
+ * agt3d renders with. Every agt3d class binds through it, a bind of what is
+ * already bound costs nothing and the driver is never queried.
+ *
+ * Objects stay bound after use instead of being reset to 0, only the
+ * explicit unbind methods (Mesh::unuse(), FBO::unbind()) bind 0. Code that
+ * changes bindings with raw GL calls has to call invalidate() before agt3d
+ * draws again, and should bind its own VAO before binding an element buffer.
+ * Objects must be deleted through the delete functions so a recycled name is
+ * not mistaken for a bound object.
+ *
+ * Tracked: program, VAO, the element buffer of the current VAO, the generic
+ * buffer targets, indexed uniform and storage buffer bindings, 2D, 2D
+ * multisample and cube map textures of units 0 to maxTextureUnits - 1, the
+ * active unit, draw and read framebuffers, renderbuffer, a set of
+ * glEnable/glDisable capabilities, blend function, depth function and depth
+ * mask. Anything else is passed through and counted as issued.
+ */
+class GlState
+{
+ public:
+  static constexpr GLuint maxTextureUnits = 32;
+  static constexpr GLuint maxIndexedBindings = 16;
+
+  static void useProgram(GLuint program) noexcept;
+  static void bindVertexArray(GLuint vao) noexcept;
+  static void bindBuffer(GLenum target, GLuint buffer) noexcept;
+  static void bindBufferBase(GLenum target, GLuint index,
+                             GLuint buffer) noexcept;
+  static void bindBufferRange(GLenum target, GLuint index, GLuint buffer,
+                              GLintptr offset, GLsizeiptr size) noexcept;
+  static void activeTexture(GLuint unit) noexcept;
+  /**
+   * @brief Bind a texture to a unit, the active unit only changes if the
+   * bind has to be issued.
+   */
+  static void bindTexture(GLenum target, GLuint texture, GLuint unit) noexcept;
+  /**
+   * @brief Bind a texture to the active unit, e.g. to upload data.
+   */
+  static void bindTexture(GLenum target, GLuint texture) noexcept;
+  static void bindFramebuffer(GLenum target, GLuint fbo) noexcept;
+  static void bindRenderbuffer(GLuint rbo) noexcept;
+  static void setEnabled(GLenum cap, bool enabled) noexcept;
+  static void blendFunc(GLenum src, GLenum dst) noexcept;
+  static void depthFunc(GLenum func) noexcept;
+  static void depthMask(bool write) noexcept;
+
+  static void deleteProgram(GLuint program) noexcept;
+  static void deleteVertexArrays(GLsizei count, const GLuint* vaos) noexcept;
+  static void deleteBuffers(GLsizei count, const GLuint* buffers) noexcept;
+  static void deleteTextures(GLsizei count, const GLuint* textures) noexcept;
+  static void deleteFramebuffers(GLsizei count, const GLuint* fbos) noexcept;
+  static void deleteRenderbuffers(GLsizei count, const GLuint* rbos) noexcept;
+
+  /**
+   * @brief Currently bound objects as far as the shadow knows, 0 also when
+   * unknown.
+   */
+  static GLuint getProgram() noexcept;
+  static GLuint getVertexArray() noexcept;
+  static GLuint getBuffer(GLenum target) noexcept;
+  static GLuint getTexture(GLenum target) noexcept;
+  static GLuint getFramebuffer(GLenum target) noexcept;
+
+  /**
+   * @brief Forget everything, the next call of each kind is issued.
+   */
+  static void invalidate() noexcept;
+  static const GlStateStats& getStats() noexcept;
+  static void resetStats() noexcept;
+};
+
+}  // namespace agt3d
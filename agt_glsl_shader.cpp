@@ -1,9 +1,23 @@
 #include "agt_glsl_shader.h"
+#include "agt_gl_state.h"
+#include "agt_utils.h"
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
 
 static std::string glslVersion = "#version 330 core";
 
+static std::filesystem::path programCacheDirectory;
+
+static agt3d::ProgramCacheStats programCacheStats;
+
 static std::unordered_map<std::string, agt3d::Shader> cachedShaders;
 
+static agt3d::UniformStats uniformStats;
+
 namespace agt3d
 {
 void log(const std::string& msg) { std::cerr << msg << "\n"; }
@@ -15,6 +29,25 @@ void setGlslVersion(const std::string& version) noexcept
 
 std::string getGlslVersion() noexcept { return glslVersion; }
 
+void setProgramCacheDirectory(const std::filesystem::path& directory) noexcept
+{
+  programCacheDirectory = directory;
+  if (directory.empty()) {
+    return;
+  }
+  std::error_code error;
+  std::filesystem::create_directories(directory, error);
+  if (error) {
+    log("program cache: can't create " + directory.string() + ", disabled");
+    programCacheDirectory.clear();
+  }
+}
+
+const ProgramCacheStats& getProgramCacheStats() noexcept
+{
+  return programCacheStats;
+}
+
 std::optional<std::string> validateShader(GLuint shaderIndex)
 {
   GLint success = GL_FALSE;
@@ -99,7 +132,25 @@ std::map<std::string, GLuint> collectAttributes(GLuint program) noexcept
   return attributes;
 }
 
-std::map<std::string, GLuint> collectUniforms(GLuint program) noexcept
+void buildUniformSlots(Shader& shader) noexcept
+{
+  auto slots = std::make_shared<std::vector<UniformSlot>>();
+  for (const auto& [name, loc] : shader.uniforms) {
+    slots->push_back(
+      {UniformId(name).hash, static_cast<GLint>(loc), std::nullopt});
+  }
+  std::sort(slots->begin(), slots->end(),
+            [](const UniformSlot& a, const UniformSlot& b) {
+              return a.id < b.id;
+            });
+  for (size_t i = 1; i < slots->size(); i++) {
+    MY_ASSERT((*slots)[i - 1].id != (*slots)[i].id,
+              "Uniform name hash collision");
+  }
+  shader.uniformSlots = std::move(slots);
+}
+
+void collectUniforms(Shader& shader) noexcept
 {
   GLint count;
   GLint size;
@@ -107,6 +158,7 @@ std::map<std::string, GLuint> collectUniforms(GLuint program) noexcept
   const GLsizei bufSize = 256;
   GLsizei length;
   GLchar name[bufSize] = {'\0'};
+  GLuint program = shader.program;
 
   std::map<std::string, GLuint> uniforms;
 
@@ -117,13 +169,264 @@ std::map<std::string, GLuint> collectUniforms(GLuint program) noexcept
     glGetActiveUniform(program, (GLuint)i, bufSize, &length, &size, &type,
                        name);
     auto loc = glGetUniformLocation(program, name);
-    uniforms[name] = loc;
     std::cout << "Uniform #" << i << " Type: " << type << " Name: " << name
               << " Loc: " << loc << " Size: " << size << " Length: " << length
               << "\n";
+    // Members of uniform blocks have no location
+    if (loc != -1) {
+      uniforms[name] = loc;
+    }
+  }
+  shader.uniforms = std::move(uniforms);
+  buildUniformSlots(shader);
+}
+
+
+std::map<std::string, GLuint> collectUniformBlocks(GLuint program) noexcept
+{
+  GLint count;
+  const GLsizei bufSize = 256;
+  GLsizei length;
+  GLchar name[bufSize] = {'\0'};
+
+  std::map<std::string, GLuint> blocks;
+
+  glGetProgramiv(program, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+  for (GLint i = 0; i < count; i++) {
+    glGetActiveUniformBlockName(program, (GLuint)i, bufSize, &length, name);
+    blocks[name] = (GLuint)i;
+  }
+
+  return blocks;
+}
+
+/// Bumped whenever the layout of the cache files or the way programs are
+/// linked changes.
+static constexpr uint32_t programCacheVersion = 2;
+static constexpr uint64_t programCacheMagic = 0x4e42475250544741ull;
+
+bool programCacheEnabled() noexcept
+{
+  if (programCacheDirectory.empty() ||
+      !(GLAD_GL_VERSION_4_1 || GLAD_GL_ARB_get_program_binary)) {
+    return false;
+  }
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  return formats > 0;
+}
+
+/**
+ * @brief Hash of the driver and of every source string passed to the
+ * compiler, in order.
+ */
+uint64_t programKey(
+  std::initializer_list<std::span<const GLchar* const>> stages) noexcept
+{
+  uint64_t h = hash64(&programCacheVersion, sizeof(programCacheVersion));
+  auto add = [&h](const char* text) {
+    size_t length = text ? strlen(text) : 0;
+    h = hash64(&length, sizeof(length), h);
+    h = hash64(text, length, h);
+  };
+  for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+    add(reinterpret_cast<const char*>(glGetString(name)));
+  }
+  for (auto sources : stages) {
+    size_t count = sources.size();
+    h = hash64(&count, sizeof(count), h);
+    for (auto source : sources) {
+      add(source);
+    }
+  }
+  return h;
+}
+
+std::filesystem::path programCachePath(uint64_t key)
+{
+  std::ostringstream name;
+  name << std::hex << std::setw(16) << std::setfill('0') << key << ".bin";
+  return programCacheDirectory / name.str();
+}
+
+/**
+ * @brief Bounds checked reads from a cache file, ok turns false on the first
+ * read past the end.
+ */
+struct CacheReader {
+  const std::vector<uint8_t>& data;
+  size_t offset = 0;
+  bool ok = true;
+
+  template <typename T>
+  T read() noexcept
+  {
+    T value{};
+    if (!ok || data.size() - offset < sizeof(T)) {
+      ok = false;
+      return value;
+    }
+    memcpy(&value, data.data() + offset, sizeof(T));
+    offset += sizeof(T);
+    return value;
   }
+  const uint8_t* bytes(size_t size) noexcept
+  {
+    if (!ok || data.size() - offset < size) {
+      ok = false;
+      return nullptr;
+    }
+    offset += size;
+    return data.data() + offset - size;
+  }
+  std::map<std::string, GLuint> table()
+  {
+    std::map<std::string, GLuint> entries;
+    auto count = read<uint32_t>();
+    for (uint32_t i = 0; i < count && ok; i++) {
+      auto length = read<uint32_t>();
+      auto name = reinterpret_cast<const char*>(bytes(length));
+      auto value = read<GLuint>();
+      if (ok) {
+        entries.emplace(std::string(name, length), value);
+      }
+    }
+    return entries;
+  }
+};
+
+template <typename T>
+void writeValue(std::vector<uint8_t>& out, const T& value)
+{
+  auto bytes = reinterpret_cast<const uint8_t*>(&value);
+  out.insert(out.end(), bytes, bytes + sizeof(T));
+}
 
-  return uniforms;
+void writeTable(std::vector<uint8_t>& out,
+                const std::map<std::string, GLuint>& entries)
+{
+  writeValue(out, static_cast<uint32_t>(entries.size()));
+  for (const auto& [name, value] : entries) {
+    writeValue(out, static_cast<uint32_t>(name.size()));
+    out.insert(out.end(), name.begin(), name.end());
+    writeValue(out, value);
+  }
+}
+
+/**
+ * @brief Create the program from its cached binary and tables.
+ */
+std::optional<Shader> loadProgramBinary(uint64_t key)
+{
+  auto t0 = std::chrono::steady_clock::now();
+  std::ifstream file(programCachePath(key), std::ios::in | std::ios::binary);
+  if (!file.is_open()) {
+    return std::nullopt;
+  }
+  std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)),
+                            std::istreambuf_iterator<char>());
+
+  CacheReader reader{data};
+  bool valid = reader.read<uint64_t>() == programCacheMagic &&
+               reader.read<uint64_t>() == key;
+  auto format = reader.read<GLenum>();
+  auto size = reader.read<uint32_t>();
+  auto binary = reader.bytes(size);
+  Shader shader;
+  shader.attributes = reader.table();
+  shader.uniforms = reader.table();
+  shader.uniformBlocks = reader.table();
+  if (!valid || !reader.ok || reader.offset != data.size()) {
+    log(programCachePath(key).string() + ": invalid program cache file");
+    programCacheStats.rejected++;
+    return std::nullopt;
+  }
+
+  auto prog = glCreateProgram();
+  glProgramBinary(prog, format, binary, static_cast<GLsizei>(size));
+  GLint linked = GL_FALSE;
+  glGetProgramiv(prog, GL_LINK_STATUS, &linked);
+  if (!linked) {
+    // Usually a driver update the version string didn't reveal
+    GlState::deleteProgram(prog);
+    programCacheStats.rejected++;
+    return std::nullopt;
+  }
+
+  shader.program = prog;
+  shader.compiled = true;
+  buildUniformSlots(shader);
+  programCacheStats.hits++;
+  programCacheStats.loadMs += std::chrono::duration<double, std::milli>(
+                                std::chrono::steady_clock::now() - t0)
+                                .count();
+  return shader;
+}
+
+/**
+ * @brief Name for a temporary file no other process or thread writes at the
+ * same time.
+ */
+std::string uniqueTempSuffix()
+{
+#ifdef _WIN32
+  auto pid = _getpid();
+#else
+  auto pid = getpid();
+#endif
+  thread_local std::mt19937_64 random(
+    std::random_device{}() ^
+    std::hash<std::thread::id>()(std::this_thread::get_id()));
+  std::ostringstream suffix;
+  suffix << ".tmp" << pid << "-" << std::hex << random();
+  return suffix.str();
+}
+
+/**
+ * @brief Write the binary and tables of a freshly linked program. The file
+ * is written next to its final name and renamed, so concurrent processes
+ * never read a partial file.
+ */
+void storeProgramBinary(uint64_t key, const Shader& shader)
+{
+  GLint size = 0;
+  glGetProgramiv(shader.program, GL_PROGRAM_BINARY_LENGTH, &size);
+  if (size <= 0) {
+    return;
+  }
+  std::vector<uint8_t> binary(size);
+  GLenum format = 0;
+  glGetProgramBinary(shader.program, size, &size, &format, binary.data());
+  binary.resize(size);
+
+  std::vector<uint8_t> out;
+  writeValue(out, programCacheMagic);
+  writeValue(out, key);
+  writeValue(out, format);
+  writeValue(out, static_cast<uint32_t>(binary.size()));
+  out.insert(out.end(), binary.begin(), binary.end());
+  writeTable(out, shader.attributes);
+  writeTable(out, shader.uniforms);
+  writeTable(out, shader.uniformBlocks);
+
+  auto path = programCachePath(key);
+  auto temp = path;
+  temp += uniqueTempSuffix();
+  {
+    std::ofstream file(temp, std::ios::out | std::ios::binary);
+    file.write(reinterpret_cast<const char*>(out.data()), out.size());
+    if (!file.good()) {
+      log(temp.string() + ": failed to write program cache file");
+      return;
+    }
+  }
+  std::error_code error;
+  std::filesystem::rename(temp, path, error);
+  if (error) {
+    std::filesystem::remove(temp, error);
+    return;
+  }
+  programCacheStats.stores++;
 }
 
 std::optional<Shader> compileShader(const std::string& path) noexcept
@@ -132,14 +435,33 @@ std::optional<Shader> compileShader(const std::string& path) noexcept
   if (!source) {
     return std::nullopt;
   }
+  auto shader = compileShaderSource(source->glslShaderSource);
+  if (shader) {
+    shader->glslShaderPath = path;
+  }
+  return shader;
+}
 
+std::optional<Shader> compileShaderSource(const std::string& source) noexcept
+{
   auto tmp = glslVersion + "\n";
   const char* version = tmp.c_str();
 
   const GLchar* vertexSources[] = {version, "#define VERTEX\n",
-                                   source->glslShaderSource.c_str()};
+                                   source.c_str()};
   const GLchar* fragmentSources[] = {version, "#define FRAGMENT\n",
-                                     source->glslShaderSource.c_str()};
+                                     source.c_str()};
+
+  std::optional<uint64_t> key;
+  auto t0 = std::chrono::steady_clock::now();
+  if (programCacheEnabled()) {
+    key = programKey({vertexSources, fragmentSources});
+    if (auto cached = loadProgramBinary(*key)) {
+      cached->glslShaderSource = source;
+      return cached;
+    }
+    programCacheStats.misses++;
+  }
 
   auto vert = glCreateShader(GL_VERTEX_SHADER);
   auto frag = glCreateShader(GL_FRAGMENT_SHADER);
@@ -161,6 +483,11 @@ std::optional<Shader> compileShader(const std::string& path) noexcept
   auto prog = glCreateProgram();
   glAttachShader(prog, vert);
   glAttachShader(prog, frag);
+  glBindAttribLocation(prog, instanceModelLocation, "instanceModel");
+  glBindAttribLocation(prog, instanceColorLocation, "instanceColor");
+  if (key) {
+    glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  }
   glLinkProgram(prog);
   if (validateProgram(prog)) {
     return {};
@@ -175,18 +502,81 @@ std::optional<Shader> compileShader(const std::string& path) noexcept
 #endif
   Shader shader;
   shader.program = prog;
-  shader.glslShaderPath = path;
+  shader.glslShaderSource = source;
   shader.compiled = true;
 
   shader.attributes = collectAttributes(shader.program);
-  shader.uniforms = collectUniforms(shader.program);
+  collectUniforms(shader);
+  shader.uniformBlocks = collectUniformBlocks(shader.program);
+
+  if (key) {
+    storeProgramBinary(*key, shader);
+    programCacheStats.compileMs += std::chrono::duration<double, std::milli>(
+                                     std::chrono::steady_clock::now() - t0)
+                                     .count();
+  }
+  return shader;
+}
+
+std::optional<Shader> compileComputeShader(const std::string& source) noexcept
+{
+  // Compute needs GLSL 4.30, the global version is usually lower
+  std::string version = "#version 430 core\n";
+  const GLchar* sources[] = {version.c_str(), "#define COMPUTE\n",
+                             source.c_str()};
+
+  std::optional<uint64_t> key;
+  auto t0 = std::chrono::steady_clock::now();
+  if (programCacheEnabled()) {
+    key = programKey({sources});
+    if (auto cached = loadProgramBinary(*key)) {
+      cached->glslShaderSource = source;
+      return cached;
+    }
+    programCacheStats.misses++;
+  }
 
+  auto comp = glCreateShader(GL_COMPUTE_SHADER);
+  glShaderSource(comp, sizeof(sources) / sizeof(*sources), sources, NULL);
+  glCompileShader(comp);
+  if (validateShader(comp)) {
+    glDeleteShader(comp);
+    return {};
+  }
+
+  auto prog = glCreateProgram();
+  glAttachShader(prog, comp);
+  if (key) {
+    glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  }
+  glLinkProgram(prog);
+  glDeleteShader(comp);
+  if (validateProgram(prog)) {
+    GlState::deleteProgram(prog);
+    return {};
+  }
+#ifdef VERBOSE
+  std::cout << "glsl compute compiled: " << prog << "\n";
+#endif
+  Shader shader;
+  shader.program = prog;
+  shader.glslShaderSource = source;
+  shader.compiled = true;
+  collectUniforms(shader);
+  shader.uniformBlocks = collectUniformBlocks(shader.program);
+
+  if (key) {
+    storeProgramBinary(*key, shader);
+    programCacheStats.compileMs += std::chrono::duration<double, std::milli>(
+                                     std::chrono::steady_clock::now() - t0)
+                                     .count();
+  }
   return shader;
 }
 
 void unloadShader(Shader& shader) noexcept
 {
-  glDeleteProgram(shader.program);
+  GlState::deleteProgram(shader.program);
   // todo
   log("### not implemented!");
   abort();
@@ -213,5 +603,59 @@ std::optional<const Shader*> getShader(const std::string& id) noexcept
   return &(cachedShaders[id]);
 }
 
-void useShader(const Shader& shader) noexcept { glUseProgram(shader.program); }
+void useShader(const Shader& shader) noexcept
+{
+  GlState::useProgram(shader.program);
+}
+
+bool setUniform(const Shader& shader, UniformId id, const shader_param_t& param,
+                int locationOffset) noexcept
+{
+  auto slot = findUniformSlot(shader, id);
+  if (!slot) {
+    return false;
+  }
+  if (locationOffset == 0) {
+    if (slot->value == param) {
+      uniformStats.skipped++;
+      return false;
+    }
+    slot->value = param;
+  }
+  GLint loc = slot->location + locationOffset;
+  uniformStats.issued++;
+
+  if (auto v = std::get_if<float>(&param)) {
+    glUniform1f(loc, *v);
+  } else if (auto v = std::get_if<int>(&param)) {
+    glUniform1i(loc, *v);
+  } else if (auto v = std::get_if<glm::vec2>(&param)) {
+    glUniform2f(loc, v->x, v->y);
+  } else if (auto v = std::get_if<glm::vec3>(&param)) {
+    glUniform3f(loc, v->x, v->y, v->z);
+  } else if (auto v = std::get_if<glm::vec4>(&param)) {
+    glUniform4f(loc, v->x, v->y, v->z, v->w);
+  } else if (auto v = std::get_if<glm::mat3>(&param)) {
+    glUniformMatrix3fv(loc, 1, GL_FALSE, (const GLfloat*)glm::value_ptr(*v));
+  } else if (auto v = std::get_if<glm::mat4>(&param)) {
+    glUniformMatrix4fv(loc, 1, GL_FALSE, (const GLfloat*)glm::value_ptr(*v));
+  } else {
+    MY_ABORT("param type not implemented");
+  }
+  return true;
+}
+
+void invalidateUniforms(const Shader& shader) noexcept
+{
+  if (!shader.uniformSlots) {
+    return;
+  }
+  for (auto& slot : *shader.uniformSlots) {
+    slot.value.reset();
+  }
+}
+
+const UniformStats& getUniformStats() noexcept { return uniformStats; }
+
+void resetUniformStats() noexcept { uniformStats = UniformStats(); }
 }  // namespace agt3d
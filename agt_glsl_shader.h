@@ -7,69 +7,170 @@ namespace agt3d
 {
 using shader_param_t = std::variant<int, float, glm::vec2, glm::vec3, glm::vec4,
                                     glm::mat3, glm::mat4>;
+
+/**
+ * @brief Location table entry of a uniform.
+ */
+struct UniformSlot {
+  uint64_t id = 0;
+  GLint location = -1;
+  /// Last value set through setUniform(), empty until the first set.
+  std::optional<shader_param_t> value;
+};
+
+/**
+ * @brief Uniform name interned as its 64-bit FNV-1a hash. Constructed from a
+ * literal in a constexpr context, e.g. "static constexpr UniformId
+ * model("model")", the hash is computed at compile time.
+ */
+struct UniformId {
+  uint64_t hash = 0;
+
+  static constexpr uint64_t hashName(std::string_view name) noexcept
+  {
+    uint64_t h = 14695981039346656037ull;
+    for (char c : name) {
+      h ^= static_cast<uint8_t>(c);
+      h *= 1099511628211ull;
+    }
+    return h;
+  }
+  constexpr UniformId(const char* name) noexcept : hash(hashName(name)) {}
+  UniformId(const std::string& name) noexcept : hash(hashName(name)) {}
+  explicit constexpr UniformId(uint64_t _hash) noexcept : hash(_hash) {}
+  constexpr bool operator==(const UniformId& other) const noexcept
+  {
+    return hash == other.hash;
+  }
+};
+
 struct Shader {
   std::map<std::string, GLuint> uniforms;
   std::map<std::string, GLuint> attributes;
+  /// Active uniform blocks, name to block index. Their members are not in
+  /// uniforms.
+  std::map<std::string, GLuint> uniformBlocks;
+  /// Uniforms sorted by UniformId, shared by all copies of the shader so
+  /// they agree on the values the program holds.
+  std::shared_ptr<std::vector<UniformSlot>> uniformSlots;
   std::string glslShaderPath;
   std::string glslShaderSource;
   uint32_t program;
   bool compiled;
 };
 
+/// Locations compileShader() binds the per instance vertex attributes "mat4
+/// instanceModel" (four locations) and "vec4 instanceColor" to, after the
+/// mesh streams (agt3d::DataStream). Explicit layout qualifiers override them.
+constexpr GLuint instanceModelLocation = 6;
+constexpr GLuint instanceColorLocation = 10;
+
+/**
+ * @brief Uniform uploads through setUniform() since the last reset.
+ */
+struct UniformStats {
+  size_t issued = 0;
+  /// Values equal to the one the program already holds.
+  size_t skipped = 0;
+};
+
+/**
+ * @brief Program binary cache activity since startup.
+ */
+struct ProgramCacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  /// Cache files that didn't parse or were refused by the driver, their
+  /// programs are compiled from source and the files replaced.
+  size_t rejected = 0;
+  size_t stores = 0;
+  /// Spent loading hits and compiling misses.
+  double loadMs = 0;
+  double compileMs = 0;
+};
+
 void setGlslVersion(const std::string& version) noexcept;
 std::string getGlslVersion() noexcept;
+/**
+ * @brief Keep linked programs in this directory and load them from there
+ * instead of compiling, an empty path (the default) disables the cache.
+ *
+ * Programs are stored with glGetProgramBinary() together with their
+ * attribute, uniform and uniform block tables, in a file named after a hash
+ * of the GLSL version, the #define prelude, the source and the GL vendor,
+ * renderer and version strings. Any change of those misses the cache, and a
+ * binary the driver refuses falls back to compiling from source. Needs GL 4.1
+ * or ARB_get_program_binary with at least one binary format, otherwise
+ * programs are always compiled.
+ */
+void setProgramCacheDirectory(const std::filesystem::path& directory) noexcept;
+const ProgramCacheStats& getProgramCacheStats() noexcept;
 
 std::optional<Shader> compileShader(const std::string& path) noexcept;
+/**
+ * @brief Compile a vertex and fragment program from one source, like
+ * compileShader() does with the content of a file.
+ */
+std::optional<Shader> compileShaderSource(const std::string& source) noexcept;
+/**
+ * @brief Compile a compute program from source, always as GLSL 4.30 and with
+ * COMPUTE defined. Needs GL 4.3 or ARB_compute_shader.
+ */
+std::optional<Shader> compileComputeShader(const std::string& source) noexcept;
 void cacheShader(const std::string& id, const Shader& shader) noexcept;
 std::optional<const Shader*> getShader(const std::string& id) noexcept;
 void useShader(const Shader& shader) noexcept;
 
-inline bool hasUniform(const Shader& shader, const std::string& name) noexcept
+inline UniformSlot* findUniformSlot(const Shader& shader, UniformId id) noexcept
+{
+  if (!shader.uniformSlots) {
+    return nullptr;
+  }
+  auto& slots = *shader.uniformSlots;
+  auto it = std::lower_bound(
+    slots.begin(), slots.end(), id.hash,
+    [](const UniformSlot& slot, uint64_t hash) { return slot.id < hash; });
+  return it != slots.end() && it->id == id.hash ? &*it : nullptr;
+}
+
+inline bool hasUniform(const Shader& shader, UniformId id) noexcept
 {
-  auto it = shader.uniforms.find(name);
-  return it != shader.uniforms.end();
+  return findUniformSlot(shader, id) != nullptr;
 }
 
-inline GLuint getUniformLoc(const Shader& shader,
+inline bool hasUniformBlock(const Shader& shader,
                             const std::string& name) noexcept
 {
-  if (!hasUniform(shader, name)) {
-    return 0;
-  }
-  return shader.uniforms.at(name);
+  return shader.uniformBlocks.find(name) != shader.uniformBlocks.end();
 }
 
-inline void setUniform(const Shader& shader, const std::string& name,
-                       const agt3d::shader_param_t param, int locationOffset = 0) noexcept
+inline bool hasAttribute(const Shader& shader, const std::string& name) noexcept
 {
-  auto loc = getUniformLoc(shader, name);
-
-  if (std::get_if<float>(&param)) {
-    glUniform1f(loc + locationOffset, std::get<float>(param));
-  } else if (std::get_if<int>(&param)) {
-    glUniform1i(loc + locationOffset, std::get<int>(param));
-  } else if (std::get_if<glm::vec2>(&param)) {
-    glUniform2f(loc + locationOffset, std::get<glm::vec2>(param).x,
-                std::get<glm::vec2>(param).y);
-  } else if (std::get_if<glm::vec3>(&param)) {
-    glUniform3f(loc + locationOffset, std::get<glm::vec3>(param).x,
-                std::get<glm::vec3>(param).y,
-                std::get<glm::vec3>(param).z);
-  } else if (std::get_if<glm::vec4>(&param)) {
-    glUniform4f(loc + locationOffset, std::get<glm::vec4>(param).x,
-                std::get<glm::vec4>(param).y,
-                std::get<glm::vec4>(param).z, std::get<glm::vec4>(param).w);
-  } else if (std::get_if<glm::mat3>(&param)) {
-    glUniformMatrix3fv(
-      loc + locationOffset, 1, GL_FALSE,
-      (const GLfloat*)glm::value_ptr(std::get<glm::mat3>(param)));
-  } else if (std::get_if<glm::mat4>(&param)) {
-    glUniformMatrix4fv(
-      loc + locationOffset, 1, GL_FALSE,
-      (const GLfloat*)glm::value_ptr(std::get<glm::mat4>(param)));
-  } else {
-    MY_ABORT("param type not implemented");
-  }
+  return shader.attributes.find(name) != shader.attributes.end();
 }
 
+inline GLuint getUniformLoc(const Shader& shader, UniformId id) noexcept
+{
+  auto slot = findUniformSlot(shader, id);
+  return slot ? static_cast<GLuint>(slot->location) : 0;
+}
+
+/**
+ * @brief Upload a uniform unless the program already holds the value, the
+ * program has to be in use. Uniforms the program doesn't have are ignored. A locationOffset addresses
+ * an element of an array, those are always uploaded. Values set with
+ * glUniform directly bypass the shadow copy, call invalidateUniforms() after.
+ * @return true if a glUniform call was issued.
+ */
+bool setUniform(const Shader& shader, UniformId id,
+                const agt3d::shader_param_t& param,
+                int locationOffset = 0) noexcept;
+/**
+ * @brief Forget the values the program is known to hold, the next
+ * setUniform() of every uniform uploads.
+ */
+void invalidateUniforms(const Shader& shader) noexcept;
+const UniformStats& getUniformStats() noexcept;
+void resetUniformStats() noexcept;
+
 };  // namespace agt3d
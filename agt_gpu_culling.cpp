@@ -0,0 +1,325 @@
+#include "agt_gpu_culling.h"
+
+#include "agt_gl_state.h"
+#include "agt_mesh.h"
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+static constexpr GLuint workGroupSize = 64;
+
+static const char* cullSource = R"(
+layout(local_size_x = 64) in;
+
+struct Instance {
+  vec4 sphere;
+  uint draw;
+  uint pad0;
+  uint pad1;
+  uint pad2;
+};
+struct Command {
+  uint count;
+  uint instanceCount;
+  uint firstIndex;
+  int baseVertex;
+  uint baseInstance;
+};
+
+layout(std430, binding = 0) readonly buffer Instances { Instance instances[]; };
+layout(std430, binding = 1) buffer Commands { Command commands[]; };
+layout(std430, binding = 2) writeonly buffer Visible { uint visible[]; };
+
+uniform vec4 planes[6];
+uniform uint instanceCount;
+
+void main()
+{
+  uint i = gl_GlobalInvocationID.x;
+  if (i >= instanceCount) {
+    return;
+  }
+  vec4 s = instances[i].sphere;
+  for (int p = 0; p < 6; p++) {
+    if (dot(planes[p].xyz, s.xyz) + planes[p].w < -s.w) {
+      return;
+    }
+  }
+  uint d = instances[i].draw;
+  uint slot = atomicAdd(commands[d].instanceCount, 1u);
+  visible[commands[d].baseInstance + slot] = i;
+}
+)";
+
+/**
+ * @brief Same test as the compute shader.
+ */
+static bool sphereVisible(const Frustum& frustum, const glm::vec4& s) noexcept
+{
+  for (const auto& plane : frustum.planes) {
+    if (glm::dot(glm::vec3(plane), glm::vec3(s)) + plane.w < -s.w) {
+      return false;
+    }
+  }
+  return true;
+}
+
+GpuCuller::GpuCuller()
+{
+  computeSupported = GLAD_GL_VERSION_4_3 || GLAD_GL_ARB_compute_shader;
+  baseInstanceSupported = GLAD_GL_VERSION_4_2 || GLAD_GL_ARB_base_instance;
+  if (computeSupported) {
+    program = compileComputeShader(cullSource);
+    if (!program) {
+      std::cerr << "GpuCuller: compute shader failed, culling on the CPU"
+                << std::endl;
+      computeSupported = false;
+    }
+  }
+  glGenBuffers(1, &instanceBuffer);
+  glGenBuffers(1, &templateBuffer);
+  glGenBuffers(1, &commandBuffer);
+  glGenBuffers(1, &visibleBuffer);
+}
+
+GpuCuller::~GpuCuller()
+{
+  if (program) {
+    GlState::deleteProgram(program->program);
+  }
+  GlState::deleteBuffers(1, &instanceBuffer);
+  GlState::deleteBuffers(1, &templateBuffer);
+  GlState::deleteBuffers(1, &commandBuffer);
+  GlState::deleteBuffers(1, &visibleBuffer);
+}
+
+uint32_t GpuCuller::addDraw(const Mesh& mesh)
+{
+  DrawElementsIndirectCommand command;
+  command.count = static_cast<GLuint>(mesh.getIndexCount());
+  command.firstIndex = mesh.firstIndex;
+  command.baseVertex = static_cast<GLint>(mesh.baseVertex);
+  templates.push_back(command);
+  // The command buffers are sized for the draws known so far
+  layoutDirty = true;
+  return static_cast<uint32_t>(templates.size() - 1);
+}
+
+void GpuCuller::setInstances(const std::vector<CullInstance>& _instances)
+{
+  instances = _instances;
+  layoutSegments();
+
+  GlState::bindBuffer(GL_COPY_WRITE_BUFFER, instanceBuffer);
+  glBufferData(GL_COPY_WRITE_BUFFER,
+               std::max<size_t>(1, instances.size()) * sizeof(CullInstance),
+               instances.data(), GL_DYNAMIC_DRAW);
+  GlState::bindBuffer(GL_COPY_WRITE_BUFFER, visibleBuffer);
+  glBufferData(GL_COPY_WRITE_BUFFER,
+               std::max<size_t>(1, instances.size()) * sizeof(uint32_t),
+               nullptr, GL_DYNAMIC_COPY);
+  checkOpenGLErrors();
+}
+
+void GpuCuller::layoutSegments()
+{
+  // Segment per draw, sized for all of its instances
+  for (auto& command : templates) {
+    command.baseInstance = 0;
+  }
+  for (const auto& instance : instances) {
+    MY_ASSERT(instance.draw < templates.size(), "Unknown draw");
+    templates[instance.draw].baseInstance++;
+  }
+  GLuint offset = 0;
+  for (auto& command : templates) {
+    auto count = command.baseInstance;
+    command.baseInstance = offset;
+    command.instanceCount = 0;
+    offset += count;
+  }
+  uploadCommandTemplate();
+  layoutDirty = false;
+}
+
+void GpuCuller::updateInstances(size_t first, const CullInstance* data,
+                                size_t count)
+{
+  MY_ASSERT(first + count <= instances.size(), "Range exceeds the instances");
+  for (size_t i = 0; i < count; i++) {
+    MY_ASSERT(data[i].draw == instances[first + i].draw,
+              "Instances can't change their draw");
+  }
+  std::copy(data, data + count, instances.begin() + first);
+  GlState::bindBuffer(GL_COPY_WRITE_BUFFER, instanceBuffer);
+  glBufferSubData(GL_COPY_WRITE_BUFFER, first * sizeof(CullInstance),
+                  count * sizeof(CullInstance), data);
+}
+
+void GpuCuller::uploadCommandTemplate()
+{
+  size_t bytes = std::max<size_t>(1, templates.size()) *
+                 sizeof(DrawElementsIndirectCommand);
+  GlState::bindBuffer(GL_COPY_WRITE_BUFFER, templateBuffer);
+  glBufferData(GL_COPY_WRITE_BUFFER, bytes, templates.data(), GL_STATIC_DRAW);
+  GlState::bindBuffer(GL_COPY_WRITE_BUFFER, commandBuffer);
+  glBufferData(GL_COPY_WRITE_BUFFER, bytes, templates.data(), GL_DYNAMIC_COPY);
+}
+
+bool GpuCuller::isComputeSupported() const noexcept
+{
+  return computeSupported;
+}
+
+void GpuCuller::cull(const Frustum& frustum)
+{
+  if (templates.empty()) {
+    return;
+  }
+  if (layoutDirty) {
+    layoutSegments();
+  }
+  culledDraws = templates.size();
+
+  if (!computeSupported) {
+    cpuResult = cullCpu(frustum);
+    const auto& result = cpuResult;
+    GlState::bindBuffer(GL_COPY_WRITE_BUFFER, commandBuffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, 0,
+                    result.commands.size() * sizeof(DrawElementsIndirectCommand),
+                    result.commands.data());
+    GlState::bindBuffer(GL_COPY_WRITE_BUFFER, visibleBuffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, 0,
+                    result.instanceIndices.size() * sizeof(uint32_t),
+                    result.instanceIndices.data());
+    return;
+  }
+
+  // Reset the counters on the GPU
+  GlState::bindBuffer(GL_COPY_READ_BUFFER, templateBuffer);
+  GlState::bindBuffer(GL_COPY_WRITE_BUFFER, commandBuffer);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0,
+                      templates.size() * sizeof(DrawElementsIndirectCommand));
+
+  useShader(*program);
+  glUniform4fv(getUniformLoc(*program, "planes[0]"), 6,
+               glm::value_ptr(frustum.planes[0]));
+  glUniform1ui(getUniformLoc(*program, "instanceCount"),
+               static_cast<GLuint>(instances.size()));
+  GlState::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instanceBuffer);
+  GlState::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, commandBuffer);
+  GlState::bindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, visibleBuffer);
+  auto groups = static_cast<GLuint>((instances.size() + workGroupSize - 1) /
+                                    workGroupSize);
+  if (groups > 0) {
+    glDispatchCompute(groups, 1, 1);
+  }
+  glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT |
+                  GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT |
+                  GL_BUFFER_UPDATE_BARRIER_BIT);
+  GlState::useProgram(0);
+  checkOpenGLErrors();
+}
+
+CullResult GpuCuller::cullCpu(const Frustum& frustum) const
+{
+  CullResult result;
+  result.commands = templates;
+  result.instanceIndices.resize(instances.size());
+  for (uint32_t i = 0; i < instances.size(); i++) {
+    if (!sphereVisible(frustum, instances[i].sphere)) {
+      continue;
+    }
+    auto& command = result.commands[instances[i].draw];
+    result.instanceIndices[command.baseInstance + command.instanceCount++] = i;
+  }
+  return result;
+}
+
+CullResult GpuCuller::readBack() const
+{
+  CullResult result;
+  result.commands.resize(culledDraws);
+  result.instanceIndices.resize(instances.size());
+  GlState::bindBuffer(GL_COPY_READ_BUFFER, commandBuffer);
+  glGetBufferSubData(GL_COPY_READ_BUFFER, 0,
+                     culledDraws * sizeof(DrawElementsIndirectCommand),
+                     result.commands.data());
+  GlState::bindBuffer(GL_COPY_READ_BUFFER, visibleBuffer);
+  glGetBufferSubData(GL_COPY_READ_BUFFER, 0,
+                     instances.size() * sizeof(uint32_t),
+                     result.instanceIndices.data());
+
+  // Only the written part of every segment is meaningful
+  std::vector<uint32_t> indices(instances.size(), 0);
+  for (const auto& command : result.commands) {
+    auto begin = result.instanceIndices.begin() + command.baseInstance;
+    std::sort(begin, begin + command.instanceCount);
+    std::copy(begin, begin + command.instanceCount,
+              indices.begin() + command.baseInstance);
+  }
+  result.instanceIndices.swap(indices);
+  return result;
+}
+
+void GpuCuller::draw(GLenum mode) const
+{
+  if (culledDraws == 0) {
+    return;
+  }
+  if (!hasMultiDrawIndirect()) {
+    // Only reachable with the CPU fallback, which knows the counts
+    for (const auto& command : cpuResult.commands) {
+      if (command.instanceCount == 0) {
+        continue;
+      }
+      auto indices = reinterpret_cast<const void*>(command.firstIndex *
+                                                   sizeof(unsigned int));
+      if (baseInstanceSupported) {
+        glDrawElementsInstancedBaseVertexBaseInstance(
+          mode, command.count, GL_UNSIGNED_INT, indices,
+          command.instanceCount, command.baseVertex, command.baseInstance);
+        continue;
+      }
+      // Point the visible attribute at the segment instead
+      if (visibleLocation) {
+        pointVisibleAttribute(*visibleLocation, command.baseInstance);
+      }
+      glDrawElementsInstancedBaseVertex(mode, command.count, GL_UNSIGNED_INT,
+                                        indices, command.instanceCount,
+                                        command.baseVertex);
+    }
+    return;
+  }
+  GlState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+  glMultiDrawElementsIndirect(mode, GL_UNSIGNED_INT, nullptr,
+                              static_cast<GLsizei>(culledDraws), 0);
+}
+
+void GpuCuller::bindVisibleAsAttribute(GLuint location) const
+{
+  glEnableVertexAttribArray(location);
+  pointVisibleAttribute(location, 0);
+  glVertexAttribDivisor(location, 1);
+  visibleLocation = location;
+}
+
+void GpuCuller::pointVisibleAttribute(GLuint location, GLuint first) const
+{
+  GlState::bindBuffer(GL_ARRAY_BUFFER, visibleBuffer);
+  glVertexAttribIPointer(location, 1, GL_UNSIGNED_INT, sizeof(uint32_t),
+                         reinterpret_cast<const void*>(first *
+                                                       sizeof(uint32_t)));
+}
+
+GLuint GpuCuller::getCommandBuffer() const noexcept { return commandBuffer; }
+
+GLuint GpuCuller::getVisibleBuffer() const noexcept { return visibleBuffer; }
+
+GLuint GpuCuller::getInstanceBuffer() const noexcept { return instanceBuffer; }
+
+size_t GpuCuller::getDrawCount() const noexcept { return templates.size(); }
+
+}  // namespace agt3d
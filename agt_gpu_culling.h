@@ -0,0 +1,130 @@
+#pragma once
+
+#include "agt_AABB.h"
+#include "agt_glsl_shader.h"
+#include "agt_indirect.h"
+
+namespace agt3d
+{
+
+class Mesh;
+
+/**
+ * @brief Bounds of one instance as laid out in the GPU buffer (std430).
+ */
+struct CullInstance {
+  /// World space center in xyz, radius in w.
+  glm::vec4 sphere = {0, 0, 0, 0};
+  /// Draw returned by GpuCuller::addDraw() this instance belongs to.
+  uint32_t draw = 0;
+  uint32_t pad[3] = {};
+};
+static_assert(sizeof(CullInstance) == 32);
+
+/**
+ * @brief Draw list produced by culling: one command per draw, the visible
+ * instance indices of draw d start at commands[d].baseInstance.
+ */
+struct CullResult {
+  std::vector<agt3d::DrawElementsIndirectCommand> commands;
+  std::vector<uint32_t> instanceIndices;
+};
+
+/**
+ * @brief Frustum culls instance bounding spheres on the GPU and compacts the
+ * survivors into indirect draw commands and an instance index buffer, so the
+ * CPU never looks at per-instance visibility.
+ *
+ * Every draw reserves a segment of the index buffer large enough for all its
+ * instances, the compute pass counts visible instances into instanceCount of
+ * its command and writes their indices into the segment. Drawn with
+ * glMultiDrawElementsIndirect, a shader finds the instance through
+ * visible[gl_BaseInstance + gl_InstanceID], or as a per-instance uint
+ * attribute set up by bindVisibleAsAttribute().
+ *
+ * Without compute shaders (GL < 4.3) cull() runs cullCpu() and uploads its
+ * result, which is the same draw list the GPU produces. The order of
+ * indices within a segment on the GPU depends on scheduling, readBack()
+ * sorts them for comparison. Without GL 4.2 or ARB_base_instance the
+ * fallback draws every command on its own and offsets the attribute of
+ * bindVisibleAsAttribute() to the segment, gl_BaseInstance is then 0.
+ */
+class GpuCuller
+{
+ public:
+  GpuCuller();
+  ~GpuCuller();
+  GpuCuller& operator=(const GpuCuller& other) = delete;
+  GpuCuller(GpuCuller&) = delete;
+  /**
+   * @brief Register the geometry of a draw, meshes sharing a GeometryArena
+   * pool can be drawn together. Draws added after setInstances() take part
+   * from the next cull() on, readBack() and draw() cover the draws of the
+   * last cull().
+   * @return draw index to use in CullInstance::draw.
+   */
+  uint32_t addDraw(const agt3d::Mesh& mesh);
+  /**
+   * @brief Upload all instances, this also lays out the index segments.
+   */
+  void setInstances(const std::vector<agt3d::CullInstance>& _instances);
+  /**
+   * @brief Update bounds of existing instances in place. The draw an
+   * instance belongs to must not change.
+   */
+  void updateInstances(size_t first, const agt3d::CullInstance* data,
+                       size_t count);
+  bool isComputeSupported() const noexcept;
+  void cull(const agt3d::Frustum& frustum);
+  agt3d::CullResult cullCpu(const agt3d::Frustum& frustum) const;
+  /**
+   * @brief Read the commands and indices of the last cull() back, indices
+   * sorted within every draw.
+   */
+  agt3d::CullResult readBack() const;
+  /**
+   * @brief Issue all commands with one glMultiDrawElementsIndirect. The VAO
+   * of the meshes has to be bound.
+   */
+  void draw(GLenum mode) const;
+  /**
+   * @brief Feed the visible instance indices to a uint vertex attribute with
+   * divisor 1 of the currently bound VAO.
+   */
+  void bindVisibleAsAttribute(GLuint location) const;
+  GLuint getCommandBuffer() const noexcept;
+  GLuint getVisibleBuffer() const noexcept;
+  GLuint getInstanceBuffer() const noexcept;
+  size_t getDrawCount() const noexcept;
+
+ private:
+  /**
+   * @brief Reserve the index segments of all draws and upload the commands.
+   */
+  void layoutSegments();
+  void uploadCommandTemplate();
+  void pointVisibleAttribute(GLuint location, GLuint first) const;
+
+ private:
+  std::vector<agt3d::DrawElementsIndirectCommand> templates;
+  std::vector<agt3d::CullInstance> instances;
+  std::optional<agt3d::Shader> program;
+  /// Last result of the CPU fallback.
+  agt3d::CullResult cpuResult;
+  bool computeSupported = false;
+  bool baseInstanceSupported = false;
+  /// Draws were added since the segments were laid out.
+  bool layoutDirty = false;
+  /// Commands written by the last cull().
+  size_t culledDraws = 0;
+  /// Location passed to bindVisibleAsAttribute(), re-pointed per command
+  /// when drawing without base instance.
+  mutable std::optional<GLuint> visibleLocation;
+  GLuint instanceBuffer = 0;
+  /// Commands with instanceCount 0, copied over the commands before a cull.
+  GLuint templateBuffer = 0;
+  GLuint commandBuffer = 0;
+  GLuint visibleBuffer = 0;
+};
+
+}  // namespace agt3d
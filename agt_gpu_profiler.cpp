@@ -0,0 +1,290 @@
+#include "agt_gpu_profiler.h"
+
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+static std::string escapeJson(const std::string& text)
+{
+  std::ostringstream out;
+  for (char c : text) {
+    switch (c) {
+      case '"':
+        out << "\\\"";
+        break;
+      case '\\':
+        out << "\\\\";
+        break;
+      case '\n':
+        out << "\\n";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20) {
+          out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+              << static_cast<int>(c) << std::dec;
+        } else {
+          out << c;
+        }
+    }
+  }
+  return out.str();
+}
+
+static double toMs(GLuint64 nanoseconds)
+{
+  return static_cast<double>(nanoseconds) / 1.0e6;
+}
+
+GpuProfiler::Scope::Scope(GpuProfiler* _profiler, const std::string& name)
+    : profiler(_profiler)
+{
+  if (profiler) {
+    profiler->push(name);
+  }
+}
+
+GpuProfiler::Scope::~Scope()
+{
+  if (profiler) {
+    profiler->pop();
+  }
+}
+
+GpuProfiler::GpuProfiler(size_t framesInFlight, size_t _historySize)
+    : slots(std::max<size_t>(2, framesInFlight)),
+      historySize(std::max<size_t>(1, _historySize))
+{
+  debugGroups = GLAD_GL_VERSION_4_3 || GLAD_GL_KHR_debug;
+}
+
+GpuProfiler::~GpuProfiler()
+{
+  for (auto& slot : slots) {
+    if (!slot.queries.empty()) {
+      glDeleteQueries(static_cast<GLsizei>(slot.queries.size()),
+                      slot.queries.data());
+    }
+  }
+}
+
+uint32_t GpuProfiler::timestamp(Slot& slot)
+{
+  if (slot.used == slot.queries.size()) {
+    GLuint query = 0;
+    glGenQueries(1, &query);
+    slot.queries.push_back(query);
+  }
+  glQueryCounter(slot.queries[slot.used], GL_TIMESTAMP);
+  stats.queries++;
+  return slot.used++;
+}
+
+bool GpuProfiler::isAvailable(const Slot& slot) const
+{
+  // Timestamps complete in order, the last one covers the frame
+  GLuint available = GL_FALSE;
+  glGetQueryObjectuiv(slot.queries[slot.frameEnd], GL_QUERY_RESULT_AVAILABLE,
+                      &available);
+  return available == GL_TRUE;
+}
+
+void GpuProfiler::resolve(Slot& slot)
+{
+  std::vector<GLuint64> times(slot.used);
+  for (uint32_t i = 0; i < slot.used; i++) {
+    glGetQueryObjectui64v(slot.queries[i], GL_QUERY_RESULT, &times[i]);
+  }
+  slot.pending = false;
+  if (!hasOrigin) {
+    origin = times[0];
+    hasOrigin = true;
+  }
+
+  Frame frame;
+  frame.number = slot.number;
+  frame.startMs = toMs(times[0] - origin);
+  frame.ms = toMs(times[slot.frameEnd] - times[0]);
+  frame.samples.reserve(slot.scopes.size());
+  for (const auto& scope : slot.scopes) {
+    Sample sample;
+    sample.name = scope.name;
+    sample.depth = scope.depth;
+    sample.startMs = toMs(times[scope.begin] - times[0]);
+    sample.ms = toMs(times[scope.end] - times[scope.begin]);
+
+    // Scopes come in push order, the path of the parents is still on top
+    path.resize(scope.depth);
+    path.push_back(scope.name);
+    std::string key = path[0];
+    for (size_t i = 1; i < path.size(); i++) {
+      key += "/" + path[i];
+    }
+    auto& aggregate = aggregates[key];
+    aggregate.count++;
+    aggregate.totalMs += sample.ms;
+    aggregate.minMs = std::min(aggregate.minMs, sample.ms);
+    aggregate.maxMs = std::max(aggregate.maxMs, sample.ms);
+    frame.samples.push_back(std::move(sample));
+  }
+
+  stats.frames++;
+  stats.frameMs += frame.ms;
+  frames.push_back(std::move(frame));
+  while (frames.size() > historySize) {
+    frames.pop_front();
+  }
+}
+
+void GpuProfiler::beginFrame()
+{
+  MY_ASSERT(!inFrame, "GpuProfiler: beginFrame() twice");
+  // Oldest first, and stop at the first unfinished frame to keep the order
+  for (size_t i = 1; i < slots.size(); i++) {
+    auto& slot = slots[(current + i) % slots.size()];
+    if (!slot.pending) {
+      continue;
+    }
+    if (!isAvailable(slot)) {
+      break;
+    }
+    resolve(slot);
+  }
+
+  current = (current + 1) % slots.size();
+  auto& slot = slots[current];
+  if (slot.pending) {
+    resolve(slot);
+    stats.stalls++;
+  }
+  slot.used = 0;
+  slot.scopes.clear();
+  slot.number = frameNumber;
+  timestamp(slot);
+  inFrame = true;
+}
+
+void GpuProfiler::endFrame()
+{
+  MY_ASSERT(inFrame, "GpuProfiler: endFrame() without beginFrame()");
+  MY_ASSERT(open.empty(), "GpuProfiler: scope still open at endFrame()");
+  auto& slot = slots[current];
+  slot.frameEnd = timestamp(slot);
+  slot.pending = true;
+  inFrame = false;
+  frameNumber++;
+}
+
+void GpuProfiler::push(const std::string& name)
+{
+  if (debugGroups) {
+    glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, name.c_str());
+  }
+  if (!inFrame) {
+    open.push_back(untimed);
+    return;
+  }
+  auto& slot = slots[current];
+  PendingScope scope;
+  scope.name = name;
+  scope.depth = static_cast<uint32_t>(open.size());
+  scope.begin = timestamp(slot);
+  open.push_back(static_cast<uint32_t>(slot.scopes.size()));
+  slot.scopes.push_back(std::move(scope));
+}
+
+void GpuProfiler::pop()
+{
+  MY_ASSERT(!open.empty(), "GpuProfiler: pop() without push()");
+  uint32_t index = open.back();
+  open.pop_back();
+  if (index != untimed) {
+    auto& slot = slots[current];
+    slot.scopes[index].end = timestamp(slot);
+  }
+  if (debugGroups) {
+    glPopDebugGroup();
+  }
+}
+
+const std::deque<GpuProfiler::Frame>& GpuProfiler::getFrames() const noexcept
+{
+  return frames;
+}
+
+const std::map<std::string, GpuProfiler::Aggregate>&
+GpuProfiler::getAggregates() const noexcept
+{
+  return aggregates;
+}
+
+const GpuProfiler::Stats& GpuProfiler::getStats() const noexcept
+{
+  return stats;
+}
+
+void GpuProfiler::reset()
+{
+  frames.clear();
+  aggregates.clear();
+  stats = Stats();
+}
+
+void GpuProfiler::writeJson(std::ostream& out) const
+{
+  out << "{\"frames\":" << stats.frames << ",\"frameMs\":"
+      << (stats.frames ? stats.frameMs / stats.frames : 0.0)
+      << ",\"stalls\":" << stats.stalls << ",\"scopes\":[";
+  bool first = true;
+  for (const auto& [name, aggregate] : aggregates) {
+    out << (first ? "" : ",") << "{\"name\":\"" << escapeJson(name)
+        << "\",\"count\":" << aggregate.count
+        << ",\"totalMs\":" << aggregate.totalMs
+        << ",\"averageMs\":" << aggregate.totalMs / aggregate.count
+        << ",\"minMs\":" << aggregate.minMs
+        << ",\"maxMs\":" << aggregate.maxMs << "}";
+    first = false;
+  }
+  out << "]";
+  if (!frames.empty()) {
+    const auto& frame = frames.back();
+    out << ",\"lastFrame\":{\"number\":" << frame.number
+        << ",\"ms\":" << frame.ms << ",\"samples\":[";
+    first = true;
+    for (const auto& sample : frame.samples) {
+      out << (first ? "" : ",") << "{\"name\":\"" << escapeJson(sample.name)
+          << "\",\"depth\":" << sample.depth
+          << ",\"startMs\":" << sample.startMs << ",\"ms\":" << sample.ms
+          << "}";
+      first = false;
+    }
+    out << "]}";
+  }
+  out << "}" << std::endl;
+}
+
+void GpuProfiler::writeChromeTrace(std::ostream& out) const
+{
+  // Chrome wants microseconds
+  auto event = [&out](const std::string& name, double startMs, double ms) {
+    out << "{\"name\":\"" << escapeJson(name)
+        << "\",\"cat\":\"gpu\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":"
+        << startMs * 1000.0 << ",\"dur\":" << ms * 1000.0 << "}";
+  };
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::fixed
+      << std::setprecision(3);
+  bool first = true;
+  for (const auto& frame : frames) {
+    out << (first ? "" : ",\n");
+    event("frame " + std::to_string(frame.number), frame.startMs, frame.ms);
+    for (const auto& sample : frame.samples) {
+      out << ",\n";
+      event(sample.name, frame.startMs + sample.startMs, sample.ms);
+    }
+    first = false;
+  }
+  out << "]}" << std::defaultfloat << std::endl;
+}
+
+}  // namespace agt3d
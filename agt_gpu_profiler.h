@@ -0,0 +1,155 @@
+#pragma once
+
+#include "agt_stdafx.h"
+
+namespace agt3d
+{
+
+/**
+ * @brief Measures GPU time of nested scopes, e.g. render graph passes and
+ * render queue buckets, with timestamp queries.
+ *
+ * Every frame (beginFrame() to endFrame()) records a timestamp at its start,
+ * at push() and pop() of each scope and at its end, into one of a ring of
+ * framesInFlight query sets. beginFrame() reads the sets of earlier frames
+ * the GPU has finished, without waiting, so results arrive framesInFlight - 1
+ * frames late at most. Only when the ring wraps onto a set that is still
+ * pending it waits, which is counted as a stall.
+ *
+ * Resolved frames are kept in a history of historySize frames, scopes are
+ * aggregated by their path ("pass/bucket") over all frames since reset().
+ * Both can be written as JSON, the history also in the Chrome trace event
+ * format (chrome://tracing, Perfetto).
+ *
+ * push() and pop() also open and close a KHR_debug group with the scope name
+ * when available, so frame debuggers like RenderDoc show the same structure.
+ * Outside a frame they only do that. Needs GL 3.3 or ARB_timer_query and a
+ * current context for all calls.
+ */
+class GpuProfiler
+{
+ public:
+  struct Sample {
+    std::string name;
+    /// Nesting level, 0 for scopes opened directly in the frame.
+    uint32_t depth = 0;
+    /// Relative to the start of the frame.
+    double startMs = 0;
+    double ms = 0;
+  };
+
+  struct Frame {
+    uint64_t number = 0;
+    /// Relative to the first resolved frame.
+    double startMs = 0;
+    double ms = 0;
+    /// In push() order.
+    std::vector<Sample> samples;
+  };
+
+  struct Aggregate {
+    size_t count = 0;
+    double totalMs = 0;
+    double minMs = std::numeric_limits<double>::max();
+    double maxMs = 0;
+  };
+
+  struct Stats {
+    size_t frames = 0;
+    double frameMs = 0;
+    size_t queries = 0;
+    /// beginFrame() calls that had to wait for an old frame.
+    size_t stalls = 0;
+  };
+
+  /**
+   * @brief Pushes a scope for its lifetime, does nothing without a profiler.
+   */
+  class Scope
+  {
+   public:
+    Scope(agt3d::GpuProfiler* _profiler, const std::string& name);
+    ~Scope();
+    Scope& operator=(const Scope& other) = delete;
+    Scope(Scope&) = delete;
+
+   private:
+    agt3d::GpuProfiler* profiler;
+  };
+
+  explicit GpuProfiler(size_t framesInFlight = 4, size_t _historySize = 240);
+  ~GpuProfiler();
+  GpuProfiler& operator=(const GpuProfiler& other) = delete;
+  GpuProfiler(GpuProfiler&) = delete;
+
+  void beginFrame();
+  void endFrame();
+  void push(const std::string& name);
+  void pop();
+  /**
+   * @brief Resolved frames, oldest first.
+   */
+  const std::deque<Frame>& getFrames() const noexcept;
+  /**
+   * @brief Scope times by path, e.g. "shadow/material 2".
+   */
+  const std::map<std::string, Aggregate>& getAggregates() const noexcept;
+  const Stats& getStats() const noexcept;
+  /**
+   * @brief Forget the history, aggregates and stats. Frames in flight are
+   * still resolved.
+   */
+  void reset();
+  /**
+   * @brief Aggregates and the latest frame.
+   */
+  void writeJson(std::ostream& out) const;
+  /**
+   * @brief The history as complete ("X") events, frames and their scopes
+   * nested on one track.
+   */
+  void writeChromeTrace(std::ostream& out) const;
+
+ private:
+  static constexpr uint32_t untimed = std::numeric_limits<uint32_t>::max();
+
+  struct PendingScope {
+    std::string name;
+    uint32_t depth = 0;
+    /// Query indices in the slot.
+    uint32_t begin = 0;
+    uint32_t end = 0;
+  };
+  /// Queries of one frame.
+  struct Slot {
+    std::vector<GLuint> queries;
+    uint32_t used = 0;
+    std::vector<PendingScope> scopes;
+    uint64_t number = 0;
+    uint32_t frameEnd = 0;
+    bool pending = false;
+  };
+
+  uint32_t timestamp(Slot& slot);
+  bool isAvailable(const Slot& slot) const;
+  void resolve(Slot& slot);
+
+ private:
+  std::vector<Slot> slots;
+  size_t current = 0;
+  /// Scope index in the current slot per open scope, untimed outside a
+  /// frame.
+  std::vector<uint32_t> open;
+  bool inFrame = false;
+  uint64_t frameNumber = 0;
+  GLuint64 origin = 0;
+  bool hasOrigin = false;
+  bool debugGroups = false;
+  size_t historySize;
+  std::deque<Frame> frames;
+  std::map<std::string, Aggregate> aggregates;
+  std::vector<std::string> path;
+  Stats stats;
+};
+
+}  // namespace agt3d
@@ -0,0 +1,127 @@
+#ifdef USE_EGL
+
+#include "agt_headless.h"
+
+#include <EGL/eglext.h>
+
+#include "agt_gl_state.h"
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+static EGLDisplay openDisplay()
+{
+  auto getPlatformDisplay = reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+    eglGetProcAddress("eglGetPlatformDisplayEXT"));
+  if (getPlatformDisplay) {
+    EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                            EGL_DEFAULT_DISPLAY, nullptr);
+    if (display != EGL_NO_DISPLAY && eglInitialize(display, nullptr, nullptr)) {
+      return display;
+    }
+  }
+  EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (display != EGL_NO_DISPLAY && eglInitialize(display, nullptr, nullptr)) {
+    return display;
+  }
+  return EGL_NO_DISPLAY;
+}
+
+std::unique_ptr<HeadlessContext> HeadlessContext::create(int major, int minor)
+{
+  std::unique_ptr<HeadlessContext> headless(new HeadlessContext());
+  headless->display = openDisplay();
+  if (headless->display == EGL_NO_DISPLAY) {
+    std::cerr << "HeadlessContext: no EGL display, error " << eglGetError()
+              << std::endl;
+    return nullptr;
+  }
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    std::cerr << "HeadlessContext: EGL has no desktop OpenGL" << std::endl;
+    return nullptr;
+  }
+
+  const EGLint configAttributes[] = {EGL_SURFACE_TYPE,
+                                     EGL_PBUFFER_BIT,
+                                     EGL_RENDERABLE_TYPE,
+                                     EGL_OPENGL_BIT,
+                                     EGL_NONE};
+  EGLConfig config = nullptr;
+  EGLint configCount = 0;
+  eglChooseConfig(headless->display, configAttributes, &config, 1,
+                  &configCount);
+  const char* extensions =
+    eglQueryString(headless->display, EGL_EXTENSIONS);
+  bool surfaceless =
+    extensions && strstr(extensions, "EGL_KHR_surfaceless_context");
+  if (configCount == 0 && !surfaceless) {
+    std::cerr << "HeadlessContext: no pbuffer config" << std::endl;
+    return nullptr;
+  }
+
+  const EGLint contextAttributes[] = {EGL_CONTEXT_MAJOR_VERSION,
+                                      major,
+                                      EGL_CONTEXT_MINOR_VERSION,
+                                      minor,
+                                      EGL_CONTEXT_OPENGL_PROFILE_MASK,
+                                      EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                      EGL_NONE};
+  headless->context =
+    eglCreateContext(headless->display, configCount ? config : nullptr,
+                     EGL_NO_CONTEXT, contextAttributes);
+  if (headless->context == EGL_NO_CONTEXT) {
+    std::cerr << "HeadlessContext: no OpenGL " << major << "." << minor
+              << " core context, error " << eglGetError() << std::endl;
+    return nullptr;
+  }
+  if (!surfaceless) {
+    const EGLint pbufferAttributes[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+    headless->surface =
+      eglCreatePbufferSurface(headless->display, config, pbufferAttributes);
+  }
+  if (!headless->makeCurrent()) {
+    std::cerr << "HeadlessContext: eglMakeCurrent failed, error "
+              << eglGetError() << std::endl;
+    return nullptr;
+  }
+  if (!gladLoadGLLoader(reinterpret_cast<GLADloadproc>(eglGetProcAddress))) {
+    std::cerr << "HeadlessContext: failed to load GL functions" << std::endl;
+    return nullptr;
+  }
+  GlState::invalidate();
+  return headless;
+}
+
+HeadlessContext::~HeadlessContext()
+{
+  if (display == EGL_NO_DISPLAY) {
+    return;
+  }
+  eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if (surface != EGL_NO_SURFACE) {
+    eglDestroySurface(display, surface);
+  }
+  if (context != EGL_NO_CONTEXT) {
+    eglDestroyContext(display, context);
+  }
+  eglTerminate(display);
+}
+
+bool HeadlessContext::makeCurrent()
+{
+  return eglMakeCurrent(display, surface, surface, context) == EGL_TRUE;
+}
+
+std::string HeadlessContext::getDescription() const
+{
+  auto renderer = reinterpret_cast<const char*>(glGetString(GL_RENDERER));
+  auto version = reinterpret_cast<const char*>(glGetString(GL_VERSION));
+  return std::string(renderer ? renderer : "?") + ", OpenGL " +
+         (version ? version : "?");
+}
+
+}  // namespace agt3d
+
+#endif  // USE_EGL
@@ -0,0 +1,53 @@
+#pragma once
+
+#ifdef USE_EGL
+
+#include <EGL/egl.h>
+
+#include "agt_stdafx.h"
+
+namespace agt3d
+{
+
+/**
+ * @brief OpenGL core context without a window, for rendering on servers.
+ *
+ * Uses a surfaceless EGL display (Mesa's EGL_MESA_platform_surfaceless, which
+ * also covers llvmpipe) when available, otherwise the default display with a
+ * 1x1 pbuffer. Everything renders into FBOs. The context is made current and
+ * GL entry points are loaded on creation.
+ */
+class HeadlessContext
+{
+ public:
+  /**
+   * @return nullptr if no display or context could be created, the reason is
+   * printed.
+   */
+  static std::unique_ptr<agt3d::HeadlessContext> create(int major = 4,
+                                                        int minor = 5);
+  ~HeadlessContext();
+  HeadlessContext& operator=(const HeadlessContext& other) = delete;
+  HeadlessContext(HeadlessContext&) = delete;
+
+  /**
+   * @brief Make the context current on the calling thread.
+   */
+  bool makeCurrent();
+  /**
+   * @brief GL_RENDERER and GL_VERSION.
+   */
+  std::string getDescription() const;
+
+ private:
+  HeadlessContext() = default;
+
+ private:
+  EGLDisplay display = EGL_NO_DISPLAY;
+  EGLContext context = EGL_NO_CONTEXT;
+  EGLSurface surface = EGL_NO_SURFACE;
+};
+
+}  // namespace agt3d
+
+#endif  // USE_EGL
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "agt_stdafx.h"
+
+namespace agt3d
+{
+
+/**
+ * @brief Layout of one command in a GL_DRAW_INDIRECT_BUFFER for
+ * glMultiDrawElementsIndirect, see the GL 4.3 specification.
+ */
+struct DrawElementsIndirectCommand {
+  GLuint count = 0;
+  GLuint instanceCount = 0;
+  GLuint firstIndex = 0;
+  GLint baseVertex = 0;
+  GLuint baseInstance = 0;
+};
+static_assert(sizeof(DrawElementsIndirectCommand) == 20);
+
+/**
+ * @brief glMultiDrawElementsIndirect with base instance and shader storage
+ * buffers is available (GL 4.3, or the ARB extensions).
+ */
+inline bool hasMultiDrawIndirect() noexcept
+{
+  return GLAD_GL_VERSION_4_3 ||
+         (GLAD_GL_ARB_multi_draw_indirect && GLAD_GL_ARB_base_instance &&
+          GLAD_GL_ARB_shader_storage_buffer_object);
+}
+
+}  // namespace agt3d
@@ -4,7 +4,9 @@
 namespace agt3d
 {
 
-Material::Material()
+static std::atomic<uint64_t> nextParamsVersion = 1;
+
+Material::Material() : paramsVersion(nextParamsVersion++)
 {
 #ifdef VERBOSE
   std::cout << "Material ctor" << std::endl;
@@ -46,8 +48,11 @@ void Material::setShaderParam(const std::string&& key, shader_param_t param)
   }
 
   shaderParams.insert_or_assign(key, std::make_pair(type, param));
+  paramsVersion = nextParamsVersion++;
 }
 
+uint64_t Material::getParamsVersion() const noexcept { return paramsVersion; }
+
 std::map<std::string, std::pair<std::string, agt3d::shader_param_t>>&
 Material::getShaderParams()
 {
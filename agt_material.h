@@ -20,6 +20,11 @@ class Material
    * @param param variant value or type shader_param_t.
    */
   void setShaderParam(const std::string&& key, shader_param_t param);
+  /**
+   * @brief Changes with every setShaderParam(), unique across materials.
+   * Values edited through getShaderParams() don't change it.
+   */
+  uint64_t getParamsVersion() const noexcept;
   std::map<std::string, std::pair<std::string, agt3d::shader_param_t>>&
   getShaderParams();
 
@@ -33,6 +38,7 @@ class Material
    */
   std::map<std::string, std::pair<std::string, agt3d::shader_param_t>>
     shaderParams;
+  uint64_t paramsVersion;
 };
 
 }  // namespace agt3d
@@ -1,10 +1,50 @@
 #include "agt_mesh.h"
+#include "agt_geometry_arena.h"
+#include "agt_gl_state.h"
+#include "agt_mesh_bvh.h"
 #include "agt_utils.h"
 #include "agt_stdafx.h"
 
 namespace agt3d
 {
 
+/**
+ * @brief Copy elementsCount elements of a fixed size out of an interleaved
+ * source. The constant size lets the compiler turn each copy into a couple of
+ * register moves instead of a byte loop.
+ */
+template <size_t N>
+static void gatherStrided(uint8_t* dst, const uint8_t* src, size_t stride,
+                          size_t elementsCount) noexcept
+{
+  for (size_t c = 0; c < elementsCount; c++) {
+    memcpy(dst, src, N);
+    dst += N;
+    src += stride;
+  }
+}
+
+/**
+ * @brief Split [0, count) into one contiguous chunk per thread and run fn(begin,
+ * end, chunk) on each. The calling thread takes the first chunk.
+ */
+template <typename Fn>
+static void parallelChunks(size_t count, unsigned threads, Fn&& fn)
+{
+  threads = std::max(1u, std::min<unsigned>(threads, count));
+  size_t chunk = (count + threads - 1) / threads;
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; t++) {
+    size_t begin = std::min(count, t * chunk);
+    size_t end = std::min(count, begin + chunk);
+    workers.emplace_back([&fn, begin, end, t]() { fn(begin, end, t); });
+  }
+  fn(0, std::min(count, chunk), 0u);
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
 Mesh::Mesh()
     : rawBufferDesc(static_cast<int>(DataStream::LAST), std::make_pair(-1, -1))
 {
@@ -16,9 +56,19 @@ Mesh::Mesh()
 
 Mesh::~Mesh()
 {
-  glDeleteVertexArrays(1, &vao);
-  glDeleteBuffers(1, &vbo);
-  glDeleteBuffers(1, &vib);
+  if (arena) {
+    arena->remove(*this, false);
+  }
+  releasePersistentStorage();
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    releaseExternalBuffer(i);
+  }
+  GlState::deleteVertexArrays(1, &vao);
+  if (depthVao) {
+    GlState::deleteVertexArrays(1, &depthVao);
+  }
+  GlState::deleteBuffers(1, &vbo);
+  GlState::deleteBuffers(1, &vib);
   data.clear();
   for (auto& buffer : rawBuffers) {
     buffer.resize(0);
@@ -33,6 +83,16 @@ std::vector<uint8_t>& Mesh::getDataBuffer(DataStream id)
 {
   MY_ASSERT(hasDataBuffer(id), "Mesh does not contain this data buffer");
   auto _id = static_cast<int>(id);
+  if (!isResident(id)) {
+    makeResident();
+  }
+  // Hand out a vector the caller may modify, so an external buffer becomes an
+  // owned copy first
+  if (externalStreams & (1 << _id)) {
+    const uint8_t* ptr = externalBuffers[_id].ptr;
+    rawBuffers[_id].assign(ptr, ptr + streamSizes[_id]);
+    releaseExternalBuffer(_id);
+  }
   return rawBuffers[_id];
 }
 
@@ -43,22 +103,95 @@ std::pair<int, int> Mesh::getDataBufferDesc(DataStream id)
   return rawBufferDesc[_id];
 }
 
-void Mesh::setDataBuffer(DataStream id, const float* data, size_t sizeInBytes,
-                         int type, int components)
+void Mesh::prepareStream(DataStream id, size_t sizeInBytes, int type,
+                         int components)
 {
   auto _id = static_cast<int>(id);
+  bool sameLayout = hasDataBuffer(id) && streamSizes[_id] == sizeInBytes &&
+                    rawBufferDesc[_id] == std::make_pair(type, components);
+  contentHashValid = false;
   streams |= (1 << _id);
+  residentStreams |= (1 << _id);
+  streamSizes[_id] = sizeInBytes;
   rawBufferDesc[_id] = std::make_pair(type, components);
-  rawBuffers[_id].resize(sizeInBytes);
-  memcpy(rawBuffers[_id].data(), (uint8_t*)data, sizeInBytes);
-  needsUpdate = true;
+
+  // Same size and format means only the content changed, the GPU buffer can be
+  // patched in place
+  if (sameLayout) {
+    markDirty(id, 0, sizeInBytes);
+  } else {
+    needsUpdate = true;
+    layoutDirty = true;
+  }
 
   if (id == DataStream::VERTEX) {
     aabbNeedsUpdate = true;
+    bvh.reset();
+  }
+}
+
+void Mesh::releaseExternalBuffer(int id)
+{
+  if (!(externalStreams & (1 << id))) {
+    return;
+  }
+  auto& external = externalBuffers[id];
+  if (external.deleter) {
+    external.deleter(external.ptr);
+  }
+  external = ExternalBuffer();
+  externalStreams &= ~(1 << id);
+}
+
+const uint8_t* Mesh::streamData(int id) const noexcept
+{
+  if (externalStreams & (1 << id)) {
+    return externalBuffers[id].ptr;
   }
+  return rawBuffers[id].data();
+}
+
+void Mesh::setDataBuffer(DataStream id, const float* data, size_t sizeInBytes,
+                         int type, int components)
+{
+  auto _id = static_cast<int>(id);
+  prepareStream(id, sizeInBytes, type, components);
+  rawBuffers[_id].resize(sizeInBytes);
+  memcpy(rawBuffers[_id].data(), (uint8_t*)data, sizeInBytes);
+  // Only now, data may point into the external buffer
+  releaseExternalBuffer(_id);
   return;
 }
 
+void Mesh::setDataBuffer(DataStream id, std::vector<uint8_t>&& buffer,
+                         int type, int components)
+{
+  auto _id = static_cast<int>(id);
+  prepareStream(id, buffer.size(), type, components);
+  rawBuffers[_id] = std::move(buffer);
+  releaseExternalBuffer(_id);
+}
+
+void Mesh::setExternalDataBuffer(DataStream id, std::span<const uint8_t> buffer,
+                                 int type, int components,
+                                 BufferDeleter deleter)
+{
+  auto _id = static_cast<int>(id);
+  prepareStream(id, buffer.size(), type, components);
+  std::vector<uint8_t>().swap(rawBuffers[_id]);
+  // Adopt the new buffer before releasing the old one, which is kept alive
+  // when the same memory is submitted again
+  ExternalBuffer previous;
+  if (externalStreams & (1 << _id)) {
+    previous = std::move(externalBuffers[_id]);
+  }
+  externalBuffers[_id] = {buffer.data(), std::move(deleter)};
+  externalStreams |= (1 << _id);
+  if (previous.deleter && previous.ptr != buffer.data()) {
+    previous.deleter(previous.ptr);
+  }
+}
+
 void Mesh::setDataBufferFromInterleaved(DataStream id, const uint8_t* data,
                                         int strideInBytes, int type,
                                         int components, size_t elementsCount,
@@ -69,27 +202,340 @@ void Mesh::setDataBufferFromInterleaved(DataStream id, const uint8_t* data,
   }
 
   auto _id = static_cast<int>(id);
-  streams |= (1 << _id);
+  prepareStream(id, elementsCount * elementSizeInBytes, type, components);
   rawBuffers[_id].resize(elementsCount * elementSizeInBytes);
-  rawBufferDesc[_id] = std::make_pair(type, components);
 
   const uint8_t* src = data;
-  auto stride = strideInBytes - elementSizeInBytes;
+  size_t stride = strideInBytes;
   uint8_t* dst = reinterpret_cast<uint8_t*>(rawBuffers[_id].data());
 
-  for (size_t c = 0; c < elementsCount; c++) {
-    for (size_t i = 0; i < elementSizeInBytes; i++) {
-      *dst++ = *src++;
-    }
-    src += stride;
+  if (stride == elementSizeInBytes) {
+    memcpy(dst, src, elementsCount * elementSizeInBytes);
+    releaseExternalBuffer(_id);
+    return;
+  }
+
+  switch (elementSizeInBytes) {
+    case 4:
+      gatherStrided<4>(dst, src, stride, elementsCount);
+      break;
+    case 8:
+      gatherStrided<8>(dst, src, stride, elementsCount);
+      break;
+    case 12:
+      gatherStrided<12>(dst, src, stride, elementsCount);
+      break;
+    case 16:
+      gatherStrided<16>(dst, src, stride, elementsCount);
+      break;
+    default:
+      for (size_t c = 0; c < elementsCount; c++) {
+        memcpy(dst, src, elementSizeInBytes);
+        dst += elementSizeInBytes;
+        src += stride;
+      }
+      break;
+  }
+  releaseExternalBuffer(_id);
+
+  return;
+}
+
+void Mesh::updateDataBufferRange(DataStream id, const void* data,
+                                 size_t offsetInBytes, size_t sizeInBytes)
+{
+  MY_ASSERT(hasDataBuffer(id), "Mesh does not contain this data buffer");
+  auto& buffer = getDataBuffer(id);
+  MY_ASSERT(offsetInBytes + sizeInBytes <= buffer.size(),
+            "Range exceeds the data buffer size");
+  memcpy(buffer.data() + offsetInBytes, data, sizeInBytes);
+  markDirty(id, offsetInBytes, sizeInBytes);
+}
+
+void Mesh::markDirty(DataStream id, size_t offsetInBytes, size_t sizeInBytes)
+{
+  if (sizeInBytes == 0) {
+    return;
+  }
+  contentHashValid = false;
+  auto& range = dirtyRanges[static_cast<int>(id)];
+  if (range.first >= range.second) {
+    range = {offsetInBytes, offsetInBytes + sizeInBytes};
+  } else {
+    range.first = std::min(range.first, offsetInBytes);
+    range.second = std::max(range.second, offsetInBytes + sizeInBytes);
   }
-  needsUpdate = true;
 
   if (id == DataStream::VERTEX) {
     aabbNeedsUpdate = true;
+    bvh.reset();
   }
+}
 
-  return;
+bool Mesh::hasDirtyRanges() const noexcept
+{
+  for (const auto& range : dirtyRanges) {
+    if (range.first < range.second) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Mesh::clearDirtyRanges() noexcept
+{
+  for (auto& range : dirtyRanges) {
+    range = {0, 0};
+  }
+}
+
+void Mesh::setUsage(MeshUsage _usage)
+{
+  if (usage == _usage) {
+    return;
+  }
+  // Immutable storage can't be respecified with glBufferData, start over with
+  // a fresh buffer object
+  if (persistentPtr) {
+    releasePersistentStorage();
+    GlState::deleteBuffers(1, &vbo);
+    vbo = 0;
+    initOpenGLObjects();
+  }
+  usage = _usage;
+  layoutDirty = true;
+  // The persistent path never patches the combined copy, rebuild it before
+  // the next full upload
+  needsUpdate = true;
+}
+
+MeshUsage Mesh::getUsage() const noexcept { return usage; }
+
+void Mesh::setResidency(MeshResidency _residency) { residency = _residency; }
+
+MeshResidency Mesh::getResidency() const noexcept { return residency; }
+
+bool Mesh::isResident(DataStream id) const noexcept
+{
+  return residentStreams & (1 << static_cast<int>(id));
+}
+
+bool Mesh::isFullyResident() const noexcept
+{
+  return (residentStreams & streams) == streams && indicesResident;
+}
+
+size_t Mesh::getIndexCount() const noexcept
+{
+  return indicesResident ? indices.size() : indexCount;
+}
+
+size_t Mesh::getResidentBytes() const noexcept
+{
+  size_t total = data.capacity() + indices.capacity() * sizeof(unsigned int);
+  for (const auto& buffer : rawBuffers) {
+    total += buffer.capacity();
+  }
+  return total;
+}
+
+size_t Mesh::getElementSize(DataStream id) const noexcept
+{
+  const auto& desc = rawBufferDesc[static_cast<int>(id)];
+  return desc.second * getGlTypeSize(desc.first);
+}
+
+size_t Mesh::getVertexCount() const noexcept
+{
+  auto elementSize = getElementSize(DataStream::VERTEX);
+  if (!(streams & (1 << static_cast<int>(DataStream::VERTEX))) ||
+      elementSize == 0) {
+    return 0;
+  }
+  return streamSizes[static_cast<int>(DataStream::VERTEX)] / elementSize;
+}
+
+size_t Mesh::getGeometryBytes() const noexcept
+{
+  size_t total = getIndexCount() * sizeof(unsigned int);
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if (streams & (1 << i)) {
+      total += streamSizes[i];
+    }
+  }
+  return total;
+}
+
+uint64_t Mesh::getContentHash()
+{
+  if (contentHashValid) {
+    return contentHash;
+  }
+  makeResident();
+
+  uint64_t h = hash64(&streams, sizeof(streams));
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if (!(streams & (1 << i))) {
+      continue;
+    }
+    h = hash64(&rawBufferDesc[i], sizeof(rawBufferDesc[i]), h);
+    h = hash64(streamData(i), streamSizes[i], h);
+  }
+  h = hash64(indices.data(), indices.size() * sizeof(unsigned int), h);
+
+  contentHash = h;
+  contentHashValid = true;
+  return contentHash;
+}
+
+bool Mesh::hasSameContent(Mesh& other)
+{
+  if (streams != other.streams || getIndexCount() != other.getIndexCount()) {
+    return false;
+  }
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if ((streams & (1 << i)) && (rawBufferDesc[i] != other.rawBufferDesc[i] ||
+                                 streamSizes[i] != other.streamSizes[i])) {
+      return false;
+    }
+  }
+  // avoid reading released data back from the GPU, the cached hash was taken
+  // while the data was still in host memory
+  if (!isFullyResident() || !other.isFullyResident()) {
+    return getContentHash() == other.getContentHash();
+  }
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if ((streams & (1 << i)) &&
+        memcmp(streamData(i), other.streamData(i), streamSizes[i]) != 0) {
+      return false;
+    }
+  }
+  return indices == other.indices;
+}
+
+GLuint Mesh::getVertexArray() const noexcept
+{
+  return arena ? arena->getVertexArray(arenaPool) : vao;
+}
+
+GLuint Mesh::getDepthVertexArray()
+{
+  if (arena) {
+    return arena->getDepthVertexArray(arenaPool);
+  }
+  if (!hasDataBuffer(DataStream::VERTEX)) {
+    return vao;
+  }
+  if (depthVao == 0) {
+    glGenVertexArrays(1, &depthVao);
+    setupDepthAttributes(currentBaseOffset());
+  }
+  return depthVao;
+}
+
+void Mesh::draw(GLenum mode, GLsizei instanceCount)
+{
+  auto count = static_cast<GLsizei>(getIndexCount());
+  auto offset = (const GLvoid*)(firstIndex * sizeof(unsigned int));
+  if (count == 0) {
+    auto vertexCount = static_cast<GLsizei>(getVertexCount());
+    if (instanceCount == 1) {
+      glDrawArrays(mode, baseVertex, vertexCount);
+    } else {
+      glDrawArraysInstanced(mode, baseVertex, vertexCount, instanceCount);
+    }
+  } else if (arena) {
+    if (instanceCount == 1) {
+      glDrawElementsBaseVertex(mode, count, GL_UNSIGNED_INT, offset,
+                               baseVertex);
+    } else {
+      glDrawElementsInstancedBaseVertex(mode, count, GL_UNSIGNED_INT, offset,
+                                        instanceCount, baseVertex);
+    }
+  } else {
+    if (instanceCount == 1) {
+      glDrawElements(mode, count, GL_UNSIGNED_INT, offset);
+    } else {
+      glDrawElementsInstanced(mode, count, GL_UNSIGNED_INT, offset,
+                              instanceCount);
+    }
+  }
+}
+
+size_t Mesh::currentBaseOffset() const noexcept
+{
+  return persistentPtr ? persistentIndex * persistentStride : 0;
+}
+
+void Mesh::makeResident()
+{
+  if (isFullyResident()) {
+    return;
+  }
+
+  // Read through GL_COPY_READ_BUFFER so neither the VAO nor the array buffer
+  // bindings change
+  GlState::bindBuffer(GL_COPY_READ_BUFFER, vbo);
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    auto id = static_cast<DataStream>(i);
+    if (!hasDataBuffer(id) || isResident(id)) {
+      continue;
+    }
+    rawBuffers[i].resize(streamSizes[i]);
+    if (arena) {
+      arena->readBack(*this, i, rawBuffers[i].data());
+    } else {
+      glGetBufferSubData(GL_COPY_READ_BUFFER,
+                         currentBaseOffset() + streamOffsets[i],
+                         streamSizes[i], rawBuffers[i].data());
+    }
+    residentStreams |= (1 << i);
+  }
+
+  if (!indicesResident) {
+    indices.resize(indexCount);
+    if (indexCount && arena) {
+      arena->readBackIndices(*this, indices.data());
+    } else if (indexCount) {
+      GlState::bindBuffer(GL_COPY_READ_BUFFER, vib);
+      glGetBufferSubData(GL_COPY_READ_BUFFER, 0,
+                         indexCount * sizeof(unsigned int), indices.data());
+    }
+    indicesResident = true;
+  }
+  checkOpenGLErrors();
+}
+
+void Mesh::applyResidency()
+{
+  if (residency == MeshResidency::KEEP_ALL) {
+    return;
+  }
+
+  // Bounds must be known before the positions may go away
+  if (hasDataBuffer(DataStream::VERTEX)) {
+    calculateAABB();
+  }
+
+  // The combined copy is only a staging area for the upload
+  std::vector<uint8_t>().swap(data);
+  needsUpdate = true;
+
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if (residency == MeshResidency::KEEP_POSITIONS &&
+        i == static_cast<int>(DataStream::VERTEX)) {
+      continue;
+    }
+    std::vector<uint8_t>().swap(rawBuffers[i]);
+    releaseExternalBuffer(i);
+    residentStreams &= ~(1 << i);
+  }
+
+  if (residency == MeshResidency::DISCARD && indicesResident) {
+    indexCount = indices.size();
+    std::vector<unsigned int>().swap(indices);
+    indicesResident = false;
+  }
 }
 
 bool Mesh::hasDataBuffer(DataStream id)
@@ -102,26 +548,28 @@ void Mesh::initOpenGLObjects()
   if (vao == 0) {
     glGenVertexArrays(1, &vao);
   }
-  glBindVertexArray(vao);
+  // Binding creates the VAO, the caller's one is bound again afterwards
+  GLuint previous = GlState::getVertexArray();
+  GlState::bindVertexArray(vao);
   if (vbo == 0) {
     glGenBuffers(1, &vbo);
   }
   if (vib == 0) {
     glGenBuffers(1, &vib);
   }
+  GlState::bindVertexArray(previous);
 
-  glBindVertexArray(0);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
   checkOpenGLErrors();
 }
 
 void Mesh::updateData()
 {
+  makeResident();
+
   uint32_t totalDataLen = 0;
   for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
     if (hasDataBuffer(static_cast<DataStream>(i))) {
-      totalDataLen += static_cast<uint32_t>(rawBuffers[i].size());
+      totalDataLen += static_cast<uint32_t>(streamSizes[i]);
     }
   }
 
@@ -133,58 +581,473 @@ void Mesh::updateData()
     if (!hasDataBuffer(static_cast<DataStream>(i))) {
       continue;
     }
-    data.insert(data.end(), rawBuffers[i].begin(), rawBuffers[i].end());
+    data.insert(data.end(), streamData(i), streamData(i) + streamSizes[i]);
   }
   needsUpdate = false;
 }
 
-void Mesh::updateVAO()
+void Mesh::updateStreamOffsets()
 {
-#ifdef _DEBUG
-  assert(vao);
-  assert(vbo);
-  assert(vib);
-#endif
+  size_t offset = 0;
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    streamOffsets[i] = offset;
+    if (hasDataBuffer(static_cast<DataStream>(i))) {
+      offset += streamSizes[i];
+    }
+  }
+}
+
+void Mesh::setupAttributePointers(size_t baseOffset)
+{
+  GlState::bindBuffer(GL_ARRAY_BUFFER, vbo);
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if (!hasDataBuffer(static_cast<DataStream>(i))) {
+      glDisableVertexAttribArray(i);
+      continue;
+    }
+    glEnableVertexAttribArray(i);
+    int type = rawBufferDesc[i].first;
+    int components = rawBufferDesc[i].second;
+
+    glVertexAttribPointer(i, components, type, GL_FALSE, 0,
+                          (const GLvoid*)(baseOffset + streamOffsets[i]));
+  }
+  if (depthVao) {
+    setupDepthAttributes(baseOffset);
+  }
+}
 
-  glBindVertexArray(vao);
+void Mesh::setupDepthAttributes(size_t baseOffset)
+{
+  // Positions are one tightly packed range of the vertex buffer, so the
+  // depth pass fetches only them
+  GLuint previous = GlState::getVertexArray();
+  GlState::bindVertexArray(depthVao);
+  GlState::bindBuffer(GL_ARRAY_BUFFER, vbo);
+  const int i = static_cast<int>(DataStream::VERTEX);
+  glEnableVertexAttribArray(i);
+  glVertexAttribPointer(i, rawBufferDesc[i].second, rawBufferDesc[i].first,
+                        GL_FALSE, 0,
+                        (const GLvoid*)(baseOffset + streamOffsets[i]));
+  GlState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, vib);
+  GlState::bindVertexArray(previous);
+}
 
+void Mesh::uploadFull()
+{
   // New chunk combiner approach
   if (needsUpdate) {
     updateData();
   }
 
-  glBindBuffer(GL_ARRAY_BUFFER, vbo);
-  glBufferData(GL_ARRAY_BUFFER, data.size(), data.data(), GL_STATIC_DRAW);
+  GlState::bindBuffer(GL_ARRAY_BUFFER, vbo);
+  glBufferData(GL_ARRAY_BUFFER, data.size(), data.data(),
+               usage == MeshUsage::STATIC ? GL_STATIC_DRAW : GL_DYNAMIC_DRAW);
+  updateStreamOffsets();
+  setupAttributePointers(0);
+  uploadedSize = data.size();
+}
 
-  size_t offset = 0;
+void Mesh::uploadDirtyRanges()
+{
+  size_t dirtyBytes = 0;
+  for (const auto& range : dirtyRanges) {
+    if (range.first < range.second) {
+      dirtyBytes += range.second - range.first;
+    }
+  }
+
+  // Keep the combined copy in sync with the streams
+  bool patchData = !needsUpdate && data.size() == uploadedSize;
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    const auto& range = dirtyRanges[i];
+    if (patchData && range.first < range.second) {
+      memcpy(data.data() + streamOffsets[i] + range.first,
+             streamData(i) + range.first, range.second - range.first);
+    }
+  }
+
+  GlState::bindBuffer(GL_ARRAY_BUFFER, vbo);
+
+  // When most of the buffer changed, orphan it so the driver can hand out
+  // fresh storage instead of waiting for pending draws that use the old one
+  if (dirtyBytes * 2 > uploadedSize && isFullyResident()) {
+    glBufferData(GL_ARRAY_BUFFER, uploadedSize, nullptr,
+                 usage == MeshUsage::STATIC ? GL_STATIC_DRAW : GL_DYNAMIC_DRAW);
+    for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+      if (hasDataBuffer(static_cast<DataStream>(i))) {
+        glBufferSubData(GL_ARRAY_BUFFER, streamOffsets[i], streamSizes[i],
+                        streamData(i));
+      }
+    }
+    return;
+  }
+
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    const auto& range = dirtyRanges[i];
+    if (range.first < range.second) {
+      glBufferSubData(GL_ARRAY_BUFFER, streamOffsets[i] + range.first,
+                      range.second - range.first,
+                      streamData(i) + range.first);
+    }
+  }
+}
+
+bool Mesh::allocatePersistentStorage()
+{
+  if (!GLAD_GL_VERSION_4_4 && !GLAD_GL_ARB_buffer_storage) {
+    return false;
+  }
+
+  releasePersistentStorage();
+  GlState::deleteBuffers(1, &vbo);
+  glGenBuffers(1, &vbo);
+
+  updateStreamOffsets();
+  size_t total = 0;
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if (hasDataBuffer(static_cast<DataStream>(i))) {
+      total += streamSizes[i];
+    }
+  }
+  persistentStride = (total + 255) & ~static_cast<size_t>(255);
+  if (persistentStride == 0) {
+    return false;
+  }
+
+  const GLbitfield flags =
+    GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+  auto size = static_cast<GLsizeiptr>(persistentStride * persistentRingSize);
+  GlState::bindBuffer(GL_ARRAY_BUFFER, vbo);
+  glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+  persistentPtr =
+    static_cast<uint8_t*>(glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags));
+  if (!persistentPtr) {
+    std::cerr << "Mesh: failed to map persistent vertex buffer" << std::endl;
+    GlState::deleteBuffers(1, &vbo);
+    glGenBuffers(1, &vbo);
+    return false;
+  }
+  uploadedSize = total;
+  persistentIndex = persistentRingSize - 1;
+  uploadPersistent();
+  return true;
+}
+
+void Mesh::releasePersistentStorage()
+{
+  for (auto& fence : persistentFences) {
+    if (fence) {
+      glDeleteSync(fence);
+      fence = nullptr;
+    }
+  }
+  if (persistentPtr) {
+    GlState::bindBuffer(GL_ARRAY_BUFFER, vbo);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    persistentPtr = nullptr;
+  }
+}
+
+void Mesh::uploadPersistent()
+{
+  // Fence the region the GPU may still be reading, then move on to the next
+  // one in the ring and wait only if the GPU is still behind on it
+  auto& current = persistentFences[persistentIndex];
+  if (current) {
+    glDeleteSync(current);
+  }
+  current = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  persistentIndex = (persistentIndex + 1) % persistentRingSize;
+
+  auto& next = persistentFences[persistentIndex];
+  if (next) {
+    GLenum res = GL_TIMEOUT_EXPIRED;
+    while (res == GL_TIMEOUT_EXPIRED) {
+      res = glClientWaitSync(next, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+    }
+    glDeleteSync(next);
+    next = nullptr;
+  }
+
+  // The region holds data from persistentRingSize updates ago, so all streams
+  // are written, not only the dirty ranges
+  uint8_t* dst = persistentPtr + persistentIndex * persistentStride;
   for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
     if (hasDataBuffer(static_cast<DataStream>(i))) {
-      glEnableVertexAttribArray(i);
-      int type = rawBufferDesc[i].first;
-      int components = rawBufferDesc[i].second;
+      memcpy(dst + streamOffsets[i], streamData(i), streamSizes[i]);
+    }
+  }
+  // The streams changed but the combined copy didn't
+  needsUpdate = true;
+  setupAttributePointers(persistentIndex * persistentStride);
+}
+
+void Mesh::updateVAO()
+{
+#ifdef _DEBUG
+  assert(vao);
+  assert(vbo);
+  assert(vib);
+#endif
+
+  if (arena) {
+    arena->update(*this);
+    return;
+  }
+
+  GLuint previous = GlState::getVertexArray();
+  GlState::bindVertexArray(vao);
+
+  // Nothing marked as modified keeps the old behaviour of uploading
+  // everything, otherwise only the dirty ranges go to the GPU. Mapped
+  // persistent storage is only reallocated when the layout changed.
+  bool fullUpload = layoutDirty || (!hasDirtyRanges() && !indicesDirty);
+  if (usage == MeshUsage::PERSISTENT && persistentPtr && !layoutDirty) {
+    fullUpload = false;
+  }
+
+  // Released streams are needed whenever the whole buffer is written
+  if (fullUpload || (usage == MeshUsage::PERSISTENT && hasDirtyRanges())) {
+    makeResident();
+  }
 
-      glVertexAttribPointer(i, components, type, GL_FALSE, 0,
-                            (const GLvoid*)offset);
-      offset += rawBuffers[i].size();
+  if (usage == MeshUsage::PERSISTENT) {
+    if (fullUpload) {
+      if (!allocatePersistentStorage()) {
+        std::cerr << "Mesh: persistent mapping not available, using dynamic "
+                     "buffer"
+                  << std::endl;
+        usage = MeshUsage::DYNAMIC;
+        uploadFull();
+      }
+    } else if (hasDirtyRanges()) {
+      uploadPersistent();
     }
+  } else if (fullUpload) {
+    uploadFull();
+  } else if (hasDirtyRanges()) {
+    uploadDirtyRanges();
   }
 
-  if (indices.size()) {
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vib);
+  if (indices.size() && (fullUpload || indicesDirty)) {
+    GlState::bindBuffer(GL_ELEMENT_ARRAY_BUFFER, vib);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned int) * indices.size(),
-                 indices.data(), GL_STATIC_DRAW);
+                 indices.data(),
+                 usage == MeshUsage::STATIC ? GL_STATIC_DRAW : GL_DYNAMIC_DRAW);
   }
+  layoutDirty = false;
+  indicesDirty = false;
+  clearDirtyRanges();
+  applyResidency();
+  GlState::bindVertexArray(previous);
 
-  glBindVertexArray(0);
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
-  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
   checkOpenGLErrors();
 }
 
 void Mesh::setIndices(const std::vector<unsigned int>& _indices)
 {
   indices = _indices;
-  needsUpdate = true;
+  contentHashValid = false;
+  bvh.reset();
+  indicesResident = true;
+  indicesDirty = true;
+}
+
+size_t Mesh::weldVertices(float positionEpsilon, unsigned threads)
+{
+  makeResident();
+  const size_t vertexCount = getVertexCount();
+  if (vertexCount == 0) {
+    return 0;
+  }
+  MY_ASSERT(vertexCount < std::numeric_limits<uint32_t>::max(),
+            "Too many vertices to weld");
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // Not worth spinning up threads for small meshes
+  if (vertexCount < (1 << 16)) {
+    threads = 1;
+  }
+
+  struct Stream {
+    int id;
+    const uint8_t* data;
+    size_t elementSize;
+  };
+  std::vector<Stream> active;
+  for (auto i = 0; i < static_cast<int>(DataStream::LAST); i++) {
+    if (!(streams & (1 << i))) {
+      continue;
+    }
+    auto elementSize = getElementSize(static_cast<DataStream>(i));
+    MY_ASSERT(streamSizes[i] == vertexCount * elementSize,
+              "All streams need the same number of elements to weld");
+    active.push_back({i, streamData(i), elementSize});
+  }
+
+  // Positions snap to a grid of epsilon sized cells, so nearly equal positions
+  // produce the same key. Points close to a cell border may still land in
+  // neighbouring cells and stay apart.
+  const auto vertexId = static_cast<int>(DataStream::VERTEX);
+  const int positionComponents = rawBufferDesc[vertexId].second;
+  const bool quantize = positionEpsilon > 0.0f &&
+                        rawBufferDesc[vertexId].first == GL_FLOAT &&
+                        positionComponents <= 4;
+  const float invEpsilon = quantize ? 1.0f / positionEpsilon : 0.0f;
+  const float* positions = reinterpret_cast<const float*>(streamData(vertexId));
+  auto positionKey = [&](size_t v, int64_t* cells) {
+    const float* p = positions + v * positionComponents;
+    for (int c = 0; c < positionComponents; c++) {
+      cells[c] = static_cast<int64_t>(std::floor(p[c] * invEpsilon + 0.5f));
+    }
+  };
+  auto hashVertex = [&](size_t v) {
+    uint64_t h = 0;
+    for (const auto& stream : active) {
+      if (quantize && stream.id == vertexId) {
+        int64_t cells[4];
+        positionKey(v, cells);
+        h = hash64(cells, positionComponents * sizeof(int64_t), h);
+      } else {
+        h = hash64(stream.data + v * stream.elementSize, stream.elementSize, h);
+      }
+    }
+    return h;
+  };
+  auto sameVertex = [&](size_t a, size_t b) {
+    for (const auto& stream : active) {
+      if (quantize && stream.id == vertexId) {
+        int64_t cellsA[4], cellsB[4];
+        positionKey(a, cellsA);
+        positionKey(b, cellsB);
+        if (memcmp(cellsA, cellsB, positionComponents * sizeof(int64_t))) {
+          return false;
+        }
+      } else if (memcmp(stream.data + a * stream.elementSize,
+                        stream.data + b * stream.elementSize,
+                        stream.elementSize)) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  // 1. hash every vertex and bucket it by shard, one bucket list per source
+  // chunk so every shard sees its vertices in ascending order
+  std::vector<uint64_t> hashes(vertexCount);
+  std::vector<std::vector<std::vector<uint32_t>>> buckets(
+    threads, std::vector<std::vector<uint32_t>>(threads));
+  parallelChunks(vertexCount, threads,
+                 [&](size_t begin, size_t end, unsigned chunk) {
+                   for (size_t v = begin; v < end; v++) {
+                     hashes[v] = hashVertex(v);
+                     buckets[chunk][hashes[v] % threads].push_back(
+                       static_cast<uint32_t>(v));
+                   }
+                 });
+
+  // 2. every shard owns the vertices with its hashes. The first occurrence of
+  // a vertex becomes the representative, so the result doesn't depend on the
+  // thread count.
+  std::vector<uint32_t> remap(vertexCount);
+  parallelChunks(threads, threads, [&](size_t begin, size_t end, unsigned) {
+    for (size_t shard = begin; shard < end; shard++) {
+      std::unordered_multimap<uint64_t, uint32_t> representatives;
+      for (unsigned chunk = 0; chunk < threads; chunk++) {
+        for (auto v : buckets[chunk][shard]) {
+          auto [it, last] = representatives.equal_range(hashes[v]);
+          while (it != last && !sameVertex(it->second, v)) {
+            ++it;
+          }
+          if (it != last) {
+            remap[v] = it->second;
+          } else {
+            representatives.emplace(hashes[v], v);
+            remap[v] = v;
+          }
+        }
+      }
+    }
+  });
+  std::vector<uint64_t>().swap(hashes);
+  buckets.clear();
+
+  // 3. representatives keep their relative order in the compacted streams
+  constexpr uint32_t notRepresentative = std::numeric_limits<uint32_t>::max();
+  std::vector<uint32_t> newIndex(vertexCount, notRepresentative);
+  uint32_t uniqueCount = 0;
+  for (size_t v = 0; v < vertexCount; v++) {
+    if (remap[v] == v) {
+      newIndex[v] = uniqueCount++;
+    }
+  }
+  if (uniqueCount == vertexCount && !indices.empty()) {
+    return vertexCount;
+  }
+
+  for (const auto& stream : active) {
+    std::vector<uint8_t> compacted(uniqueCount * stream.elementSize);
+    parallelChunks(vertexCount, threads,
+                   [&](size_t begin, size_t end, unsigned) {
+                     for (size_t v = begin; v < end; v++) {
+                       if (newIndex[v] != notRepresentative) {
+                         memcpy(
+                           compacted.data() + newIndex[v] * stream.elementSize,
+                           stream.data + v * stream.elementSize,
+                           stream.elementSize);
+                       }
+                     }
+                   });
+    setDataBuffer(static_cast<DataStream>(stream.id), std::move(compacted),
+                  rawBufferDesc[stream.id].first,
+                  rawBufferDesc[stream.id].second);
+  }
+
+  // 4. remap the existing indices or generate them for unindexed geometry
+  std::vector<unsigned int> welded;
+  if (indices.empty()) {
+    welded.resize(vertexCount);
+    parallelChunks(vertexCount, threads,
+                   [&](size_t begin, size_t end, unsigned) {
+                     for (size_t v = begin; v < end; v++) {
+                       welded[v] = newIndex[remap[v]];
+                     }
+                   });
+  } else {
+    welded.resize(indices.size());
+    parallelChunks(indices.size(), threads,
+                   [&](size_t begin, size_t end, unsigned) {
+                     for (size_t i = begin; i < end; i++) {
+                       MY_ASSERT(indices[i] < vertexCount,
+                                 "Index out of range");
+                       welded[i] = newIndex[remap[indices[i]]];
+                     }
+                   });
+  }
+  setIndices(welded);
+  return uniqueCount;
+}
+
+const MeshBVH* Mesh::getBVH()
+{
+  if (bvh) {
+    return bvh.get();
+  }
+  auto vertexId = static_cast<int>(DataStream::VERTEX);
+  if (!hasDataBuffer(DataStream::VERTEX) ||
+      rawBufferDesc[vertexId].first != GL_FLOAT ||
+      rawBufferDesc[vertexId].second < 3) {
+    return nullptr;
+  }
+  makeResident();
+  bvh = std::make_unique<MeshBVH>();
+  bvh->build(reinterpret_cast<const float*>(streamData(vertexId)),
+             rawBufferDesc[vertexId].second, getVertexCount(),
+             indices.empty() ? nullptr : indices.data(),
+             indices.empty() ? getVertexCount() : indices.size());
+  return bvh.get();
 }
 
 void Mesh::use()
@@ -192,13 +1055,13 @@ void Mesh::use()
 #if _DEBUG
   assert(vao);
 #endif
-  glBindVertexArray(vao);
+  GlState::bindVertexArray(getVertexArray());
   checkOpenGLErrors();
 }
 
 void Mesh::unuse()
 {
-  glBindVertexArray(0);
+  GlState::bindVertexArray(0);
 }
 
 void Mesh::calculateAABB()
@@ -207,9 +1070,13 @@ void Mesh::calculateAABB()
     return;
   }
 
-  auto& vertsRaw = getDataBuffer(agt3d::DataStream::VERTEX);
-  glm::vec3* verts = (glm::vec3*)vertsRaw.data();
-  size_t numVerts = vertsRaw.size() / sizeof(glm::vec3);
+  // Read through streamData() so an external buffer is not copied
+  if (!isResident(DataStream::VERTEX)) {
+    makeResident();
+  }
+  auto _id = static_cast<int>(DataStream::VERTEX);
+  const glm::vec3* verts = (const glm::vec3*)streamData(_id);
+  size_t numVerts = streamSizes[_id] / sizeof(glm::vec3);
   aabb.calculateFromPoints(verts, static_cast<uint32_t>(numVerts));
   aabbNeedsUpdate = false;
 
@@ -13,43 +13,238 @@ namespace agt3d {
     LAST
   };
 
+  /**
+   * @brief How the vertex buffer of a mesh is stored and refreshed on the GPU.
+   * STATIC - GL_STATIC_DRAW, meant for geometry that is uploaded once.
+   * DYNAMIC - GL_DYNAMIC_DRAW, only dirty ranges are re-uploaded with
+   * glBufferSubData, the buffer is orphaned when most of it changed.
+   * PERSISTENT - persistently mapped ring buffer (GL 4.4 or
+   * ARB_buffer_storage), falls back to DYNAMIC when not available.
+   */
+  enum class MeshUsage {
+    STATIC = 0,
+    DYNAMIC,
+    PERSISTENT
+  };
+
+  /**
+   * @brief What a mesh keeps in host memory once its data is on the GPU.
+   * KEEP_ALL - streams, the combined copy and indices stay in RAM.
+   * KEEP_POSITIONS - only the VERTEX stream and indices stay, enough for
+   * picking and bounds.
+   * DISCARD - nothing stays, bounds are computed before the data is dropped.
+   * Released data is read back from the GPU on demand by getDataBuffer() or
+   * makeResident(), which then needs a current OpenGL context.
+   */
+  enum class MeshResidency {
+    KEEP_ALL = 0,
+    KEEP_POSITIONS,
+    DISCARD
+  };
+
+  /**
+   * @brief Called with the buffer pointer once the mesh no longer needs an
+   * external data buffer.
+   */
+  using BufferDeleter = std::function<void(const uint8_t*)>;
+
+  class GeometryArena;
+  class MeshBVH;
+
   class Mesh
   {
   public:
     Mesh();
     ~Mesh();
     void setDataBuffer(DataStream id, const float* data, size_t sizeInBytes, int type, int components);
+    /**
+     * @brief Take over the storage of the vector without copying.
+     */
+    void setDataBuffer(DataStream id, std::vector<uint8_t>&& buffer, int type, int components);
+    /**
+     * @brief Use caller owned memory as the data buffer without copying. With
+     * a deleter the mesh owns the memory and calls the deleter when the stream
+     * is replaced, released by the residency policy or the mesh is destroyed.
+     * Without a deleter the memory is borrowed and has to outlive that moment.
+     * Submitting the current pointer again only replaces the deleter, the old
+     * one is not called. getDataBuffer() copies an external buffer into the mesh before handing
+     * out a mutable vector.
+     */
+    void setExternalDataBuffer(DataStream id, std::span<const uint8_t> buffer, int type, int components, BufferDeleter deleter = nullptr);
     void setDataBufferFromInterleaved(DataStream id, const uint8_t* data, int strideInBytes, int type, int components, size_t elementsCount, size_t elementSizeInBytes);
+    /**
+     * @brief Overwrite a part of an existing data buffer and mark it dirty.
+     * The layout of the mesh doesn't change, so the next updateVAO() uploads
+     * only the modified range.
+     * @param id data stream to update.
+     * @param data source bytes.
+     * @param offsetInBytes offset into the data stream.
+     * @param sizeInBytes number of bytes to copy.
+     */
+    void updateDataBufferRange(DataStream id, const void* data, size_t offsetInBytes, size_t sizeInBytes);
+    /**
+     * @brief Mark a range of the data buffer as modified. Use it after changing
+     * the buffer returned by getDataBuffer() in place.
+     */
+    void markDirty(DataStream id, size_t offsetInBytes, size_t sizeInBytes);
     bool hasDataBuffer(DataStream id);
     std::vector<uint8_t>& getDataBuffer(DataStream id);
     std::pair<int, int> getDataBufferDesc(DataStream id);
+    void setUsage(MeshUsage _usage);
+    MeshUsage getUsage() const noexcept;
+    /**
+     * @brief Set the host memory policy. It is applied at the end of every
+     * updateVAO().
+     */
+    void setResidency(MeshResidency _residency);
+    MeshResidency getResidency() const noexcept;
+    bool isResident(DataStream id) const noexcept;
+    /**
+     * @brief Read every released stream and the indices back from the GPU.
+     */
+    void makeResident();
+    /**
+     * @brief Number of indices, also valid when the indices are not resident.
+     */
+    size_t getIndexCount() const noexcept;
+    /**
+     * @brief Bytes of vertex and index data currently held in host memory.
+     */
+    size_t getResidentBytes() const noexcept;
+    /**
+     * @brief Size of one element of the stream in bytes.
+     */
+    size_t getElementSize(DataStream id) const noexcept;
+    size_t getVertexCount() const noexcept;
+    /**
+     * @brief Size of the vertex and index data as stored on the GPU.
+     */
+    size_t getGeometryBytes() const noexcept;
+    /**
+     * @brief 64-bit hash over the stream layout, every stream and the indices.
+     * Cached until the data changes.
+     */
+    uint64_t getContentHash();
+    /**
+     * @brief Byte-wise comparison of layout, streams and indices. Falls back
+     * to comparing content hashes when either mesh released its host data.
+     */
+    bool hasSameContent(Mesh& other);
+    /**
+     * @brief VAO to bind for drawing, the pool VAO when the mesh lives in a
+     * GeometryArena.
+     */
+    GLuint getVertexArray() const noexcept;
+    /**
+     * @brief VAO that only enables the VERTEX stream, for depth-only passes.
+     * Created on first use, shares the buffers of getVertexArray(), so
+     * draw() works with it the same way.
+     */
+    GLuint getDepthVertexArray();
+    /**
+     * @brief Issue the draw call for the whole mesh, honouring the base vertex
+     * and first index of an arena allocation. The VAO from getVertexArray()
+     * has to be bound.
+     * @param mode GL primitive, GL_TRIANGLES, GL_POINTS, ...
+     * @param instanceCount number of instances to draw.
+     */
+    void draw(GLenum mode, GLsizei instanceCount = 1);
     void updateData();
     void updateVAO();
     void setIndices(const std::vector<unsigned int>& _indices);
+    /**
+     * @brief Merge vertices that are equal in every stream and compact the
+     * streams. Existing indices are remapped, unindexed geometry gets indices
+     * generated. The first occurrence of a vertex is kept, so the result is the
+     * same for any thread count.
+     * @param positionEpsilon positions are compared on a grid of this cell
+     * size (float positions only), 0 compares them exactly.
+     * @param threads worker count, 0 uses all hardware threads.
+     * @return number of vertices after welding.
+     */
+    size_t weldVertices(float positionEpsilon = 0.0f, unsigned threads = 0);
     void use();
     void unuse();
     const BoundingSphere& getBoundingSphere();
     const AABB& getAABB();
+    /**
+     * @brief Triangle BVH for ray queries in mesh space, built on first use
+     * and rebuilt after the positions or indices change.
+     * @return nullptr when the VERTEX stream isn't float xyz.
+     */
+    const MeshBVH* getBVH();
 
   private:
     void calculateAABB();
     void initOpenGLObjects();
+    void prepareStream(DataStream id, size_t sizeInBytes, int type, int components);
+    void releaseExternalBuffer(int id);
+    const uint8_t* streamData(int id) const noexcept;
+    bool hasDirtyRanges() const noexcept;
+    void clearDirtyRanges() noexcept;
+    void updateStreamOffsets();
+    void setupAttributePointers(size_t baseOffset);
+    void setupDepthAttributes(size_t baseOffset);
+    void uploadFull();
+    void uploadDirtyRanges();
+    bool allocatePersistentStorage();
+    void releasePersistentStorage();
+    void uploadPersistent();
+    size_t currentBaseOffset() const noexcept;
+    bool isFullyResident() const noexcept;
+    void applyResidency();
 
   public:
     GLuint vao = 0;
     GLuint vbo = 0;
     GLuint vib = 0;
+    /// Position-only VAO, 0 until getDepthVertexArray() is called.
+    GLuint depthVao = 0;
     std::vector<uint8_t> data;
     std::vector<uint8_t> rawBuffers[static_cast<int>(DataStream::LAST)];
     std::vector<std::pair<int, int>> rawBufferDesc;
     std::vector<unsigned int> indices;
     uint32_t streams = 0UL;
+    /// Set while the geometry is suballocated from a GeometryArena.
+    GeometryArena* arena = nullptr;
+    uint32_t arenaPool = 0;
+    uint32_t baseVertex = 0;
+    uint32_t firstIndex = 0;
   private:
+    friend class GeometryArena;
+    static constexpr int persistentRingSize = 3;
     AABB aabb;
     BoundingSphere boundingSphere = { {0,0,0}, 0.0f };
     bool aabbNeedsUpdate = true;
+    std::unique_ptr<MeshBVH> bvh;
     bool needsUpdate = false;
-
+    bool layoutDirty = true;
+    bool indicesDirty = false;
+    MeshUsage usage = MeshUsage::STATIC;
+    MeshResidency residency = MeshResidency::KEEP_ALL;
+    /// Logical size of every stream, kept while the stream is released.
+    size_t streamSizes[static_cast<int>(DataStream::LAST)] = {};
+    uint32_t residentStreams = 0UL;
+    size_t indexCount = 0;
+    bool indicesResident = true;
+    struct ExternalBuffer {
+      const uint8_t* ptr = nullptr;
+      BufferDeleter deleter;
+    };
+    ExternalBuffer externalBuffers[static_cast<int>(DataStream::LAST)];
+    uint32_t externalStreams = 0UL;
+    uint64_t contentHash = 0;
+    bool contentHashValid = false;
+    size_t arenaVertexCount = 0;
+    size_t arenaIndexCount = 0;
+    /// Byte range [first, second) per stream modified since the last upload.
+    std::pair<size_t, size_t> dirtyRanges[static_cast<int>(DataStream::LAST)];
+    size_t streamOffsets[static_cast<int>(DataStream::LAST)] = {};
+    size_t uploadedSize = 0;
+    uint8_t* persistentPtr = nullptr;
+    size_t persistentStride = 0;
+    int persistentIndex = 0;
+    GLsync persistentFences[persistentRingSize] = {};
   };
-  
+
 }
\ No newline at end of file
@@ -0,0 +1,280 @@
+#include "agt_mesh_bvh.h"
+
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+static constexpr int sahBins = 16;
+static constexpr uint32_t maxLeafTriangles = 4;
+
+static float surfaceArea(const glm::vec3& bmin, const glm::vec3& bmax) noexcept
+{
+  glm::vec3 e = bmax - bmin;
+  return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+/**
+ * @brief Slab test, returns the entry distance or max float on a miss.
+ */
+static float intersectBox(const glm::vec3& bmin, const glm::vec3& bmax,
+                          const glm::vec3& origin, const glm::vec3& invDir,
+                          float tMax) noexcept
+{
+  glm::vec3 t0 = (bmin - origin) * invDir;
+  glm::vec3 t1 = (bmax - origin) * invDir;
+  glm::vec3 tNear = glm::min(t0, t1);
+  glm::vec3 tFar = glm::max(t0, t1);
+  float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+  float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, tMax));
+  return enter <= exit ? enter : std::numeric_limits<float>::max();
+}
+
+void MeshBVH::build(const float* positions, size_t positionStride,
+                    size_t vertexCount, const unsigned int* indices,
+                    size_t indexCount)
+{
+  nodes.clear();
+  triangles.clear();
+  triangleIds.clear();
+  const size_t triangleCount = indexCount / 3;
+  if (triangleCount == 0) {
+    return;
+  }
+
+  auto vertex = [&](size_t i) {
+    size_t v = indices ? indices[i] : i;
+    MY_ASSERT(v < vertexCount, "Index out of range");
+    const float* p = positions + v * positionStride;
+    return glm::vec3(p[0], p[1], p[2]);
+  };
+
+  triangles.resize(triangleCount);
+  triangleIds.resize(triangleCount);
+  std::vector<glm::vec3> centroids(triangleCount);
+  for (size_t t = 0; t < triangleCount; t++) {
+    glm::vec3 a = vertex(t * 3), b = vertex(t * 3 + 1), c = vertex(t * 3 + 2);
+    triangles[t] = {a, b - a, c - a};
+    triangleIds[t] = static_cast<uint32_t>(t);
+    centroids[t] = (a + b + c) / 3.0f;
+  }
+
+  nodes.reserve(triangleCount * 2);
+  nodes.push_back({{}, 0, {}, static_cast<uint32_t>(triangleCount)});
+  updateBounds(nodes[0]);
+  subdivide(0, centroids);
+  nodes.shrink_to_fit();
+}
+
+void MeshBVH::updateBounds(Node& node) const noexcept
+{
+  node.bmin = glm::vec3(std::numeric_limits<float>::max());
+  node.bmax = glm::vec3(-std::numeric_limits<float>::max());
+  for (uint32_t i = node.first; i < node.first + node.count; i++) {
+    const auto& tri = triangles[i];
+    for (const auto& v : {tri.v0, tri.v0 + tri.e1, tri.v0 + tri.e2}) {
+      node.bmin = glm::min(node.bmin, v);
+      node.bmax = glm::max(node.bmax, v);
+    }
+  }
+}
+
+void MeshBVH::subdivide(uint32_t nodeIndex, std::vector<glm::vec3>& centroids)
+{
+  // Explicit stack, degenerate inputs can get deep
+  std::vector<uint32_t> pending = {nodeIndex};
+  while (!pending.empty()) {
+    uint32_t current = pending.back();
+    pending.pop_back();
+    Node node = nodes[current];
+    if (node.count <= maxLeafTriangles) {
+      continue;
+    }
+
+    glm::vec3 cmin(std::numeric_limits<float>::max());
+    glm::vec3 cmax(-std::numeric_limits<float>::max());
+    for (uint32_t i = node.first; i < node.first + node.count; i++) {
+      cmin = glm::min(cmin, centroids[i]);
+      cmax = glm::max(cmax, centroids[i]);
+    }
+
+    // Binned SAH, pick the cheapest plane over all three axes
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1;
+    int bestSplit = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      float extent = cmax[axis] - cmin[axis];
+      if (extent <= 0.0f) {
+        continue;
+      }
+      struct Bin {
+        glm::vec3 bmin = glm::vec3(std::numeric_limits<float>::max());
+        glm::vec3 bmax = glm::vec3(-std::numeric_limits<float>::max());
+        uint32_t count = 0;
+      } bins[sahBins];
+      float scale = sahBins / extent;
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        int b = std::min(sahBins - 1,
+                         static_cast<int>((centroids[i][axis] - cmin[axis]) * scale));
+        const auto& tri = triangles[i];
+        for (const auto& v : {tri.v0, tri.v0 + tri.e1, tri.v0 + tri.e2}) {
+          bins[b].bmin = glm::min(bins[b].bmin, v);
+          bins[b].bmax = glm::max(bins[b].bmax, v);
+        }
+        bins[b].count++;
+      }
+
+      // Sweep from both sides to get the area and count left and right of
+      // every plane
+      float leftArea[sahBins - 1], rightArea[sahBins - 1];
+      uint32_t leftCount[sahBins - 1], rightCount[sahBins - 1];
+      Bin left, right;
+      for (int i = 0; i < sahBins - 1; i++) {
+        left.count += bins[i].count;
+        left.bmin = glm::min(left.bmin, bins[i].bmin);
+        left.bmax = glm::max(left.bmax, bins[i].bmax);
+        leftCount[i] = left.count;
+        leftArea[i] = left.count ? surfaceArea(left.bmin, left.bmax) : 0.0f;
+        const auto& bin = bins[sahBins - 1 - i];
+        right.count += bin.count;
+        right.bmin = glm::min(right.bmin, bin.bmin);
+        right.bmax = glm::max(right.bmax, bin.bmax);
+        rightCount[sahBins - 2 - i] = right.count;
+        rightArea[sahBins - 2 - i] =
+          right.count ? surfaceArea(right.bmin, right.bmax) : 0.0f;
+      }
+      for (int i = 0; i < sahBins - 1; i++) {
+        float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+        if (leftCount[i] && rightCount[i] && cost < bestCost) {
+          bestCost = cost;
+          bestAxis = axis;
+          bestSplit = i;
+        }
+      }
+    }
+
+    // Splitting has to beat intersecting every triangle of the node
+    float leafCost = node.count * surfaceArea(node.bmin, node.bmax);
+    if (bestAxis < 0 || bestCost >= leafCost) {
+      continue;
+    }
+
+    float scale = sahBins / (cmax[bestAxis] - cmin[bestAxis]);
+    uint32_t i = node.first;
+    uint32_t end = node.first + node.count;
+    while (i < end) {
+      int b = std::min(sahBins - 1,
+                       static_cast<int>((centroids[i][bestAxis] - cmin[bestAxis]) * scale));
+      if (b <= bestSplit) {
+        i++;
+      } else {
+        end--;
+        std::swap(triangles[i], triangles[end]);
+        std::swap(triangleIds[i], triangleIds[end]);
+        std::swap(centroids[i], centroids[end]);
+      }
+    }
+    uint32_t splitCount = i - node.first;
+
+    auto leftIndex = static_cast<uint32_t>(nodes.size());
+    nodes.push_back({{}, node.first, {}, splitCount});
+    nodes.push_back({{}, i, {}, node.count - splitCount});
+    updateBounds(nodes[leftIndex]);
+    updateBounds(nodes[leftIndex + 1]);
+    nodes[current].first = leftIndex;
+    nodes[current].count = 0;
+    pending.push_back(leftIndex);
+    pending.push_back(leftIndex + 1);
+  }
+}
+
+std::optional<RayHit> MeshBVH::intersect(const agt3d::ray& r,
+                                         float tMax) const
+{
+  if (nodes.empty()) {
+    return std::nullopt;
+  }
+  const glm::vec3 invDir = 1.0f / r.direction;
+  RayHit hit;
+  hit.t = tMax;
+  bool found = false;
+
+  std::vector<uint32_t> stack;
+  stack.reserve(64);
+  if (intersectBox(nodes[0].bmin, nodes[0].bmax, r.origin, invDir, hit.t) ==
+      std::numeric_limits<float>::max()) {
+    return std::nullopt;
+  }
+  stack.push_back(0);
+  while (!stack.empty()) {
+    const Node& node = nodes[stack.back()];
+    stack.pop_back();
+    if (node.count > 0) {
+      // Moeller-Trumbore
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        const auto& tri = triangles[i];
+        glm::vec3 p = glm::cross(r.direction, tri.e2);
+        float det = glm::dot(tri.e1, p);
+        if (std::fabs(det) < 1e-12f) {
+          continue;
+        }
+        float invDet = 1.0f / det;
+        glm::vec3 s = r.origin - tri.v0;
+        float u = glm::dot(s, p) * invDet;
+        if (u < 0.0f || u > 1.0f) {
+          continue;
+        }
+        glm::vec3 q = glm::cross(s, tri.e1);
+        float v = glm::dot(r.direction, q) * invDet;
+        if (v < 0.0f || u + v > 1.0f) {
+          continue;
+        }
+        float t = glm::dot(tri.e2, q) * invDet;
+        if (t >= 0.0f && t < hit.t) {
+          hit.t = t;
+          hit.triangle = triangleIds[i];
+          hit.barycentric = {u, v};
+          found = true;
+        }
+      }
+      continue;
+    }
+
+    // Visit the closer child first, push it last
+    const Node& a = nodes[node.first];
+    const Node& b = nodes[node.first + 1];
+    float ta = intersectBox(a.bmin, a.bmax, r.origin, invDir, hit.t);
+    float tb = intersectBox(b.bmin, b.bmax, r.origin, invDir, hit.t);
+    uint32_t near = node.first, far = node.first + 1;
+    if (tb < ta) {
+      std::swap(ta, tb);
+      std::swap(near, far);
+    }
+    if (tb != std::numeric_limits<float>::max()) {
+      stack.push_back(far);
+    }
+    if (ta != std::numeric_limits<float>::max()) {
+      stack.push_back(near);
+    }
+  }
+
+  if (!found) {
+    return std::nullopt;
+  }
+  hit.position = r.origin + r.direction * hit.t;
+  return hit;
+}
+
+size_t MeshBVH::getTriangleCount() const noexcept { return triangles.size(); }
+
+size_t MeshBVH::getNodeCount() const noexcept { return nodes.size(); }
+
+size_t MeshBVH::getMemoryBytes() const noexcept
+{
+  return nodes.capacity() * sizeof(Node) +
+         triangles.capacity() * sizeof(Triangle) +
+         triangleIds.capacity() * sizeof(uint32_t);
+}
+
+}  // namespace agt3d
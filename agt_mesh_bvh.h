@@ -0,0 +1,69 @@
+#pragma once
+
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+struct RayHit {
+  /// Distance along the ray in units of the ray direction length.
+  float t = std::numeric_limits<float>::max();
+  /// Index of the triangle, the triangle uses indices [3 * triangle, +3).
+  uint32_t triangle = 0;
+  /// Weights (u, v) of the second and third vertex, w = 1 - u - v.
+  glm::vec2 barycentric = {0, 0};
+  glm::vec3 position = {0, 0, 0};
+};
+
+/**
+ * @brief Bounding volume hierarchy over the triangles of a mesh, built with a
+ * binned surface area heuristic. The triangles are copied in leaf order, so
+ * queries don't touch the mesh and work after its host data was released.
+ */
+class MeshBVH
+{
+ public:
+  /**
+   * @param positions vertex positions with a stride of positionStride floats.
+   * @param indices triangle list, nullptr for unindexed geometry.
+   * @param indexCount number of indices, or vertices when unindexed.
+   */
+  void build(const float* positions, size_t positionStride,
+             size_t vertexCount, const unsigned int* indices,
+             size_t indexCount);
+  /**
+   * @brief Closest hit along the ray within [0, tMax]. The ray direction
+   * doesn't have to be normalized.
+   */
+  std::optional<RayHit> intersect(const agt3d::ray& r,
+                                  float tMax = std::numeric_limits<float>::max()) const;
+  size_t getTriangleCount() const noexcept;
+  size_t getNodeCount() const noexcept;
+  size_t getMemoryBytes() const noexcept;
+
+ private:
+  /// 32 bytes. Leaves have count > 0 and first pointing into triangles,
+  /// inner nodes have their children at first and first + 1.
+  struct Node {
+    glm::vec3 bmin;
+    uint32_t first;
+    glm::vec3 bmax;
+    uint32_t count;
+  };
+  struct Triangle {
+    glm::vec3 v0;
+    glm::vec3 e1;
+    glm::vec3 e2;
+  };
+
+  void subdivide(uint32_t nodeIndex, std::vector<glm::vec3>& centroids);
+  void updateBounds(Node& node) const noexcept;
+
+ private:
+  std::vector<Node> nodes;
+  std::vector<Triangle> triangles;
+  /// Original triangle index of every entry in triangles.
+  std::vector<uint32_t> triangleIds;
+};
+
+}  // namespace agt3d
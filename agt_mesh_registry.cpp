@@ -0,0 +1,58 @@
+#include "agt_mesh_registry.h"
+
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+static std::unordered_multimap<uint64_t, std::weak_ptr<agt3d::Mesh>>
+  registeredMeshes;
+static agt3d::MeshDedupStats dedupStats;
+static std::mutex registryMutex;
+
+namespace agt3d
+{
+
+std::shared_ptr<Mesh> dedupMesh(const std::shared_ptr<Mesh>& mesh)
+{
+  if (!mesh) {
+    return mesh;
+  }
+  const auto hash = mesh->getContentHash();
+
+  std::lock_guard<std::mutex> lock(registryMutex);
+  dedupStats.lookups++;
+  auto [it, end] = registeredMeshes.equal_range(hash);
+  while (it != end) {
+    auto other = it->second.lock();
+    if (!other) {
+      it = registeredMeshes.erase(it);
+      continue;
+    }
+    if (other == mesh) {
+      return mesh;
+    }
+    if (other->hasSameContent(*mesh)) {
+      dedupStats.duplicates++;
+      dedupStats.bytesSaved += mesh->getGeometryBytes();
+      return other;
+    }
+    ++it;
+  }
+  registeredMeshes.emplace(hash, mesh);
+  dedupStats.unique++;
+  return mesh;
+}
+
+MeshDedupStats getMeshDedupStats()
+{
+  std::lock_guard<std::mutex> lock(registryMutex);
+  return dedupStats;
+}
+
+void clearMeshDedupRegistry()
+{
+  std::lock_guard<std::mutex> lock(registryMutex);
+  registeredMeshes.clear();
+  dedupStats = MeshDedupStats();
+}
+
+}  // namespace agt3d
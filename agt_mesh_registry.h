@@ -0,0 +1,29 @@
+#pragma once
+
+#include "agt_mesh.h"
+
+namespace agt3d
+{
+
+struct MeshDedupStats {
+  size_t lookups = 0;
+  size_t unique = 0;
+  size_t duplicates = 0;
+  /// Vertex and index bytes that didn't have to be uploaded or kept.
+  size_t bytesSaved = 0;
+};
+
+/**
+ * @brief Look up a mesh with identical content in the process wide registry.
+ * Meshes are matched by Mesh::getContentHash() and confirmed with
+ * Mesh::hasSameContent(). The registry only holds weak references, a mesh
+ * drops out once the last owner releases it.
+ * Call it before updateVAO() so a duplicate never allocates GPU buffers.
+ * The returned mesh is shared, owners must not modify it afterwards.
+ * @return the already registered mesh, or the passed mesh when it is new.
+ */
+std::shared_ptr<Mesh> dedupMesh(const std::shared_ptr<Mesh>& mesh);
+MeshDedupStats getMeshDedupStats();
+void clearMeshDedupRegistry();
+
+}  // namespace agt3d
@@ -2,6 +2,7 @@
 
 #include "agt_model3d.h"
 
+#include "agt_mesh_registry.h"
 #include "agt_object.h"
 #include "agt_object_instance.h"
 #include "agt_scene.h"
@@ -35,6 +36,13 @@ Model3d::~Model3d()
 
 Model3d::ErrorCode Model3d::getError() { return error; }
 
+void Model3d::setMeshResidency(agt3d::MeshResidency residency)
+{
+  meshResidency = residency;
+}
+
+void Model3d::setMeshDeduplication(bool enable) { meshDeduplication = enable; }
+
 bool Model3d::loadFromDisk()
 {
   scene = const_cast<aiScene*>(
@@ -284,6 +292,13 @@ std::shared_ptr<agt3d::Mesh> Model3d::processMesh(aiMesh* aiMesh)
                         texcoords.size() * sizeof(glm::vec2), GL_FLOAT, 2);
   }
   mesh->setIndices(indices);
+  if (meshDeduplication) {
+    auto shared = agt3d::dedupMesh(mesh);
+    if (shared != mesh) {
+      return shared;
+    }
+  }
+  mesh->setResidency(meshResidency);
   mesh->updateData();
   mesh->updateVAO();
 
@@ -37,6 +37,18 @@ class Model3d
    */
   void prepare(agt3d::Scene& s);
   Model3d::ErrorCode getError();
+  /**
+   * @brief Host memory policy applied to every mesh created by prepare().
+   * @param residency see agt3d::MeshResidency.
+   */
+  void setMeshResidency(agt3d::MeshResidency residency);
+  /**
+   * @brief Share one agt3d::Mesh between all meshes with identical content,
+   * also across models (see agt3d::dedupMesh). Off by default, only enable
+   * it for models whose meshes are not modified after loading, a change
+   * would show up in every model sharing the mesh.
+   */
+  void setMeshDeduplication(bool enable);
 
  private:
   std::vector<std::shared_ptr<agt3d::Texture>> loadMaterialTextures(
@@ -52,6 +64,8 @@ class Model3d
   std::vector<std::shared_ptr<agt3d::Material>> materials;
   std::vector<std::shared_ptr<agt3d::Texture>> texturesLoaded;
   Model3d::ErrorCode error = Model3d::ErrorCode::OK;
+  agt3d::MeshResidency meshResidency = agt3d::MeshResidency::KEEP_ALL;
+  bool meshDeduplication = false;
   const std::string fullPath;
   const std::string pathWithoutFilename;
   const std::string filenameWithExtension;
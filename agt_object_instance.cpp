@@ -1,5 +1,6 @@
 #include "agt_stdafx.h"
 #include "agt_object_instance.h"
+#include "agt_mesh_bvh.h"
 
 namespace agt3d {
 
@@ -141,6 +142,37 @@ namespace agt3d {
     return tm;
   }
 
+  const glm::mat4& ObjectInstance::getInverseTm()
+  {
+    auto current = getTm();
+    if (current != inverseTmSource) {
+      inverseTm = glm::inverse(current);
+      inverseTmSource = current;
+    }
+    return inverseTm;
+  }
+
+  std::optional<RayHit> ObjectInstance::raycast(const ray& worldRay)
+  {
+    if (!isRenderable() || !getObject()->getMesh()) {
+      return std::nullopt;
+    }
+    auto bvh = getObject()->getMesh()->getBVH();
+    if (!bvh) {
+      return std::nullopt;
+    }
+    // Direction is not renormalized, so t stays the same in both spaces
+    const auto& inv = getInverseTm();
+    ray localRay;
+    localRay.origin = glm::vec3(inv * glm::vec4(worldRay.origin, 1.0f));
+    localRay.direction = glm::vec3(inv * glm::vec4(worldRay.direction, 0.0f));
+    auto hit = bvh->intersect(localRay);
+    if (hit) {
+      hit->position = worldRay.origin + worldRay.direction * hit->t;
+    }
+    return hit;
+  }
+
   void ObjectInstance::setParent(std::shared_ptr<ObjectInstance>& oi)
   {
     parent = oi;
@@ -150,32 +182,41 @@ namespace agt3d {
   agt3d::BoundingSphere ObjectInstance::getBoundingSphere()
   {
     MY_ASSERT(isRenderable(), "OI not renderable");
-/*
-    agt3d::BoundingSphere bs;
-    bs = getObject()->getMesh()->getBoundingSphere();
-
-    glm::vec3 scale;
-    glm::quat rotation;
-    glm::vec3 translation;
-    glm::vec3 skew;
-    glm::vec4 perspective;
-    glm::decompose(getTm(), scale, rotation, translation, skew, perspective);
-    bs.center += translation;
-    // Kind of a fast hack, but we are interested in the major component (absolute value) of the (non) uniform scaling vector   
-    bs.radius *= std::max(std::max(fabs(localPRS.localScale.x), fabs(localPRS.localScale.y)), fabs(localPRS.localScale.z));
-*/
-
-    agt3d::BoundingSphere bs;
-
-    const auto& aabb = getObject()->getMesh()->getAABB();
-    auto tm = getTm();
-    glm::vec3 min = tm * glm::vec4(aabb.min, 1.0f);
-    glm::vec3 max = tm * glm::vec4(aabb.max, 1.0f);
-    float d = glm::distance(min, max);
-    bs.radius = d / 2.0f;
-    bs.center = (min + max) / 2.0f;
-
-    return bs;
+    updateWorldBounds();
+    return worldSphere;
+  }
+
+  const agt3d::AABB& ObjectInstance::getWorldAABB()
+  {
+    MY_ASSERT(isRenderable(), "OI not renderable");
+    updateWorldBounds();
+    return worldAABB;
+  }
+
+  bool ObjectInstance::worldBoundsStale(const glm::mat4& _tm,
+                                        const AABB& local) const
+  {
+    return !worldBoundsValid || _tm != worldBoundsTm ||
+           !(local == worldBoundsLocal);
+  }
+
+  void ObjectInstance::setWorldBounds(const glm::mat4& _tm, const AABB& local,
+                                      const AABB& world)
+  {
+    worldBoundsTm = _tm;
+    worldBoundsLocal = local;
+    worldAABB = world;
+    worldSphere = getObject()->getMesh()->getBoundingSphere().transformed(_tm);
+    worldBoundsValid = true;
+  }
+
+  void ObjectInstance::updateWorldBounds()
+  {
+    auto _tm = getTm();
+    const auto& local = getObject()->getMesh()->getAABB();
+    if (worldBoundsStale(_tm, local)) {
+      setWorldBounds(_tm, local, local.transformed(_tm));
+    }
   }
 
   bool ObjectInstance::isRenderable()
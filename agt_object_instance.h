@@ -8,6 +8,8 @@ namespace agt3d
 {
 
 struct Shader;
+struct RayHit;
+struct ray;
 
 class RenderTechnique
 {
@@ -15,6 +17,8 @@ class RenderTechnique
   enum class DrawPrimitiveType { TRIANGLES, LINES, LINE_STRIP, POINTS };
 
   glm::vec4 borderColor = {1, 1, 1, 1};
+  /// Passed as the color uniform, or per instance when drawn instanced.
+  glm::vec4 color = {1, 1, 1, 1};
   /// Deprecated. Set point size via shader uniforms.
   // float pointSize = 0.25f;
   float borderRadius = 0.45f;
@@ -22,10 +26,30 @@ class RenderTechnique
   DrawPrimitiveType primitiveType = DrawPrimitiveType::TRIANGLES;
   bool disableDepthTest = false;
   bool enableAlphaBlending = false;
+  /// Lay down depth in RenderQueue's depth pre-pass and shade with GL_EQUAL.
+  /// Only used for opaque, depth tested triangles.
+  bool depthPrePass = false;
   GLuint alphaSrc = GL_ONE;
   GLuint alphaDst = GL_ONE_MINUS_SRC_ALPHA;
 };
 
+/**
+ * @brief GL primitive mode of a draw primitive type.
+ */
+inline GLenum toGlPrimitive(RenderTechnique::DrawPrimitiveType type) noexcept
+{
+  switch (type) {
+    case RenderTechnique::DrawPrimitiveType::LINES:
+      return GL_LINES;
+    case RenderTechnique::DrawPrimitiveType::LINE_STRIP:
+      return GL_LINE_STRIP;
+    case RenderTechnique::DrawPrimitiveType::POINTS:
+      return GL_POINTS;
+    default:
+      return GL_TRIANGLES;
+  }
+}
+
 class ObjectInstance
 {
  public:
@@ -42,8 +66,28 @@ class ObjectInstance
   void setLocalPosition(const glm::vec3& position);
   void setLocalScale(const glm::vec3& scale);
   void setLocalRotation(const glm::quat& rotation);
+  /**
+   * @brief Conservative world space sphere of the mesh, cached until the
+   * transform or the mesh bounds change.
+   */
   agt3d::BoundingSphere getBoundingSphere();
+  /**
+   * @brief Exact world space AABB of the mesh AABB, cached like the sphere.
+   * Scene::updateWorldBounds() refreshes all instances in one batch.
+   */
+  const agt3d::AABB& getWorldAABB();
   glm::mat4 getTm();
+  /**
+   * @brief Inverse of getTm(), cached until the transform changes.
+   */
+  const glm::mat4& getInverseTm();
+  /**
+   * @brief Intersect a world space ray with the triangles of the mesh, using
+   * the BVH shared by all instances of the mesh.
+   * @return closest hit, t is measured along the world ray and position is in
+   * world space.
+   */
+  std::optional<agt3d::RayHit> raycast(const agt3d::ray& worldRay);
   void setParent(std::shared_ptr<agt3d::ObjectInstance>& oi);
   const agt3d::ObjectInstance* getParent();
   bool isRenderable();
@@ -53,8 +97,23 @@ class ObjectInstance
   bool isEnabled();
 
  private:
+  friend class Scene;
+  bool worldBoundsStale(const glm::mat4& _tm, const agt3d::AABB& local) const;
+  void setWorldBounds(const glm::mat4& _tm, const agt3d::AABB& local,
+                      const agt3d::AABB& world);
+  void updateWorldBounds();
+
   bool tmDirty = true;
   glm::mat4 tm;
+  glm::mat4 inverseTm = glm::mat4(1);
+  /// The tm inverseTm was computed from, parents may change without notice.
+  glm::mat4 inverseTmSource = glm::mat4(1);
+  /// World bounds and the tm and mesh AABB they were computed from.
+  bool worldBoundsValid = false;
+  glm::mat4 worldBoundsTm;
+  agt3d::AABB worldBoundsLocal;
+  agt3d::AABB worldAABB;
+  agt3d::BoundingSphere worldSphere = {{0, 0, 0}, 0.0f};
 
  public:
   std::string name;
@@ -0,0 +1,213 @@
+#include "agt_readback.h"
+
+#include "agt_gl_state.h"
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+AsyncReadback::AsyncReadback(size_t slotCount, PixelLayout _layout, bool _flip)
+    : slots(std::max<size_t>(1, slotCount)), layout(_layout), flip(_flip)
+{
+  worker = std::thread([this]() { work(); });
+}
+
+AsyncReadback::~AsyncReadback()
+{
+  flush();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  worker.join();
+  for (auto& slot : slots) {
+    GlState::deleteBuffers(1, &slot.buffer);
+  }
+}
+
+void AsyncReadback::read(const FBO& fbo, Callback callback, GLenum attachment)
+{
+  MY_ASSERT(!fbo.multiSampled, "AsyncReadback: resolve multisampled FBOs");
+  auto& slot = slots[(oldest + pending) % slots.size()];
+  if (slot.fence) {
+    // The ring is full, the oldest read has to finish first
+    auto t0 = std::chrono::steady_clock::now();
+    glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                     GL_TIMEOUT_IGNORED);
+    collect(slot);
+    stats.stalls++;
+    stats.stallMs += std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - t0)
+                       .count();
+  }
+
+  size_t size = static_cast<size_t>(fbo.width) * fbo.height * 4;
+  if (!slot.buffer) {
+    glGenBuffers(1, &slot.buffer);
+  }
+  GlState::bindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+  if (slot.capacity < size) {
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+    slot.capacity = size;
+  }
+  GlState::bindFramebuffer(GL_READ_FRAMEBUFFER, fbo.id);
+  // Querying would sync with the driver, both are left at their defaults
+  // instead: alignment 4 and the first color attachment, which is state of
+  // the FBO
+  glReadBuffer(attachment);
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glReadPixels(0, 0, fbo.width, fbo.height, GL_RGBA, GL_UNSIGNED_BYTE,
+               nullptr);
+  if (attachment != GL_COLOR_ATTACHMENT0) {
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+  }
+  GlState::bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  slot.width = fbo.width;
+  slot.height = fbo.height;
+  slot.sequence = sequence++;
+  slot.callback = std::move(callback);
+  pending++;
+  stats.reads++;
+  stats.bytes += size;
+  checkOpenGLErrors();
+}
+
+std::future<ReadbackImage> AsyncReadback::read(const FBO& fbo,
+                                               GLenum attachment)
+{
+  auto promise = std::make_shared<std::promise<ReadbackImage>>();
+  auto future = promise->get_future();
+  read(
+    fbo,
+    [promise](ReadbackImage&& image) { promise->set_value(std::move(image)); },
+    attachment);
+  return future;
+}
+
+void AsyncReadback::collect(Slot& slot)
+{
+  MY_ASSERT(&slot == &slots[oldest], "AsyncReadback: collected out of order");
+  Job job;
+  job.image.width = slot.width;
+  job.image.height = slot.height;
+  job.image.sequence = slot.sequence;
+  job.image.pixels.resize(static_cast<size_t>(slot.width) * slot.height * 4);
+  job.callback = std::move(slot.callback);
+
+  GlState::bindBuffer(GL_PIXEL_PACK_BUFFER, slot.buffer);
+  auto data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0,
+                               job.image.pixels.size(), GL_MAP_READ_BIT);
+  if (data) {
+    memcpy(job.image.pixels.data(), data, job.image.pixels.size());
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  } else {
+    std::cerr << "AsyncReadback: failed to map pack buffer" << std::endl;
+  }
+  GlState::bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  glDeleteSync(slot.fence);
+  slot.fence = nullptr;
+  oldest = (oldest + 1) % slots.size();
+  pending--;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(std::move(job));
+  }
+  wake.notify_one();
+}
+
+void AsyncReadback::poll()
+{
+  while (pending > 0) {
+    auto& slot = slots[oldest];
+    GLenum status = glClientWaitSync(slot.fence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) {
+      break;
+    }
+    collect(slot);
+  }
+}
+
+void AsyncReadback::flush()
+{
+  while (pending > 0) {
+    auto& slot = slots[oldest];
+    glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                     GL_TIMEOUT_IGNORED);
+    collect(slot);
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  idle.wait(lock, [this]() { return jobs.empty() && !busy; });
+  stats.delivered = delivered;
+}
+
+const AsyncReadback::Stats& AsyncReadback::getStats() const noexcept
+{
+  return stats;
+}
+
+void AsyncReadback::convert(ReadbackImage& image) const
+{
+  const size_t width = image.width;
+  const size_t height = image.height;
+  auto& pixels = image.pixels;
+  if (flip) {
+    const size_t row = width * 4;
+    std::vector<uint8_t> swap(row);
+    for (size_t y = 0; y < height / 2; y++) {
+      uint8_t* top = pixels.data() + y * row;
+      uint8_t* bottom = pixels.data() + (height - 1 - y) * row;
+      memcpy(swap.data(), top, row);
+      memcpy(top, bottom, row);
+      memcpy(bottom, swap.data(), row);
+    }
+  }
+  switch (layout) {
+    case PixelLayout::RGBA:
+      break;
+    case PixelLayout::BGRA:
+      for (size_t i = 0; i < width * height; i++) {
+        std::swap(pixels[i * 4], pixels[i * 4 + 2]);
+      }
+      break;
+    case PixelLayout::RGB:
+      for (size_t i = 0; i < width * height; i++) {
+        pixels[i * 3] = pixels[i * 4];
+        pixels[i * 3 + 1] = pixels[i * 4 + 1];
+        pixels[i * 3 + 2] = pixels[i * 4 + 2];
+      }
+      pixels.resize(width * height * 3);
+      image.channels = 3;
+      break;
+  }
+}
+
+void AsyncReadback::work()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+    if (jobs.empty()) {
+      return;
+    }
+    Job job = std::move(jobs.front());
+    jobs.pop_front();
+    busy = true;
+    lock.unlock();
+
+    convert(job.image);
+    if (job.callback) {
+      job.callback(std::move(job.image));
+    }
+
+    lock.lock();
+    busy = false;
+    delivered++;
+    idle.notify_all();
+  }
+}
+
+}  // namespace agt3d
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "agt_fbo.h"
+
+namespace agt3d
+{
+
+/**
+ * @brief Channel order of the images delivered by AsyncReadback.
+ */
+enum class PixelLayout { RGBA, RGB, BGRA };
+
+struct ReadbackImage {
+  int width = 0;
+  int height = 0;
+  int channels = 4;
+  /// Tightly packed rows, top row first when the readback flips.
+  std::vector<uint8_t> pixels;
+  /// Counts the reads of one AsyncReadback, starting at 0.
+  uint64_t sequence = 0;
+};
+
+/**
+ * @brief Reads FBO color attachments back without stalling the pipeline.
+ *
+ * read() starts a glReadPixels into one of a ring of pixel pack buffers and
+ * places a fence after it. poll(), called once per frame, maps the buffers
+ * whose fences have signaled, in the order they were read, and hands the
+ * pixels to a worker thread that converts the channel order, flips the rows
+ * and delivers the image to a callback or future. With n slots a read is
+ * delivered up to n - 1 frames later. A read into a slot that is still in
+ * flight waits for it, which is counted as a stall.
+ *
+ * The pixel pack buffer binding is reset to 0 after every use, so client
+ * memory glReadPixels calls elsewhere keep working. Multisampled FBOs have
+ * to be resolved first, e.g. with FBO::blitQuick().
+ */
+class AsyncReadback
+{
+ public:
+  /// Runs on the worker thread.
+  using Callback = std::function<void(agt3d::ReadbackImage&& image)>;
+
+  struct Stats {
+    size_t reads = 0;
+    size_t delivered = 0;
+    size_t stalls = 0;
+    double stallMs = 0;
+    size_t bytes = 0;
+  };
+
+  explicit AsyncReadback(size_t slotCount = 3,
+                         agt3d::PixelLayout _layout = agt3d::PixelLayout::RGBA,
+                         bool _flip = true);
+  /**
+   * @brief Waits for all pending reads, needs the GL context.
+   */
+  ~AsyncReadback();
+  AsyncReadback& operator=(const AsyncReadback& other) = delete;
+  AsyncReadback(AsyncReadback&) = delete;
+
+  /**
+   * @brief Start reading an attachment. GL_PACK_ALIGNMENT and the read
+   * buffer of the FBO are left at their defaults, 4 and
+   * GL_COLOR_ATTACHMENT0.
+   */
+  void read(const agt3d::FBO& fbo, Callback callback,
+            GLenum attachment = GL_COLOR_ATTACHMENT0);
+  std::future<agt3d::ReadbackImage> read(
+    const agt3d::FBO& fbo, GLenum attachment = GL_COLOR_ATTACHMENT0);
+  /**
+   * @brief Collect the finished transfers without blocking.
+   */
+  void poll();
+  /**
+   * @brief Wait until every read has been delivered.
+   */
+  void flush();
+  /**
+   * @brief Reads, stalls and bytes as of the last GL thread call, delivered
+   * as of the last flush().
+   */
+  const Stats& getStats() const noexcept;
+
+ private:
+  struct Slot {
+    GLuint buffer = 0;
+    size_t capacity = 0;
+    GLsync fence = nullptr;
+    int width = 0;
+    int height = 0;
+    uint64_t sequence = 0;
+    Callback callback;
+  };
+  struct Job {
+    agt3d::ReadbackImage image;
+    Callback callback;
+  };
+  void collect(Slot& slot);
+  void work();
+  void convert(agt3d::ReadbackImage& image) const;
+
+ private:
+  std::vector<Slot> slots;
+  size_t oldest = 0;
+  size_t pending = 0;
+  uint64_t sequence = 0;
+  agt3d::PixelLayout layout;
+  bool flip;
+  Stats stats;
+
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable idle;
+  std::deque<Job> jobs;
+  bool busy = false;
+  bool stopping = false;
+  size_t delivered = 0;
+};
+
+}  // namespace agt3d
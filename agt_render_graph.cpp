@@ -0,0 +1,361 @@
+#include "agt_render_graph.h"
+
+#include "agt_gl_state.h"
+#include "agt_gpu_profiler.h"
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+RenderGraph::~RenderGraph()
+{
+  clear();
+  for (auto& allocation : allocations) {
+    GlState::deleteTextures(1, &allocation.texture);
+  }
+}
+
+RenderGraph::Resource RenderGraph::createTexture(const std::string& name,
+                                                 const RenderTargetDesc& desc)
+{
+  ResourceNode node;
+  node.name = name;
+  node.desc = desc;
+  resources.push_back(node);
+  compiled = false;
+  return static_cast<Resource>(resources.size() - 1);
+}
+
+RenderGraph::Resource RenderGraph::importTexture(const std::string& name,
+                                                 GLuint texture,
+                                                 const RenderTargetDesc& desc)
+{
+  Resource resource = createTexture(name, desc);
+  resources[resource].texture = texture;
+  resources[resource].imported = true;
+  return resource;
+}
+
+void RenderGraph::addPass(const std::string& name,
+                          const std::vector<Resource>& reads,
+                          const std::vector<Resource>& writes,
+                          PassFunction execute, bool depthBuffer)
+{
+  PassNode pass;
+  pass.name = name;
+  pass.reads = reads;
+  pass.writes = writes;
+  pass.execute = std::move(execute);
+  pass.depthBuffer = depthBuffer;
+  passes.push_back(std::move(pass));
+  compiled = false;
+}
+
+bool RenderGraph::link()
+{
+  for (uint32_t p = 0; p < passes.size(); p++) {
+    for (auto resource : passes[p].writes) {
+      MY_ASSERT(resource < resources.size(), "RenderGraph: unknown resource");
+      auto& node = resources[resource];
+      if (node.writer != none) {
+        std::cerr << "RenderGraph: " << node.name << " is written by "
+                  << passes[node.writer].name << " and " << passes[p].name
+                  << std::endl;
+        return false;
+      }
+      node.writer = p;
+    }
+  }
+  for (const auto& pass : passes) {
+    for (auto resource : pass.reads) {
+      MY_ASSERT(resource < resources.size(), "RenderGraph: unknown resource");
+      const auto& node = resources[resource];
+      if (node.writer == none && !node.imported) {
+        std::cerr << "RenderGraph: " << pass.name << " reads " << node.name
+                  << " which no pass writes" << std::endl;
+        return false;
+      }
+      if (std::find(pass.writes.begin(), pass.writes.end(), resource) !=
+          pass.writes.end()) {
+        std::cerr << "RenderGraph: " << pass.name << " reads and writes "
+                  << node.name << std::endl;
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void RenderGraph::cull()
+{
+  std::vector<uint32_t> pending;
+  for (uint32_t p = 0; p < passes.size(); p++) {
+    auto& pass = passes[p];
+    pass.alive = pass.writes.empty() ||
+                 std::any_of(pass.writes.begin(), pass.writes.end(),
+                             [this](Resource r) {
+                               return resources[r].imported;
+                             });
+    if (pass.alive) {
+      pending.push_back(p);
+    }
+  }
+  while (!pending.empty()) {
+    uint32_t p = pending.back();
+    pending.pop_back();
+    for (auto resource : passes[p].reads) {
+      uint32_t writer = resources[resource].writer;
+      if (writer != none && !passes[writer].alive) {
+        passes[writer].alive = true;
+        pending.push_back(writer);
+      }
+    }
+  }
+}
+
+bool RenderGraph::schedulePasses()
+{
+  // Kahn's algorithm, always taking the earliest declared ready pass
+  std::vector<uint32_t> dependencies(passes.size(), 0);
+  std::vector<std::vector<uint32_t>> dependents(passes.size());
+  for (uint32_t p = 0; p < passes.size(); p++) {
+    if (!passes[p].alive) {
+      continue;
+    }
+    for (auto resource : passes[p].reads) {
+      uint32_t writer = resources[resource].writer;
+      if (writer != none) {
+        dependencies[p]++;
+        dependents[writer].push_back(p);
+      }
+    }
+  }
+  std::vector<uint32_t> ready;
+  size_t alive = 0;
+  for (uint32_t p = 0; p < passes.size(); p++) {
+    if (passes[p].alive) {
+      alive++;
+      if (dependencies[p] == 0) {
+        ready.push_back(p);
+      }
+    }
+  }
+  schedule.clear();
+  while (!ready.empty()) {
+    auto it = std::min_element(ready.begin(), ready.end());
+    uint32_t p = *it;
+    ready.erase(it);
+    schedule.push_back(p);
+    for (auto dependent : dependents[p]) {
+      if (--dependencies[dependent] == 0) {
+        ready.push_back(dependent);
+      }
+    }
+  }
+  if (schedule.size() != alive) {
+    std::cerr << "RenderGraph: the passes form a cycle" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void RenderGraph::allocate()
+{
+  for (auto& node : resources) {
+    node.last = 0;
+  }
+  for (uint32_t i = 0; i < schedule.size(); i++) {
+    const auto& pass = passes[schedule[i]];
+    for (const auto* list : {&pass.reads, &pass.writes}) {
+      for (auto resource : *list) {
+        auto& node = resources[resource];
+        node.last = std::max(node.last, i);
+      }
+    }
+  }
+
+  for (auto& allocation : allocations) {
+    allocation.used = false;
+    allocation.busy = false;
+  }
+  std::vector<uint32_t> assigned(resources.size(), none);
+  for (uint32_t i = 0; i < schedule.size(); i++) {
+    const auto& pass = passes[schedule[i]];
+    for (auto resource : pass.writes) {
+      auto& node = resources[resource];
+      if (node.imported) {
+        continue;
+      }
+      auto it = std::find_if(allocations.begin(), allocations.end(),
+                             [&node](const Allocation& allocation) {
+                               return !allocation.busy &&
+                                      allocation.desc == node.desc;
+                             });
+      if (it == allocations.end()) {
+        allocations.push_back({node.desc, createTargetTexture(node.desc)});
+        it = allocations.end() - 1;
+      }
+      it->used = true;
+      it->busy = true;
+      node.texture = it->texture;
+      assigned[resource] = static_cast<uint32_t>(it - allocations.begin());
+      stats.transientTextures++;
+      stats.transientBytes += getByteSize(node.desc);
+    }
+    // Released after the pass, so its writes never alias its reads
+    for (const auto* list : {&pass.reads, &pass.writes}) {
+      for (auto resource : *list) {
+        if (assigned[resource] != none && resources[resource].last == i) {
+          allocations[assigned[resource]].busy = false;
+        }
+      }
+    }
+  }
+
+  auto unused = std::stable_partition(
+    allocations.begin(), allocations.end(),
+    [](const Allocation& allocation) { return allocation.used; });
+  for (auto it = unused; it != allocations.end(); ++it) {
+    GlState::deleteTextures(1, &it->texture);
+  }
+  allocations.erase(unused, allocations.end());
+  for (const auto& allocation : allocations) {
+    stats.allocatedTextures++;
+    stats.allocatedBytes += getByteSize(allocation.desc);
+  }
+}
+
+bool RenderGraph::createFramebuffers()
+{
+  for (auto p : schedule) {
+    auto& pass = passes[p];
+    pass.fbo.reset();
+    if (pass.writes.empty()) {
+      continue;
+    }
+    // The FBO is set up after the first write, the attachments have to
+    // match it
+    const auto& desc = resources[pass.writes[0]].desc;
+    for (auto resource : pass.writes) {
+      const auto& other = resources[resource].desc;
+      if (other.width != desc.width || other.height != desc.height ||
+          other.samples != desc.samples) {
+        std::cerr << "RenderGraph: writes of " << pass.name
+                  << " differ in size or sample count" << std::endl;
+        return false;
+      }
+    }
+    pass.fbo = std::make_unique<FBO>(desc.width, desc.height, desc.samples > 0,
+                                     desc.samples, desc.internalFormat);
+    std::vector<GLenum> drawBuffers;
+    for (auto resource : pass.writes) {
+      const auto& node = resources[resource];
+      GLenum attachment = GL_COLOR_ATTACHMENT0 + drawBuffers.size();
+      pass.fbo->attachExternalTexture(attachment, node.texture, node.desc.type,
+                                      node.desc.format);
+      drawBuffers.push_back(attachment);
+    }
+    if (pass.depthBuffer) {
+      pass.fbo->attachRenderBuffer();
+    }
+    pass.fbo->bind();
+    glDrawBuffers(static_cast<GLsizei>(drawBuffers.size()),
+                  drawBuffers.data());
+    if (!pass.fbo->checkReadiness()) {
+      std::cerr << "RenderGraph: FBO of " << pass.name << " is incomplete"
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RenderGraph::compile()
+{
+  stats = Stats();
+  stats.passes = passes.size();
+  compiled = false;
+  for (auto& node : resources) {
+    node.writer = none;
+    if (!node.imported) {
+      node.texture = 0;
+    }
+  }
+  if (!link()) {
+    return false;
+  }
+  cull();
+  if (!schedulePasses()) {
+    return false;
+  }
+  stats.culledPasses = passes.size() - schedule.size();
+  allocate();
+  if (!createFramebuffers()) {
+    return false;
+  }
+  checkOpenGLErrors();
+  compiled = true;
+  return true;
+}
+
+void RenderGraph::execute()
+{
+  MY_ASSERT(compiled, "RenderGraph: execute() before compile()");
+  for (auto p : schedule) {
+    const auto& pass = passes[p];
+    GpuProfiler::Scope scope(profiler, pass.name);
+    if (pass.fbo) {
+      pass.fbo->bind();
+      glViewport(0, 0, pass.fbo->width, pass.fbo->height);
+    } else {
+      GlState::bindFramebuffer(GL_FRAMEBUFFER, 0);
+      if (defaultViewport) {
+        glViewport(defaultViewport->x, defaultViewport->y,
+                   defaultViewport->z, defaultViewport->w);
+      }
+    }
+    pass.execute(*this);
+  }
+  checkOpenGLErrors();
+}
+
+void RenderGraph::setProfiler(GpuProfiler* _profiler) noexcept
+{
+  profiler = _profiler;
+}
+
+void RenderGraph::setDefaultViewport(const glm::ivec4& viewport) noexcept
+{
+  defaultViewport = viewport;
+}
+
+void RenderGraph::clear()
+{
+  passes.clear();
+  resources.clear();
+  schedule.clear();
+  compiled = false;
+}
+
+GLuint RenderGraph::getTexture(Resource resource) const
+{
+  MY_ASSERT(resource < resources.size(), "RenderGraph: unknown resource");
+  return resources[resource].texture;
+}
+
+std::vector<std::string> RenderGraph::getSchedule() const
+{
+  std::vector<std::string> names;
+  for (auto p : schedule) {
+    names.push_back(passes[p].name);
+  }
+  return names;
+}
+
+const RenderGraph::Stats& RenderGraph::getStats() const noexcept
+{
+  return stats;
+}
+
+}  // namespace agt3d
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "agt_fbo.h"
+#include "agt_render_target_pool.h"
+
+namespace agt3d
+{
+
+class GpuProfiler;
+
+/**
+ * @brief Declarative chain of FBO passes.
+ *
+ * Passes declare the textures they read and write. compile() orders them by
+ * these dependencies (declaration order among independent passes), culls
+ * passes whose output is never used, and assigns the transient textures to
+ * GL textures owned by the graph: transients of the same description whose
+ * lifetimes don't overlap share one texture. Each pass that writes gets an
+ * FBO with its writes as color attachments 0..n-1, bound together with the
+ * viewport before the pass runs.
+ *
+ * A pass is kept if it writes an imported texture, writes nothing (it draws
+ * to the default framebuffer) or writes a texture a kept pass reads. Each
+ * texture has one writer and may be read by any later pass. Passes drawing
+ * to the default framebuffer get the viewport given to setDefaultViewport(),
+ * without one they keep whatever viewport is set.
+ *
+ * The graph is meant to be built and compiled once and executed every frame.
+ * After a resize call clear(), declare it again and compile, textures whose
+ * description didn't change are kept.
+ */
+class RenderGraph
+{
+ public:
+  using Resource = uint32_t;
+  /**
+   * @brief Called with the pass FBO bound. Look up the textures to sample
+   * with getTexture().
+   */
+  using PassFunction = std::function<void(const agt3d::RenderGraph& graph)>;
+
+  struct Stats {
+    size_t passes = 0;
+    size_t culledPasses = 0;
+    /// Transient textures used by the kept passes.
+    size_t transientTextures = 0;
+    /// GL textures backing them.
+    size_t allocatedTextures = 0;
+    /// Memory the transients would need without aliasing.
+    size_t transientBytes = 0;
+    size_t allocatedBytes = 0;
+  };
+
+  RenderGraph() = default;
+  ~RenderGraph();
+  RenderGraph& operator=(const RenderGraph& other) = delete;
+  RenderGraph(RenderGraph&) = delete;
+
+  /**
+   * @brief Declare a texture allocated by the graph for the current frame.
+   */
+  Resource createTexture(const std::string& name,
+                         const agt3d::RenderTargetDesc& desc);
+  /**
+   * @brief Declare a texture owned by the caller, e.g. an FBO attachment
+   * displayed later. Passes writing it are never culled.
+   */
+  Resource importTexture(const std::string& name, GLuint texture,
+                         const agt3d::RenderTargetDesc& desc);
+  /**
+   * @param depthBuffer attach a depth renderbuffer to the pass FBO.
+   */
+  void addPass(const std::string& name, const std::vector<Resource>& reads,
+               const std::vector<Resource>& writes, PassFunction execute,
+               bool depthBuffer = false);
+  /**
+   * @brief Order, cull and allocate.
+   * @return false if a texture has two writers, is read before it is
+   * written, the passes form a cycle or the writes of a pass differ in size
+   * or sample count.
+   */
+  bool compile();
+  /**
+   * @brief Run the compiled passes in order.
+   */
+  void execute();
+  /**
+   * @brief Time every pass in a scope named after it, nullptr to stop.
+   */
+  void setProfiler(agt3d::GpuProfiler* _profiler) noexcept;
+  /**
+   * @brief Viewport (x, y, width, height) of the passes drawing to the
+   * default framebuffer, e.g. the window size. Kept by clear(), set it again
+   * after a resize.
+   */
+  void setDefaultViewport(const glm::ivec4& viewport) noexcept;
+  /**
+   * @brief Forget passes and resources. The textures are reused by the next
+   * compile() where the descriptions match.
+   */
+  void clear();
+
+  GLuint getTexture(Resource resource) const;
+  /**
+   * @brief Names of the kept passes in execution order.
+   */
+  std::vector<std::string> getSchedule() const;
+  const Stats& getStats() const noexcept;
+
+ private:
+  static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+  struct ResourceNode {
+    std::string name;
+    agt3d::RenderTargetDesc desc;
+    GLuint texture = 0;
+    bool imported = false;
+    uint32_t writer = none;
+    /// Position in the schedule of the last pass using it.
+    uint32_t last = 0;
+  };
+  struct PassNode {
+    std::string name;
+    std::vector<Resource> reads;
+    std::vector<Resource> writes;
+    PassFunction execute;
+    bool depthBuffer = false;
+    bool alive = false;
+    std::unique_ptr<agt3d::FBO> fbo;
+  };
+  struct Allocation {
+    agt3d::RenderTargetDesc desc;
+    GLuint texture = 0;
+    bool used = false;
+    bool busy = false;
+  };
+
+  bool link();
+  void cull();
+  bool schedulePasses();
+  void allocate();
+  bool createFramebuffers();
+
+ private:
+  std::vector<ResourceNode> resources;
+  std::vector<PassNode> passes;
+  std::vector<uint32_t> schedule;
+  std::vector<Allocation> allocations;
+  bool compiled = false;
+  agt3d::GpuProfiler* profiler = nullptr;
+  std::optional<glm::ivec4> defaultViewport;
+  Stats stats;
+};
+
+}  // namespace agt3d
@@ -0,0 +1,984 @@
+#include "agt_render_queue.h"
+
+#include "agt_camera.h"
+#include "agt_gl_state.h"
+#include "agt_gpu_profiler.h"
+#include "agt_material.h"
+#include "agt_mesh.h"
+#include "agt_scene.h"
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+static constexpr uint32_t blendBits = 4;
+static constexpr uint32_t programBits = 12;
+static constexpr uint32_t materialBits = 14;
+static constexpr uint32_t vaoBits = 14;
+static constexpr uint32_t depthBits = 18;
+
+/**
+ * @brief Map a depth into [0, 2^bits - 1] over the depth range of the frame.
+ */
+static uint64_t quantizeDepth(float depth, float minDepth, float maxDepth,
+                              uint32_t bits) noexcept
+{
+  float range = maxDepth - minDepth;
+  float n = range > 0.0f ? (depth - minDepth) / range : 0.0f;
+  n = std::clamp(n, 0.0f, 1.0f);
+  return static_cast<uint64_t>(n * static_cast<float>((1u << bits) - 1));
+}
+
+static constexpr UniformId viewId("view");
+static constexpr UniformId projectionId("projection");
+static constexpr UniformId modelId("model");
+static constexpr UniformId colorId("color");
+static constexpr UniformId borderRadiusId("borderRadius");
+static constexpr UniformId borderColorId("borderColor");
+
+static const char* passNames[] = {"solid", "blended", "overlay"};
+
+static_assert(instanceModelLocation >= static_cast<GLuint>(DataStream::LAST) &&
+                instanceColorLocation >= instanceModelLocation + 4,
+              "Instance attributes overlap the mesh streams");
+
+static const char* depthSource = R"(
+#ifdef VERTEX
+layout(location = 0) in vec3 position;
+layout(location = 6) in mat4 instanceModel;
+uniform mat4 view;
+uniform mat4 projection;
+invariant gl_Position;
+void main()
+{
+  gl_Position = projection * view * instanceModel * vec4(position, 1.0);
+}
+#endif
+#ifdef FRAGMENT
+void main() {}
+#endif
+)";
+
+RenderPass getRenderPass(const RenderTechnique& technique) noexcept
+{
+  if (technique.disableDepthTest) {
+    return RenderPass::OVERLAY;
+  }
+  if (technique.enableAlphaBlending) {
+    return RenderPass::BLENDED;
+  }
+  return RenderPass::SOLID;
+}
+
+RenderQueue::RenderQueue() {}
+
+RenderQueue::~RenderQueue()
+{
+  if (instanceBuffer) {
+    GlState::deleteBuffers(1, &instanceBuffer);
+  }
+  if (indirectBuffer) {
+    GlState::deleteBuffers(1, &indirectBuffer);
+    GlState::deleteBuffers(1, &drawBuffer);
+  }
+  if (depthInstanceBuffer) {
+    GlState::deleteBuffers(1, &depthInstanceBuffer);
+  }
+  if (depthShader) {
+    GlState::deleteProgram(depthShader->program);
+  }
+  if (samplesQuery) {
+    glDeleteQueries(1, &samplesQuery);
+  }
+}
+
+void RenderQueue::begin(const glm::mat4& _view, const glm::mat4& _projection)
+{
+  view = _view;
+  projection = _projection;
+  frustum = Frustum(projection * view);
+  frame.view = view;
+  frame.projection = projection;
+  frame.viewProjection = projection * view;
+  frame.cameraPosition = glm::inverse(view)[3];
+  items.clear();
+  keys.clear();
+  order.clear();
+  programIds.clear();
+  materialIds.clear();
+  vaoIds.clear();
+  blendModes.clear();
+  stats = Stats();
+}
+
+void RenderQueue::begin(const BaseCamera& camera)
+{
+  begin(camera.getView(), camera.getProjection());
+  frame.viewport = glm::vec4(camera.getViewport());
+  auto [nearZ, farZ] = camera.getNearFar();
+  frame.nearFar = {nearZ, farZ, 0, 0};
+}
+
+bool RenderQueue::add(ObjectInstance& oi)
+{
+  if (!oi.isEnabled() || !oi.isRenderable()) {
+    return false;
+  }
+  auto obj = oi.getObject();
+  Material* material = obj->getMaterial();
+  if (!obj->getMesh() || !material || !material->getShader()) {
+    return false;
+  }
+  if (!frustum.intersects(oi.getWorldAABB())) {
+    stats.culled++;
+    return false;
+  }
+
+  Item item;
+  item.oi = &oi;
+  item.mesh = obj->getMesh();
+  item.material = material;
+  item.shader = material->getShader();
+  item.technique = &oi.getRenderTechnique();
+  item.model = oi.getTm();
+  item.center = oi.getBoundingSphere().center;
+  item.pass = getRenderPass(*item.technique);
+  // Blended depths are computed in one go by sortBlended()
+  if (item.pass != RenderPass::BLENDED) {
+    item.viewDepth = -(view * glm::vec4(item.center, 1.0f)).z;
+  }
+  items.push_back(item);
+  return true;
+}
+
+void RenderQueue::gather(Scene& scene)
+{
+  scene.updateWorldBounds();
+  for (auto& oi : scene.ois) {
+    add(*oi);
+  }
+}
+
+uint32_t RenderQueue::smallId(std::unordered_map<uintptr_t, uint32_t>& ids,
+                              uintptr_t value, uint32_t bits)
+{
+  auto it = ids.find(value);
+  if (it != ids.end()) {
+    return it->second;
+  }
+  // Out of ids, the rest shares the last one. The order is still correct,
+  // only less state gets grouped.
+  uint32_t last = (1u << bits) - 1;
+  if (ids.size() >= last) {
+    return last;
+  }
+  auto id = static_cast<uint32_t>(ids.size());
+  ids.emplace(value, id);
+  return id;
+}
+
+uint32_t RenderQueue::blendId(const RenderTechnique& technique)
+{
+  if (!technique.enableAlphaBlending) {
+    return 0;
+  }
+  auto mode = std::make_pair(technique.alphaSrc, technique.alphaDst);
+  auto it = std::find(blendModes.begin(), blendModes.end(), mode);
+  if (it != blendModes.end()) {
+    return static_cast<uint32_t>(it - blendModes.begin()) + 1;
+  }
+  uint32_t last = (1u << blendBits) - 1;
+  if (blendModes.size() + 1 >= last) {
+    return last;
+  }
+  blendModes.push_back(mode);
+  return static_cast<uint32_t>(blendModes.size());
+}
+
+uint64_t RenderQueue::makeKey(const Item& item, float minDepth, float maxDepth)
+{
+  uint64_t pass = static_cast<uint64_t>(item.pass);
+  uint64_t program = smallId(programIds, item.shader->program, programBits);
+  uint64_t material =
+    smallId(materialIds, reinterpret_cast<uintptr_t>(item.material),
+            materialBits);
+
+  if (item.pass == RenderPass::BLENDED) {
+    // Ordered by sortBlended(), the key only groups the pass
+    return pass << 62;
+  }
+
+  uint64_t blend = blendId(*item.technique);
+  uint64_t vao = smallId(vaoIds, item.mesh->getVertexArray(), vaoBits);
+  uint64_t depth = quantizeDepth(item.viewDepth, minDepth, maxDepth, depthBits);
+  return (pass << 62) | (blend << 58) | (program << 46) | (material << 32) |
+         (vao << 18) | depth;
+}
+
+void RenderQueue::sort()
+{
+  float minDepth = std::numeric_limits<float>::max();
+  float maxDepth = -std::numeric_limits<float>::max();
+  for (const auto& item : items) {
+    if (item.pass != RenderPass::BLENDED) {
+      minDepth = std::min(minDepth, item.viewDepth);
+      maxDepth = std::max(maxDepth, item.viewDepth);
+    }
+  }
+
+  keys.resize(items.size());
+  order.resize(items.size());
+  for (size_t i = 0; i < items.size(); i++) {
+    keys[i] = makeKey(items[i], minDepth, maxDepth);
+    order[i] = static_cast<uint32_t>(i);
+  }
+  radixSort();
+  sortBlended();
+}
+
+void RenderQueue::sortBlended()
+{
+  // The radix sort is stable, blended items are still in the order they were
+  // added, which keeps their ids stable for the sorter's frame coherence
+  constexpr uint64_t blended = static_cast<uint64_t>(RenderPass::BLENDED);
+  auto begin = std::lower_bound(keys.begin(), keys.end(), blended << 62);
+  auto end = std::lower_bound(begin, keys.end(), (blended + 1) << 62);
+  size_t first = begin - keys.begin();
+  size_t count = end - begin;
+  stats.blendedItems = count;
+  if (count == 0) {
+    return;
+  }
+
+  blendedIds.resize(count);
+  blendedCenters.resize(count);
+  for (size_t i = 0; i < count; i++) {
+    const auto& item = items[order[first + i]];
+    blendedIds[i] = reinterpret_cast<uintptr_t>(item.oi);
+    blendedCenters[i] = item.center;
+  }
+  const auto& sorted = depthSorter.sort(blendedIds, blendedCenters, view);
+  const auto& depths = depthSorter.getDepths();
+  orderTemp.assign(order.begin() + first, order.begin() + first + count);
+  for (size_t i = 0; i < count; i++) {
+    items[orderTemp[i]].viewDepth = depths[i];
+    order[first + i] = orderTemp[sorted[i]];
+  }
+  stats.blendedSortMs = depthSorter.getStats().ms;
+  stats.blendedSortCoherent = depthSorter.getStats().coherent &&
+                              !depthSorter.getStats().radixSorted;
+}
+
+void RenderQueue::radixSort()
+{
+  const size_t count = keys.size();
+  keysTemp.resize(count);
+  orderTemp.resize(count);
+
+  // LSD radix sort, 8 bits per pass. Bytes equal across all keys (unused
+  // ids, a single pass) are skipped.
+  for (int shift = 0; shift < 64; shift += 8) {
+    size_t histogram[256] = {};
+    for (auto key : keys) {
+      histogram[(key >> shift) & 0xff]++;
+    }
+    if (count == 0 || histogram[(keys[0] >> shift) & 0xff] == count) {
+      continue;
+    }
+    size_t offset = 0;
+    for (auto& bucket : histogram) {
+      auto n = bucket;
+      bucket = offset;
+      offset += n;
+    }
+    for (size_t i = 0; i < count; i++) {
+      auto dst = histogram[(keys[i] >> shift) & 0xff]++;
+      keysTemp[dst] = keys[i];
+      orderTemp[dst] = order[i];
+    }
+    keys.swap(keysTemp);
+    order.swap(orderTemp);
+  }
+}
+
+bool RenderQueue::sameTechnique(const RenderTechnique& a,
+                                const RenderTechnique& b,
+                                bool colorPerInstance) noexcept
+{
+  return a.primitiveType == b.primitiveType &&
+         a.disableDepthTest == b.disableDepthTest &&
+         a.enableAlphaBlending == b.enableAlphaBlending &&
+         a.alphaSrc == b.alphaSrc && a.alphaDst == b.alphaDst &&
+         a.depthPrePass == b.depthPrePass && a.lineWidth == b.lineWidth &&
+         a.borderRadius == b.borderRadius &&
+         a.borderColor == b.borderColor &&
+         (colorPerInstance || a.color == b.color);
+}
+
+bool RenderQueue::canBatch(const Item& a, const Item& b) const
+{
+  if (a.mesh != b.mesh || a.material != b.material) {
+    return false;
+  }
+  // Color travels per instance only when the shader reads instanceColor or
+  // the instance block
+  return sameTechnique(*a.technique, *b.technique, colorPerInstance(*a.shader));
+}
+
+bool RenderQueue::canMultiDraw(const Item& a, const Item& b) const
+{
+  return b.mesh->getIndexCount() > 0 && a.material == b.material &&
+         a.mesh->getVertexArray() == b.mesh->getVertexArray() &&
+         sameTechnique(*a.technique, *b.technique, colorPerInstance(*a.shader));
+}
+
+void RenderQueue::buildBatches()
+{
+  batches.clear();
+  instanceData.clear();
+  objectBlocks.clear();
+  for (uint32_t i = 0; i < order.size();) {
+    const auto& first = items[order[i]];
+    Batch batch;
+    batch.first = i;
+    batch.count = 1;
+    batch.instanced = drawsInstanced(*first.shader);
+    // Programs reading the Instances block only work with an indirect draw
+    // of indexed geometry
+    if (hasMultiDrawIndirect() && declaresInstanceBlock(*first.shader) &&
+        (!multiDrawIndirect || first.mesh->getIndexCount() == 0)) {
+      batch.instanced = false;
+      batch.rejected = true;
+      while (i + batch.count < order.size() &&
+             canBatch(first, items[order[i + batch.count]])) {
+        batch.count++;
+      }
+      stats.rejected += batch.count;
+      if (std::find(rejectedPrograms.begin(), rejectedPrograms.end(),
+                    first.shader->program) == rejectedPrograms.end()) {
+        std::cerr << "RenderQueue: program " << first.shader->program
+                  << " reads the Instances block and needs indexed meshes "
+                     "and multi-draw indirect, skipping its items"
+                  << std::endl;
+        rejectedPrograms.push_back(first.shader->program);
+      }
+    } else if (batch.instanced) {
+      while (i + batch.count < order.size() &&
+             canBatch(first, items[order[i + batch.count]])) {
+        batch.count++;
+      }
+      batch.instanceOffset = static_cast<uint32_t>(instanceData.size());
+      for (uint32_t j = i; j < i + batch.count; j++) {
+        const auto& item = items[order[j]];
+        instanceData.push_back({item.model, item.technique->color});
+      }
+    } else if (hasUniformBlock(*first.shader, "Object")) {
+      batch.objectBlock = true;
+      batch.objectOffset = objectBlocks.size();
+      objectBlocks.push_back({first.model, first.technique->color});
+    }
+    batches.push_back(batch);
+    i += batch.count;
+  }
+
+  if (!objectBlocks.empty()) {
+    // One upload for the frame, the index becomes the ring offset
+    size_t base = objectRing.write(objectBlocks.data(), sizeof(ObjectBlock),
+                                   objectBlocks.size());
+    size_t stride = objectRing.getStride(sizeof(ObjectBlock));
+    for (auto& batch : batches) {
+      if (batch.objectBlock) {
+        batch.objectOffset = base + batch.objectOffset * stride;
+      }
+    }
+    stats.blockUploads++;
+  }
+
+  if (instanceData.empty()) {
+    return;
+  }
+  if (!instanceBuffer) {
+    glGenBuffers(1, &instanceBuffer);
+  }
+  // Orphan, the previous frame may still be read by the GPU
+  size_t bytes = instanceData.size() * sizeof(InstanceData);
+  GlState::bindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+  if (bytes > instanceBufferSize) {
+    instanceBufferSize = bytes;
+  }
+  glBufferData(GL_ARRAY_BUFFER, instanceBufferSize, nullptr, GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, instanceData.data());
+}
+
+bool RenderQueue::readsInstanceBlock(const Shader& shader) const
+{
+  return multiDrawIndirect && hasMultiDrawIndirect() &&
+         declaresInstanceBlock(shader);
+}
+
+bool RenderQueue::declaresInstanceBlock(const Shader& shader) const
+{
+  auto it = instanceBlockPrograms.find(shader.program);
+  if (it != instanceBlockPrograms.end()) {
+    return it->second;
+  }
+  bool reads = glGetProgramResourceIndex(shader.program,
+                                         GL_SHADER_STORAGE_BLOCK,
+                                         "Instances") != GL_INVALID_INDEX;
+  instanceBlockPrograms.emplace(shader.program, reads);
+  return reads;
+}
+
+bool RenderQueue::colorPerInstance(const Shader& shader) const
+{
+  return hasAttribute(shader, "instanceColor") || readsInstanceBlock(shader);
+}
+
+bool RenderQueue::drawsInstanced(const Shader& shader) const
+{
+  auto it = instancedPrograms.find(shader.program);
+  if (it != instancedPrograms.end()) {
+    return it->second;
+  }
+  auto at = [&shader](const char* name, GLuint location) {
+    auto attribute = shader.attributes.find(name);
+    return attribute == shader.attributes.end() ||
+           attribute->second == location;
+  };
+  bool instanced =
+    hasAttribute(shader, "instanceModel") || readsInstanceBlock(shader);
+  if (instanced && !(at("instanceModel", instanceModelLocation) &&
+                     at("instanceColor", instanceColorLocation))) {
+    std::cerr << "RenderQueue: program " << shader.program
+              << " has instance attributes at other locations than "
+              << instanceModelLocation << " and " << instanceColorLocation
+              << ", drawing it without instancing" << std::endl;
+    instanced = false;
+  }
+  instancedPrograms.emplace(shader.program, instanced);
+  return instanced;
+}
+
+void RenderQueue::buildMultiDraws()
+{
+  multiDraws.clear();
+  commands.clear();
+  drawInstanceOffsets.clear();
+  const bool indirect = multiDrawIndirect && hasMultiDrawIndirect();
+  if (indirect && ssboAlignment == 0) {
+    GLint alignment = 0;
+    glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    ssboAlignment = std::max<size_t>(sizeof(uint32_t), alignment);
+  }
+
+  for (uint32_t b = 0; b < batches.size();) {
+    const auto& first = items[order[batches[b].first]];
+    MultiDraw draw;
+    draw.firstBatch = b;
+    if (indirect && batches[b].instanced && canMultiDraw(first, first)) {
+      while (b + draw.batchCount < batches.size()) {
+        const auto& next = batches[b + draw.batchCount];
+        if (!next.instanced || !canMultiDraw(first, items[order[next.first]])) {
+          break;
+        }
+        draw.batchCount++;
+      }
+    }
+
+    // A single command gains nothing over a direct call, unless the shader
+    // fetches its instance through gl_DrawID
+    if (draw.batchCount > 1 ||
+        (draw.batchCount == 1 && indirect && batches[b].instanced &&
+         readsInstanceBlock(*first.shader))) {
+      draw.indirect = true;
+      draw.commandOffset = static_cast<uint32_t>(commands.size());
+      // gl_DrawID restarts at 0 for every call, so every call gets its own
+      // aligned range of the draw buffer
+      size_t perAlignment = ssboAlignment / sizeof(uint32_t);
+      drawInstanceOffsets.resize(
+        (drawInstanceOffsets.size() + perAlignment - 1) / perAlignment *
+        perAlignment);
+      draw.drawIdOffset = drawInstanceOffsets.size() * sizeof(uint32_t);
+      for (uint32_t i = b; i < b + draw.batchCount; i++) {
+        const auto& batch = batches[i];
+        const auto& mesh = *items[order[batch.first]].mesh;
+        DrawElementsIndirectCommand command;
+        command.count = static_cast<GLuint>(mesh.getIndexCount());
+        command.instanceCount = batch.count;
+        command.firstIndex = mesh.firstIndex;
+        command.baseVertex = static_cast<GLint>(mesh.baseVertex);
+        command.baseInstance = batch.instanceOffset;
+        commands.push_back(command);
+        drawInstanceOffsets.push_back(batch.instanceOffset);
+      }
+    }
+    multiDraws.push_back(draw);
+    b += draw.batchCount;
+  }
+
+  if (commands.empty()) {
+    return;
+  }
+  if (!indirectBuffer) {
+    glGenBuffers(1, &indirectBuffer);
+    glGenBuffers(1, &drawBuffer);
+  }
+  GlState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+  glBufferData(GL_DRAW_INDIRECT_BUFFER,
+               commands.size() * sizeof(DrawElementsIndirectCommand),
+               commands.data(), GL_STREAM_DRAW);
+  GlState::bindBuffer(GL_SHADER_STORAGE_BUFFER, drawBuffer);
+  glBufferData(GL_SHADER_STORAGE_BUFFER,
+               drawInstanceOffsets.size() * sizeof(uint32_t),
+               drawInstanceOffsets.data(), GL_STREAM_DRAW);
+}
+
+void RenderQueue::applyState(const Item& item, SubmitState& state)
+{
+  const auto& technique = *item.technique;
+  const auto& shader = *item.shader;
+
+  int depthTest = technique.disableDepthTest ? 0 : 1;
+  if (depthTest != state.depthTest) {
+    GlState::setEnabled(GL_DEPTH_TEST, depthTest);
+    state.depthTest = depthTest;
+    stats.depthChanges++;
+  }
+
+  // Only touched once a pre-passed item showed up, others keep the caller's
+  // depth function
+  int depthEqual = usesDepthPrePass(item) ? 1 : 0;
+  if (depthEqual != state.depthEqual && (depthEqual || state.depthEqual > 0)) {
+    GlState::depthFunc(depthEqual ? GL_EQUAL : GL_LESS);
+    GlState::depthMask(!depthEqual);
+    state.depthEqual = depthEqual;
+    stats.depthChanges++;
+  }
+
+  auto blend = technique.enableAlphaBlending
+                 ? std::make_pair(technique.alphaSrc, technique.alphaDst)
+                 : std::make_pair(GLuint(GL_ONE), GLuint(GL_ZERO));
+  if (blend != state.blend) {
+    if (!technique.enableAlphaBlending) {
+      GlState::setEnabled(GL_BLEND, false);
+    } else {
+      GlState::setEnabled(GL_BLEND, true);
+      GlState::blendFunc(blend.first, blend.second);
+    }
+    state.blend = blend;
+    stats.blendChanges++;
+  }
+
+  if (shader.program != state.program) {
+    useShader(shader);
+    state.program = shader.program;
+    // Uniform values live in the program, the material has to be applied
+    // again
+    state.material = nullptr;
+    stats.programChanges++;
+    if (std::find(state.programsWithFrameUniforms.begin(),
+                  state.programsWithFrameUniforms.end(),
+                  shader.program) == state.programsWithFrameUniforms.end()) {
+      setUniform(shader, viewId, view);
+      setUniform(shader, projectionId, projection);
+      bindUniformBlock(shader, "Frame", frameBlockBinding);
+      bindUniformBlock(shader, "Object", objectBlockBinding);
+      state.programsWithFrameUniforms.push_back(shader.program);
+    }
+  }
+
+  if (item.material != state.material) {
+    if (hasUniformBlock(shader, "Material")) {
+      size_t uploads = materialBlocks.getUploads();
+      materialBlocks.bind(*item.material, shader);
+      stats.blockUploads += materialBlocks.getUploads() - uploads;
+    }
+    // Params inside the block have no uniform location and are skipped
+    for (auto& [name, param] : item.material->getShaderParams()) {
+      setUniform(shader, name, param.second);
+    }
+    const auto& textures = item.material->textures;
+    if (state.textures.size() < textures.size()) {
+      state.textures.resize(textures.size(), SubmitState::unknown);
+    }
+    for (size_t unit = 0; unit < textures.size(); unit++) {
+      GLuint tex = textures[unit]->getTexture();
+      if (state.textures[unit] != tex) {
+        GlState::bindTexture(GL_TEXTURE_2D, tex, static_cast<GLuint>(unit));
+        state.textures[unit] = tex;
+        stats.textureBinds++;
+      }
+      setUniform(shader, textures[unit]->getType(), static_cast<int>(unit));
+    }
+    state.material = item.material;
+    stats.materialChanges++;
+  }
+
+  setUniform(shader, colorId, technique.color);
+  setUniform(shader, borderRadiusId, technique.borderRadius);
+  setUniform(shader, borderColorId, technique.borderColor);
+
+  GLuint vao = item.mesh->getVertexArray();
+  if (vao != state.vao) {
+    GlState::bindVertexArray(vao);
+    state.vao = vao;
+    stats.vaoChanges++;
+  }
+
+  GLenum mode = toGlPrimitive(technique.primitiveType);
+  if (mode == GL_POINTS && !state.pointSize) {
+    GlState::setEnabled(GL_PROGRAM_POINT_SIZE, true);
+    state.pointSize = true;
+  }
+  if ((mode == GL_LINES || mode == GL_LINE_STRIP) &&
+      technique.lineWidth != state.lineWidth) {
+    glLineWidth(technique.lineWidth);
+    state.lineWidth = technique.lineWidth;
+  }
+}
+
+void RenderQueue::bindInstanceAttributes(const Shader& shader,
+                                         uint32_t instanceOffset)
+{
+  GlState::bindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+  const size_t base = instanceOffset * sizeof(InstanceData);
+  if (!hasAttribute(shader, "instanceModel")) {
+    return;
+  }
+  GLuint vao = GlState::getVertexArray();
+  if (std::find(instancedVaos.begin(), instancedVaos.end(), vao) ==
+      instancedVaos.end()) {
+    instancedVaos.push_back(vao);
+  }
+  for (GLuint column = 0; column < 4; column++) {
+    glEnableVertexAttribArray(instanceModelLocation + column);
+    glVertexAttribPointer(
+      instanceModelLocation + column, 4, GL_FLOAT, GL_FALSE,
+      sizeof(InstanceData),
+      reinterpret_cast<void*>(base + offsetof(InstanceData, model) +
+                              column * sizeof(glm::vec4)));
+    glVertexAttribDivisor(instanceModelLocation + column, 1);
+  }
+  if (hasAttribute(shader, "instanceColor")) {
+    glEnableVertexAttribArray(instanceColorLocation);
+    glVertexAttribPointer(
+      instanceColorLocation, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+      reinterpret_cast<void*>(base + offsetof(InstanceData, color)));
+    glVertexAttribDivisor(instanceColorLocation, 1);
+  }
+}
+
+void RenderQueue::resetInstanceAttributes()
+{
+  for (GLuint vao : instancedVaos) {
+    GlState::bindVertexArray(vao);
+    for (GLuint location = instanceModelLocation;
+         location <= instanceColorLocation; location++) {
+      glDisableVertexAttribArray(location);
+      glVertexAttribDivisor(location, 0);
+    }
+  }
+  instancedVaos.clear();
+}
+
+bool RenderQueue::usesDepthPrePass(const Item& item) const noexcept
+{
+  return item.technique->depthPrePass && item.pass == RenderPass::SOLID &&
+         item.technique->primitiveType ==
+           RenderTechnique::DrawPrimitiveType::TRIANGLES &&
+         !depthShaderFailed;
+}
+
+void RenderQueue::submitDepthPrePass()
+{
+  depthBatches.clear();
+  depthModels.clear();
+  depthOrder.clear();
+  for (auto index : order) {
+    if (usesDepthPrePass(items[index])) {
+      depthOrder.push_back(index);
+    }
+  }
+  // The depth shader is the same for all, only the mesh splits draws. Stable,
+  // so every mesh still goes front to back.
+  std::stable_sort(depthOrder.begin(), depthOrder.end(),
+                   [this](uint32_t a, uint32_t b) {
+                     return items[a].mesh < items[b].mesh;
+                   });
+  for (auto index : depthOrder) {
+    const auto& item = items[index];
+    if (!depthBatches.empty() && depthBatches.back().mesh == item.mesh) {
+      depthBatches.back().count++;
+    } else {
+      DepthBatch batch;
+      batch.mesh = item.mesh;
+      batch.instanceOffset = static_cast<uint32_t>(depthModels.size());
+      depthBatches.push_back(batch);
+    }
+    depthModels.push_back(item.model);
+  }
+  if (depthBatches.empty()) {
+    return;
+  }
+  if (!depthShader) {
+    depthShader = compileShaderSource(depthSource);
+    if (!depthShader) {
+      std::cerr << "RenderQueue: depth pre-pass shader failed, drawing "
+                   "without pre-pass"
+                << std::endl;
+      depthShaderFailed = true;
+      depthBatches.clear();
+      return;
+    }
+  }
+
+  if (!depthInstanceBuffer) {
+    glGenBuffers(1, &depthInstanceBuffer);
+  }
+  size_t bytes = depthModels.size() * sizeof(glm::mat4);
+  GlState::bindBuffer(GL_ARRAY_BUFFER, depthInstanceBuffer);
+  if (bytes > depthInstanceBufferSize) {
+    depthInstanceBufferSize = bytes;
+  }
+  glBufferData(GL_ARRAY_BUFFER, depthInstanceBufferSize, nullptr,
+               GL_STREAM_DRAW);
+  glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, depthModels.data());
+
+  GpuProfiler::Scope scope(profiler, "depth pre-pass");
+  glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+  GlState::setEnabled(GL_DEPTH_TEST, true);
+  GlState::setEnabled(GL_BLEND, false);
+  GlState::depthFunc(GL_LESS);
+  GlState::depthMask(true);
+  useShader(*depthShader);
+  setUniform(*depthShader, viewId, view);
+  setUniform(*depthShader, projectionId, projection);
+  for (const auto& batch : depthBatches) {
+    GLuint vao = batch.mesh->getDepthVertexArray();
+    GlState::bindVertexArray(vao);
+    if (std::find(instancedVaos.begin(), instancedVaos.end(), vao) ==
+        instancedVaos.end()) {
+      instancedVaos.push_back(vao);
+    }
+    GlState::bindBuffer(GL_ARRAY_BUFFER, depthInstanceBuffer);
+    const size_t base = batch.instanceOffset * sizeof(glm::mat4);
+    for (GLuint column = 0; column < 4; column++) {
+      glEnableVertexAttribArray(instanceModelLocation + column);
+      glVertexAttribPointer(
+        instanceModelLocation + column, 4, GL_FLOAT, GL_FALSE,
+        sizeof(glm::mat4),
+        reinterpret_cast<void*>(base + column * sizeof(glm::vec4)));
+      glVertexAttribDivisor(instanceModelLocation + column, 1);
+    }
+    batch.mesh->draw(GL_TRIANGLES, static_cast<GLsizei>(batch.count));
+    stats.depthPrePassDraws++;
+  }
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+  stats.depthPrePassItems = depthModels.size();
+}
+
+void RenderQueue::submit()
+{
+  SubmitState state;
+  size_t naiveChanges = 0;
+  const UniformStats uniformsBefore = getUniformStats();
+  const GlStateStats glBefore = GlState::getStats();
+
+  if (!order.empty()) {
+    frameBuffer.update(&frame, sizeof(FrameBlock));
+    frameBuffer.bind(frameBlockBinding);
+    stats.blockUploads++;
+  }
+  submitDepthPrePass();
+  buildBatches();
+  buildMultiDraws();
+
+  if (measureFragments) {
+    if (!samplesQuery) {
+      glGenQueries(1, &samplesQuery);
+    }
+    glBeginQuery(GL_SAMPLES_PASSED, samplesQuery);
+  }
+
+  // Profiler scopes per pass and, nested, per run of the same material
+  int profiledPass = -1;
+  const Material* profiledMaterial = nullptr;
+  for (const auto& draw : multiDraws) {
+    const auto& item = items[order[batches[draw.firstBatch].first]];
+    const auto& shader = *item.shader;
+    GLenum mode = toGlPrimitive(item.technique->primitiveType);
+    if (profiler && static_cast<int>(item.pass) != profiledPass) {
+      if (profiledMaterial) {
+        profiler->pop();
+      }
+      if (profiledPass >= 0) {
+        profiler->pop();
+      }
+      profiledPass = static_cast<int>(item.pass);
+      profiledMaterial = nullptr;
+      profiler->push(passNames[profiledPass]);
+    }
+    if (profiler && item.material != profiledMaterial) {
+      if (profiledMaterial) {
+        profiler->pop();
+      }
+      // Keyed by material, not by sort id, which begin() renumbers every
+      // frame
+      auto it = materialScopes.find(item.material);
+      if (it == materialScopes.end()) {
+        it = materialScopes
+               .emplace(item.material,
+                        "material " + std::to_string(materialScopes.size()))
+               .first;
+      }
+      profiler->push(it->second);
+      profiledMaterial = item.material;
+    }
+    applyState(item, state);
+
+    if (draw.indirect) {
+      // Base instance selects the instance data, so the attributes start at
+      // the beginning of the instance buffer
+      bindInstanceAttributes(shader, 0);
+      GlState::bindBufferBase(GL_SHADER_STORAGE_BUFFER, instanceBinding,
+                              instanceBuffer);
+      GlState::bindBufferRange(GL_SHADER_STORAGE_BUFFER, drawBinding,
+                               drawBuffer, draw.drawIdOffset,
+                               draw.batchCount * sizeof(uint32_t));
+      GlState::bindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+      glMultiDrawElementsIndirect(
+        mode, GL_UNSIGNED_INT,
+        reinterpret_cast<const void*>(draw.commandOffset *
+                                      sizeof(DrawElementsIndirectCommand)),
+        static_cast<GLsizei>(draw.batchCount), 0);
+      stats.multiDrawCalls++;
+      stats.indirectCommands += draw.batchCount;
+    }
+
+    for (uint32_t b = draw.firstBatch; b < draw.firstBatch + draw.batchCount;
+         b++) {
+      const auto& batch = batches[b];
+      const auto& batchItem = items[order[batch.first]];
+      naiveChanges += (5 + batchItem.material->textures.size()) * batch.count;
+      if (batch.instanced) {
+        stats.instancedDraws++;
+        stats.instances += batch.count;
+      }
+      if (draw.indirect || batch.rejected) {
+        continue;
+      }
+      if (batch.instanced) {
+        bindInstanceAttributes(shader, batch.instanceOffset);
+        batchItem.mesh->draw(mode, static_cast<GLsizei>(batch.count));
+      } else if (batch.objectBlock) {
+        objectRing.bind(objectBlockBinding, batch.objectOffset,
+                        sizeof(ObjectBlock));
+        batchItem.mesh->draw(mode);
+      } else {
+        setUniform(shader, modelId, batchItem.model);
+        batchItem.mesh->draw(mode);
+      }
+      stats.drawCalls++;
+    }
+  }
+
+  if (profiledMaterial) {
+    profiler->pop();
+  }
+  if (profiledPass >= 0) {
+    profiler->pop();
+  }
+
+  if (measureFragments) {
+    glEndQuery(GL_SAMPLES_PASSED);
+    GLuint64 samples = 0;
+    glGetQueryObjectui64v(samplesQuery, GL_QUERY_RESULT, &samples);
+    stats.shadedSamples = samples;
+  }
+
+  if (state.pointSize) {
+    GlState::setEnabled(GL_PROGRAM_POINT_SIZE, false);
+  }
+  if (!depthBatches.empty()) {
+    GlState::depthFunc(GL_LESS);
+    GlState::depthMask(true);
+  }
+  resetInstanceAttributes();
+  checkOpenGLErrors();
+
+  stats.items = order.size();
+  stats.uniformsIssued = getUniformStats().issued - uniformsBefore.issued;
+  stats.uniformsSkipped = getUniformStats().skipped - uniformsBefore.skipped;
+  stats.glCallsIssued = GlState::getStats().issued - glBefore.issued;
+  stats.glCallsElided = GlState::getStats().elided - glBefore.elided;
+  size_t issued = stats.programChanges + stats.materialChanges +
+                  stats.textureBinds + stats.vaoChanges + stats.blendChanges +
+                  stats.depthChanges;
+  stats.stateChangesSaved = naiveChanges > issued ? naiveChanges - issued : 0;
+}
+
+void RenderQueue::setMultiDrawIndirect(bool enable)
+{
+  multiDrawIndirect = enable;
+  // Whether a program is drawn instanced depends on it
+  instancedPrograms.clear();
+}
+
+void RenderQueue::setMeasureFragments(bool enable)
+{
+  measureFragments = enable;
+}
+
+void RenderQueue::setProfiler(GpuProfiler* _profiler) noexcept
+{
+  profiler = _profiler;
+}
+
+void RenderQueue::setProfilerName(const Material& material,
+                                  const std::string& name)
+{
+  materialScopes[&material] = name;
+}
+
+const std::vector<RenderQueue::Item>& RenderQueue::getItems() const noexcept
+{
+  return items;
+}
+
+const std::vector<uint32_t>& RenderQueue::getOrder() const noexcept
+{
+  return order;
+}
+
+const RenderQueue::Stats& RenderQueue::getStats() const noexcept
+{
+  return stats;
+}
+
+void RenderQueue::printStats() const
+{
+  std::cout << "RenderQueue: " << stats.items << " items, " << stats.culled
+            << " culled, " << stats.drawCalls << " draws, "
+            << stats.programChanges << " programs, " << stats.materialChanges
+            << " materials, " << stats.instancedDraws << " instanced draws of "
+            << stats.instances << " instances, " << stats.rejected
+            << " rejected, " << stats.multiDrawCalls
+            << " multi draws of " << stats.indirectCommands << " commands, "
+            << stats.textureBinds << " textures, "
+            << stats.vaoChanges << " vaos, " << stats.blendChanges
+            << " blend, " << stats.depthChanges << " depth, "
+            << stats.blockUploads << " block uploads, "
+            << stats.uniformsIssued << " uniforms issued, "
+            << stats.uniformsSkipped << " skipped, " << stats.glCallsIssued
+            << " gl calls, " << stats.glCallsElided << " elided, "
+            << stats.stateChangesSaved << " state changes saved, "
+            << stats.blendedItems << " blended sorted in "
+            << stats.blendedSortMs << " ms"
+            << (stats.blendedSortCoherent ? " (coherent)" : "") << ", "
+            << stats.depthPrePassItems << " pre-passed in "
+            << stats.depthPrePassDraws << " depth draws, "
+            << stats.shadedSamples << " samples shaded" << std::endl;
+}
+
+}  // namespace agt3d
@@ -0,0 +1,351 @@
+#pragma once
+
+#include "agt_AABB.h"
+#include "agt_depth_sorter.h"
+#include "agt_indirect.h"
+#include "agt_object_instance.h"
+#include "agt_uniform_buffer.h"
+
+namespace agt3d
+{
+
+class BaseCamera;
+class GpuProfiler;
+class Scene;
+class Mesh;
+class Material;
+
+/**
+ * @brief Draw order buckets, submitted in this order.
+ * SOLID - opaque geometry, front to back within a state group.
+ * BLENDED - RenderTechnique::enableAlphaBlending, back to front.
+ * OVERLAY - RenderTechnique::disableDepthTest, drawn last.
+ */
+enum class RenderPass : uint8_t {
+  SOLID = 0,
+  BLENDED,
+  OVERLAY
+};
+
+/**
+ * @brief The pass items with this technique are drawn in.
+ */
+RenderPass getRenderPass(const agt3d::RenderTechnique& technique) noexcept;
+
+/**
+ * @brief Collects visible object instances for one frame, sorts them by a
+ * 64-bit key and submits them while skipping redundant program, material,
+ * texture and VAO changes.
+ *
+ * Solid and overlay keys: pass | blend | program | material | vao | depth.
+ * Blended items are ordered far to near by their exact view depth with a
+ * DepthSorter, which reuses the previous frame's order when the same
+ * instances are added in the same order.
+ *
+ * The shaders get the uniforms view, projection, model and, when declared,
+ * color (RenderTechnique::color), borderRadius and borderColor.
+ * Shaders may declare std140 uniform blocks instead (see
+ * agt_uniform_buffer.h): "Frame" is uploaded once per submit, "Material" is
+ * built once per material from its shader params and "Object" of every draw
+ * is streamed through a UniformRing, so a draw costs one buffer range bind
+ * rather than a uniform call per value. The queue owns binding points
+ * frameBlockBinding to objectBlockBinding.
+ *
+ * Shaders that declare the vertex attribute "mat4 instanceModel", or the
+ * Instances storage block below, are drawn instanced: consecutive items
+ * sharing mesh, material and technique state collapse into one draw, their
+ * world matrices (and RenderTechnique::color for an optional "vec4
+ * instanceColor") are streamed through an instance buffer with attribute
+ * divisor 1. Both have fixed locations past the mesh streams,
+ * agt3d::instanceModelLocation and agt3d::instanceColorLocation, a program
+ * that places them elsewhere is drawn without instancing. Other shaders get
+ * one draw per item with the model uniform.
+ *
+ * With GL 4.3 consecutive instanced batches sharing a VAO (meshes in the
+ * same GeometryArena pool), material and technique state are submitted as
+ * one glMultiDrawElementsIndirect. baseInstance of every command points at
+ * its instance data, so instanceModel keeps working. Shaders may instead read
+ * the instance buffer as
+ * "layout(std430, binding = 3) buffer Instances { mat4 model; vec4 color; }"
+ * entries, starting at "layout(std430, binding = 4) buffer Draws { uint
+ * first[]; }" indexed by gl_DrawID. Such shaders are always drawn
+ * indirect, so they need indexed meshes and setMultiDrawIndirect() left on.
+ * Their items are reported and skipped otherwise (Stats::rejected).
+ * Material textures are bound to units
+ * in their order and the sampler named after Texture::getType() is pointed
+ * at the unit. Meshes have to be uploaded (Mesh::updateVAO()) before
+ * submit().
+ *
+ * Solid triangles whose technique sets RenderTechnique::depthPrePass are
+ * first drawn depth-only, with color writes off, the position-only VAO of
+ * their mesh and a built-in shader, grouped into instanced draws per mesh.
+ * Their regular draw then tests with GL_EQUAL and without depth writes, so
+ * every pixel runs the expensive fragment shader once however deep the
+ * overdraw is. For GL_EQUAL to hold, their vertex shaders have to declare
+ * "invariant gl_Position;" and compute it as projection * view * model *
+ * vec4(position, 1.0) (instanceModel in place of model when instanced).
+ */
+class RenderQueue
+{
+ public:
+  struct Item {
+    agt3d::ObjectInstance* oi = nullptr;
+    agt3d::Mesh* mesh = nullptr;
+    agt3d::Material* material = nullptr;
+    agt3d::Shader* shader = nullptr;
+    const agt3d::RenderTechnique* technique = nullptr;
+    glm::mat4 model;
+    /// Bounding sphere center in world space.
+    glm::vec3 center = {0, 0, 0};
+    float viewDepth = 0.0f;
+    RenderPass pass = RenderPass::SOLID;
+  };
+
+  struct Stats {
+    size_t items = 0;
+    size_t culled = 0;
+    size_t drawCalls = 0;
+    size_t instancedDraws = 0;
+    /// Items drawn through instanced draws.
+    size_t instances = 0;
+    /// Items of Instances block programs that couldn't be drawn indirect.
+    size_t rejected = 0;
+    size_t multiDrawCalls = 0;
+    size_t indirectCommands = 0;
+    size_t programChanges = 0;
+    size_t materialChanges = 0;
+    size_t textureBinds = 0;
+    size_t vaoChanges = 0;
+    size_t blendChanges = 0;
+    size_t depthChanges = 0;
+    /// Frame, material and object uniform block uploads.
+    size_t blockUploads = 0;
+    /// setUniform() calls that reached GL and the ones the shadow values
+    /// skipped.
+    size_t uniformsIssued = 0;
+    size_t uniformsSkipped = 0;
+    /// GlState calls that reached GL and the ones it elided.
+    size_t glCallsIssued = 0;
+    size_t glCallsElided = 0;
+    /// Changes an unsorted loop binding everything per item would issue on
+    /// top of the ones above.
+    size_t stateChangesSaved = 0;
+    size_t blendedItems = 0;
+    double blendedSortMs = 0;
+    /// The blended order of the previous frame only needed repairs.
+    bool blendedSortCoherent = false;
+    size_t depthPrePassItems = 0;
+    size_t depthPrePassDraws = 0;
+    /// Samples that passed the depth test in the main pass, only counted
+    /// with setMeasureFragments().
+    uint64_t shadedSamples = 0;
+  };
+
+  RenderQueue();
+  ~RenderQueue();
+  RenderQueue& operator=(const RenderQueue& other) = delete;
+  RenderQueue(RenderQueue&) = delete;
+  /**
+   * @brief Start a new frame, clears the items and the statistics.
+   */
+  void begin(const glm::mat4& _view, const glm::mat4& _projection);
+  void begin(const agt3d::BaseCamera& camera);
+  /**
+   * @brief Add an instance unless it is disabled, not renderable, has no
+   * shader or lies outside the view frustum.
+   * @return true if the instance was queued.
+   */
+  bool add(agt3d::ObjectInstance& oi);
+  /**
+   * @brief Refresh the scene world bounds and add every instance.
+   */
+  void gather(agt3d::Scene& scene);
+  void sort();
+  /**
+   * @brief Issue the draw calls in key order. GL state touched by the queue
+   * (program, VAO, blending, depth test) is changed through GlState and left
+   * as the last item set it. After a depth pre-pass the depth function is
+   * GL_LESS and depth writes are on.
+   */
+  void submit();
+  /**
+   * @brief Merge draws of arena meshes into glMultiDrawElementsIndirect calls
+   * when supported. Enabled by default, without it programs reading the
+   * Instances block are not drawn.
+   */
+  void setMultiDrawIndirect(bool enable);
+  /**
+   * @brief Count the samples shaded by the main pass (after the depth
+   * pre-pass) with a GL_SAMPLES_PASSED query into Stats::shadedSamples.
+   * submit() then waits for the GPU, meant for measuring overdraw only.
+   */
+  void setMeasureFragments(bool enable);
+  /**
+   * @brief Time submit() with a scope per pass bucket and, nested, per run of
+   * draws sharing a material, plus one for the depth pre-pass. nullptr to
+   * stop.
+   */
+  void setProfiler(agt3d::GpuProfiler* _profiler) noexcept;
+  /**
+   * @brief Scope name of a material. Unnamed materials are called "material
+   * N", numbered in the order the queue first draws them, which stays the
+   * same for the lifetime of the queue.
+   */
+  void setProfilerName(const agt3d::Material& material,
+                       const std::string& name);
+  const std::vector<Item>& getItems() const noexcept;
+  /**
+   * @brief Item indices in submit order, valid after sort().
+   */
+  const std::vector<uint32_t>& getOrder() const noexcept;
+  const Stats& getStats() const noexcept;
+  void printStats() const;
+
+ private:
+  uint64_t makeKey(const Item& item, float minDepth, float maxDepth);
+  uint32_t smallId(std::unordered_map<uintptr_t, uint32_t>& ids,
+                   uintptr_t value, uint32_t bits);
+  uint32_t blendId(const agt3d::RenderTechnique& technique);
+  void radixSort();
+  void sortBlended();
+  static bool sameTechnique(const agt3d::RenderTechnique& a,
+                            const agt3d::RenderTechnique& b,
+                            bool colorPerInstance) noexcept;
+  bool canBatch(const Item& a, const Item& b) const;
+  bool canMultiDraw(const Item& a, const Item& b) const;
+  void buildBatches();
+  void buildMultiDraws();
+  /**
+   * @brief The program declares the Instances storage block, cached per
+   * program. Needs hasMultiDrawIndirect().
+   */
+  bool declaresInstanceBlock(const agt3d::Shader& shader) const;
+  /**
+   * @brief The program declares the Instances storage block and indirect
+   * draws are available and enabled.
+   */
+  bool readsInstanceBlock(const agt3d::Shader& shader) const;
+  bool colorPerInstance(const agt3d::Shader& shader) const;
+  /**
+   * @brief The program reads instance data and its instance attributes are
+   * at the fixed locations, cached per program.
+   */
+  bool drawsInstanced(const agt3d::Shader& shader) const;
+  void bindInstanceAttributes(const agt3d::Shader& shader,
+                              uint32_t instanceOffset);
+  /**
+   * @brief Disable the instance attributes in the VAOs they were enabled in,
+   * the VAOs are shared with other users of the meshes.
+   */
+  void resetInstanceAttributes();
+  bool usesDepthPrePass(const Item& item) const noexcept;
+  void submitDepthPrePass();
+
+  /// GL state as last set during submit().
+  struct SubmitState {
+    static constexpr GLuint unknown = std::numeric_limits<GLuint>::max();
+    GLuint program = unknown;
+    GLuint vao = unknown;
+    const agt3d::Material* material = nullptr;
+    int depthTest = -1;
+    /// GL_EQUAL without depth writes for pre-passed items.
+    int depthEqual = -1;
+    std::pair<GLuint, GLuint> blend = {unknown, unknown};
+    float lineWidth = -1.0f;
+    bool pointSize = false;
+    std::vector<GLuint> textures;
+    std::vector<GLuint> programsWithFrameUniforms;
+  };
+  void applyState(const Item& item, SubmitState& state);
+
+ private:
+  glm::mat4 view = glm::mat4(1);
+  glm::mat4 projection = glm::mat4(1);
+  agt3d::Frustum frustum;
+  std::vector<Item> items;
+  std::vector<uint64_t> keys;
+  std::vector<uint32_t> order;
+  /// Scratch buffers of the radix sort, kept between frames.
+  std::vector<uint64_t> keysTemp;
+  std::vector<uint32_t> orderTemp;
+  agt3d::DepthSorter depthSorter;
+  std::vector<uintptr_t> blendedIds;
+  std::vector<glm::vec3> blendedCenters;
+  std::unordered_map<uintptr_t, uint32_t> programIds;
+  std::unordered_map<uintptr_t, uint32_t> materialIds;
+  std::unordered_map<uintptr_t, uint32_t> vaoIds;
+  std::vector<std::pair<GLuint, GLuint>> blendModes;
+
+  struct InstanceData {
+    glm::mat4 model;
+    glm::vec4 color;
+  };
+  /// Run of items in submit order drawn with one call.
+  struct Batch {
+    uint32_t first = 0;
+    uint32_t count = 1;
+    uint32_t instanceOffset = 0;
+    /// Ring offset of the Object block of a non-instanced batch.
+    size_t objectOffset = 0;
+    bool instanced = false;
+    bool objectBlock = false;
+    /// Reads the Instances block but can't be drawn indirect.
+    bool rejected = false;
+  };
+  std::vector<Batch> batches;
+  std::vector<InstanceData> instanceData;
+  GLuint instanceBuffer = 0;
+  size_t instanceBufferSize = 0;
+
+  agt3d::FrameBlock frame;
+  agt3d::UniformBuffer frameBuffer;
+  agt3d::MaterialBlocks materialBlocks;
+  agt3d::UniformRing objectRing;
+  std::vector<agt3d::ObjectBlock> objectBlocks;
+
+  static constexpr GLuint instanceBinding = 3;
+  static constexpr GLuint drawBinding = 4;
+  /// Batches submitted with one call, indirect or a single direct draw.
+  struct MultiDraw {
+    uint32_t firstBatch = 0;
+    uint32_t batchCount = 1;
+    uint32_t commandOffset = 0;
+    size_t drawIdOffset = 0;
+    bool indirect = false;
+  };
+  bool multiDrawIndirect = true;
+  size_t ssboAlignment = 0;
+  mutable std::unordered_map<GLuint, bool> instanceBlockPrograms;
+  mutable std::unordered_map<GLuint, bool> instancedPrograms;
+  /// Programs already reported for rejected items.
+  std::vector<GLuint> rejectedPrograms;
+  /// VAOs with instance attributes enabled during submit().
+  std::vector<GLuint> instancedVaos;
+  std::vector<MultiDraw> multiDraws;
+  std::vector<agt3d::DrawElementsIndirectCommand> commands;
+  std::vector<uint32_t> drawInstanceOffsets;
+  GLuint indirectBuffer = 0;
+  GLuint drawBuffer = 0;
+
+  /// Pre-pass items sharing a mesh.
+  struct DepthBatch {
+    agt3d::Mesh* mesh = nullptr;
+    uint32_t instanceOffset = 0;
+    uint32_t count = 1;
+  };
+  std::optional<agt3d::Shader> depthShader;
+  bool depthShaderFailed = false;
+  std::vector<DepthBatch> depthBatches;
+  std::vector<uint32_t> depthOrder;
+  std::vector<glm::mat4> depthModels;
+  GLuint depthInstanceBuffer = 0;
+  size_t depthInstanceBufferSize = 0;
+  bool measureFragments = false;
+  GLuint samplesQuery = 0;
+  agt3d::GpuProfiler* profiler = nullptr;
+  /// Profiler scope names, built once per material.
+  std::unordered_map<const agt3d::Material*, std::string> materialScopes;
+  Stats stats;
+};
+
+}  // namespace agt3d
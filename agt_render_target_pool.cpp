@@ -0,0 +1,222 @@
+#include "agt_render_target_pool.h"
+
+#include "agt_gl_state.h"
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+size_t bytesPerPixel(GLuint internalFormat) noexcept
+{
+  switch (internalFormat) {
+    case GL_R8:
+      return 1;
+    case GL_RG8:
+    case GL_R16F:
+      return 2;
+    case GL_RGB8:
+    case GL_SRGB8:
+      return 3;
+    case GL_RGB16F:
+      return 6;
+    case GL_RGBA16F:
+    case GL_RG32F:
+      return 8;
+    case GL_RGB32F:
+      return 12;
+    case GL_RGBA32F:
+      return 16;
+    default:
+      return 4;
+  }
+}
+
+size_t getByteSize(const RenderTargetDesc& desc) noexcept
+{
+  return static_cast<size_t>(desc.width) * desc.height *
+         std::max(1, desc.samples) * bytesPerPixel(desc.internalFormat);
+}
+
+GLuint createTargetTexture(const RenderTargetDesc& desc)
+{
+  GLuint texture;
+  glGenTextures(1, &texture);
+  if (desc.samples > 0) {
+    GlState::bindTexture(GL_TEXTURE_2D_MULTISAMPLE, texture);
+    glTexImage2DMultisample(GL_TEXTURE_2D_MULTISAMPLE, desc.samples,
+                            desc.internalFormat, desc.width, desc.height,
+                            GL_TRUE);
+    return texture;
+  }
+  GlState::bindTexture(GL_TEXTURE_2D, texture);
+  glTexImage2D(GL_TEXTURE_2D, 0, desc.internalFormat, desc.width, desc.height,
+               0, desc.format, desc.type, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, desc.filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, desc.filter);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  return texture;
+}
+
+RenderTargetPool::RenderTargetPool(uint32_t _maxIdleFrames)
+    : maxIdleFrames(_maxIdleFrames)
+{
+}
+
+RenderTargetPool::~RenderTargetPool() { clear(); }
+
+RenderTargetPool::Key RenderTargetPool::makeKey(const RenderTargetDesc& desc,
+                                                bool framebuffer,
+                                                bool depth) noexcept
+{
+  return {desc.width, desc.height, desc.internalFormat, desc.samples,
+          framebuffer, framebuffer && depth};
+}
+
+RenderTargetPool::Entry& RenderTargetPool::acquire(const Key& key,
+                                                   const RenderTargetDesc& desc)
+{
+  auto& bucket = entries[key];
+  for (auto& entry : bucket) {
+    if (entry.inUse) {
+      continue;
+    }
+    stats.hits++;
+    if (desc.samples == 0 && entry.desc.filter != desc.filter) {
+      GlState::bindTexture(GL_TEXTURE_2D, entry.texture);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, desc.filter);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, desc.filter);
+    }
+    if (entry.fbo) {
+      entry.fbo->textures[0].format = desc.format;
+      entry.fbo->textures[0].type = desc.type;
+    }
+    entry.desc = desc;
+    entry.inUse = true;
+    entry.lastUsed = frame;
+    stats.inUse++;
+    return entry;
+  }
+
+  stats.misses++;
+  Entry entry;
+  entry.desc = desc;
+  if (key.framebuffer) {
+    entry.fbo = std::make_unique<FBO>(desc.width, desc.height, desc.samples > 0,
+                                      desc.samples, desc.internalFormat);
+    entry.texture = entry.fbo->attachTexture(GL_COLOR_ATTACHMENT0, desc.type,
+                                             desc.format, desc.filter);
+    if (key.depth) {
+      entry.fbo->attachRenderBuffer();
+    }
+    if (!entry.fbo->checkReadiness()) {
+      std::cerr << "RenderTargetPool: incomplete " << desc.width << "x"
+                << desc.height << " framebuffer" << std::endl;
+    }
+  } else {
+    entry.texture = createTargetTexture(desc);
+  }
+  checkOpenGLErrors();
+  entry.inUse = true;
+  entry.lastUsed = frame;
+  stats.entries++;
+  stats.inUse++;
+  stats.bytes += getByteSize(desc);
+  bucket.push_back(std::move(entry));
+  return bucket.back();
+}
+
+FBO* RenderTargetPool::acquireFramebuffer(const RenderTargetDesc& desc,
+                                          bool depth)
+{
+  return acquire(makeKey(desc, true, depth), desc).fbo.get();
+}
+
+GLuint RenderTargetPool::acquireTexture(const RenderTargetDesc& desc)
+{
+  return acquire(makeKey(desc, false, false), desc).texture;
+}
+
+void RenderTargetPool::release(Entry& entry)
+{
+  if (entry.inUse) {
+    entry.inUse = false;
+    stats.inUse--;
+  }
+}
+
+void RenderTargetPool::release(const FBO* fbo)
+{
+  for (auto& [key, bucket] : entries) {
+    for (auto& entry : bucket) {
+      if (entry.fbo.get() == fbo) {
+        release(entry);
+        return;
+      }
+    }
+  }
+}
+
+void RenderTargetPool::releaseTexture(GLuint texture)
+{
+  for (auto& [key, bucket] : entries) {
+    for (auto& entry : bucket) {
+      if (!entry.fbo && entry.texture == texture) {
+        release(entry);
+        return;
+      }
+    }
+  }
+}
+
+void RenderTargetPool::destroy(Entry& entry)
+{
+  if (entry.fbo) {
+    // The FBO owns its texture
+    entry.fbo.reset();
+  } else {
+    GlState::deleteTextures(1, &entry.texture);
+  }
+  stats.entries--;
+  stats.bytes -= getByteSize(entry.desc);
+}
+
+void RenderTargetPool::endFrame()
+{
+  for (auto it = entries.begin(); it != entries.end();) {
+    auto& bucket = it->second;
+    for (auto& entry : bucket) {
+      release(entry);
+    }
+    auto idle = std::stable_partition(
+      bucket.begin(), bucket.end(), [this](const Entry& entry) {
+        return frame - entry.lastUsed <= maxIdleFrames;
+      });
+    for (auto e = idle; e != bucket.end(); ++e) {
+      destroy(*e);
+      stats.trimmed++;
+    }
+    bucket.erase(idle, bucket.end());
+    it = bucket.empty() ? entries.erase(it) : std::next(it);
+  }
+  frame++;
+}
+
+void RenderTargetPool::clear()
+{
+  for (auto& [key, bucket] : entries) {
+    for (auto& entry : bucket) {
+      destroy(entry);
+    }
+  }
+  entries.clear();
+  stats.inUse = 0;
+}
+
+const RenderTargetPool::Stats& RenderTargetPool::getStats() const noexcept
+{
+  return stats;
+}
+
+}  // namespace agt3d
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "agt_fbo.h"
+
+namespace agt3d
+{
+
+/**
+ * @brief Size and format of a 2D color target, multisampled if samples > 0.
+ */
+struct RenderTargetDesc {
+  int width = 0;
+  int height = 0;
+  GLuint internalFormat = GL_RGBA8;
+  GLuint format = GL_RGBA;
+  GLuint type = GL_UNSIGNED_BYTE;
+  GLuint filter = GL_LINEAR;
+  int samples = 0;
+
+  bool operator==(const RenderTargetDesc& other) const = default;
+};
+
+/**
+ * @brief Approximate bytes per texel of an internal format, 4 for formats it
+ * doesn't know.
+ */
+size_t bytesPerPixel(GLuint internalFormat) noexcept;
+
+/**
+ * @brief Approximate memory of a target, samples included.
+ */
+size_t getByteSize(const agt3d::RenderTargetDesc& desc) noexcept;
+
+/**
+ * @brief Create an uninitialized texture for a target, GL_TEXTURE_2D or
+ * GL_TEXTURE_2D_MULTISAMPLE depending on desc.samples.
+ */
+GLuint createTargetTexture(const agt3d::RenderTargetDesc& desc);
+
+/**
+ * @brief Recycles FBOs and textures between frames instead of creating new
+ * GL objects for every temporary or resized target.
+ *
+ * Targets are matched by width, height, internal format and sample count,
+ * FBOs also by whether they have a depth buffer. The pixel format, type and
+ * filter of the request are applied to a recycled texture, they don't need
+ * new storage. Everything acquired stays valid until endFrame(), which
+ * returns it to the pool; release() returns a target earlier so it can be
+ * handed out again within the frame. Entries idle for more than maxIdleFrames
+ * frames are deleted by endFrame().
+ */
+class RenderTargetPool
+{
+ public:
+  struct Stats {
+    size_t hits = 0;
+    size_t misses = 0;
+    /// Entries deleted after being idle too long.
+    size_t trimmed = 0;
+    size_t entries = 0;
+    size_t inUse = 0;
+    /// Color storage of all entries, depth buffers not counted.
+    size_t bytes = 0;
+  };
+
+  explicit RenderTargetPool(uint32_t _maxIdleFrames = 3);
+  ~RenderTargetPool();
+  RenderTargetPool& operator=(const RenderTargetPool& other) = delete;
+  RenderTargetPool(RenderTargetPool&) = delete;
+
+  /**
+   * @brief An FBO with one color texture at GL_COLOR_ATTACHMENT0 and an
+   * optional depth renderbuffer, owned by the pool.
+   */
+  agt3d::FBO* acquireFramebuffer(const agt3d::RenderTargetDesc& desc,
+                                 bool depth = true);
+  /**
+   * @brief A texture owned by the pool, e.g. to attach to another FBO.
+   */
+  GLuint acquireTexture(const agt3d::RenderTargetDesc& desc);
+  void release(const agt3d::FBO* fbo);
+  void releaseTexture(GLuint texture);
+  /**
+   * @brief Return all acquired targets to the pool and trim idle entries.
+   */
+  void endFrame();
+  /**
+   * @brief Delete every entry, acquired ones included.
+   */
+  void clear();
+  const Stats& getStats() const noexcept;
+
+ private:
+  struct Key {
+    int width;
+    int height;
+    GLuint internalFormat;
+    int samples;
+    bool framebuffer;
+    bool depth;
+
+    bool operator<(const Key& other) const
+    {
+      return std::tie(width, height, internalFormat, samples, framebuffer,
+                      depth) < std::tie(other.width, other.height,
+                                        other.internalFormat, other.samples,
+                                        other.framebuffer, other.depth);
+    }
+  };
+  struct Entry {
+    agt3d::RenderTargetDesc desc;
+    std::unique_ptr<agt3d::FBO> fbo;
+    GLuint texture = 0;
+    bool inUse = false;
+    uint64_t lastUsed = 0;
+  };
+  static Key makeKey(const agt3d::RenderTargetDesc& desc, bool framebuffer,
+                     bool depth) noexcept;
+  Entry& acquire(const Key& key, const agt3d::RenderTargetDesc& desc);
+  void release(Entry& entry);
+  void destroy(Entry& entry);
+
+ private:
+  std::map<Key, std::vector<Entry>> entries;
+  uint32_t maxIdleFrames;
+  uint64_t frame = 0;
+  Stats stats;
+};
+
+}  // namespace agt3d
@@ -1,3 +1,4 @@
+#include "agt_mesh_bvh.h"
 #include "agt_object_instance.h"
 #include "agt_scene.h"
 #include "agt_stdafx.h"
@@ -137,3 +138,44 @@ agt3d::BoundingSphere agt3d::Scene::calculateBoundingSphere() const
   float maxDist = sqrtf(maxDistSq);
   return {center, maxDist};
 }
+
+void agt3d::Scene::updateWorldBounds()
+{
+  std::vector<agt3d::ObjectInstance*> stale;
+  std::vector<agt3d::AABB> local;
+  std::vector<glm::mat4> tms;
+  for (auto& oi : ois) {
+    if (!oi->isRenderable()) {
+      continue;
+    }
+    auto tm = oi->getTm();
+    const auto& box = oi->getObject()->getMesh()->getAABB();
+    if (oi->worldBoundsStale(tm, box)) {
+      stale.push_back(oi.get());
+      local.push_back(box);
+      tms.push_back(tm);
+    }
+  }
+
+  std::vector<agt3d::AABB> world(stale.size());
+  agt3d::transformAABBs(local.data(), tms.data(), world.data(), stale.size());
+  for (size_t i = 0; i < stale.size(); i++) {
+    stale[i]->setWorldBounds(tms[i], local[i], world[i]);
+  }
+}
+
+std::optional<std::pair<agt3d::ObjectInstance*, agt3d::RayHit>>
+agt3d::Scene::pick(const agt3d::ray& worldRay)
+{
+  std::optional<std::pair<agt3d::ObjectInstance*, agt3d::RayHit>> closest;
+  for (auto& oi : ois) {
+    if (!oi->isRenderable() || !oi->isEnabled()) {
+      continue;
+    }
+    auto hit = oi->raycast(worldRay);
+    if (hit && (!closest || hit->t < closest->second.t)) {
+      closest = std::make_pair(oi.get(), *hit);
+    }
+  }
+  return closest;
+}
@@ -9,6 +9,8 @@ namespace agt3d
 class Texture;
 class Material;
 class ObjectInstance;
+struct RayHit;
+struct ray;
 
 class Scene
 {
@@ -40,6 +42,17 @@ class Scene
    * @return bounding sphere object.
    */
   agt3d::BoundingSphere calculateBoundingSphere() const;
+  /**
+   * @brief Refresh the cached world bounds of every renderable instance whose
+   * transform or mesh bounds changed, transforming them as one batch.
+   */
+  void updateWorldBounds();
+  /**
+   * @brief Closest enabled object instance hit by a world space ray, tested
+   * against the mesh triangles.
+   */
+  std::optional<std::pair<agt3d::ObjectInstance*, agt3d::RayHit>> pick(
+    const agt3d::ray& worldRay);
 
  public:
   std::vector<std::shared_ptr<agt3d::ObjectInstance>> ois;
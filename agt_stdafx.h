@@ -12,7 +12,9 @@
 #include <atomic>
 #include <cassert>
 #include <chrono>
+#include <condition_variable>
 #include <ctime>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <functional>
@@ -25,7 +27,9 @@
 #include <numeric>
 #include <optional>
 #include <ostream>
+#include <random>
 #include <shared_mutex>
+#include <span>
 #include <sstream>
 #include <thread>
 #include <vector>
@@ -1,8 +1,11 @@
 #include "agt_texture.h"
 
+#include "agt_gl_state.h"
+
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb/stb_image.h"
+#include "stb/stb_image_write.h"
 
 namespace agt3d
 {
@@ -24,7 +27,7 @@ Texture::~Texture()
     std::cout << "-- deleted texture object: " << textureObject
               << " path: " << path << "\n";
 #endif
-    glDeleteTextures(1, &textureObject);
+    GlState::deleteTextures(1, &textureObject);
   }
 }
 
@@ -57,7 +60,7 @@ glm::ivec2 Texture::getResolution() { return resolution; }
 
 void Texture::updateFromBGRABuffer(const void* data)
 {
-  glBindTexture(GL_TEXTURE_2D, textureObject);
+  GlState::bindTexture(GL_TEXTURE_2D, textureObject);
   glTexSubImage2D(GL_TEXTURE_2D,                           // target
                   0,                                       // level
                   0,                                       // xoffset
@@ -74,7 +77,7 @@ void Texture::updateFromBGRABuffer(const void* data)
 
 void Texture::updateFromRGBBuffer(const void* data)
 {
-  glBindTexture(GL_TEXTURE_2D, textureObject);
+  GlState::bindTexture(GL_TEXTURE_2D, textureObject);
   glTexSubImage2D(GL_TEXTURE_2D,                           // target
                   0,                                       // level
                   0,                                       // xoffset
@@ -91,7 +94,7 @@ void Texture::updateFromRGBBuffer(const void* data)
 
 void Texture::updateFromRedBuffer(const void* data)
 {
-  glBindTexture(GL_TEXTURE_2D, textureObject);
+  GlState::bindTexture(GL_TEXTURE_2D, textureObject);
   glTexSubImage2D(GL_TEXTURE_2D,                           // target
                   0,                                       // level
                   0,                                       // xoffset
@@ -108,7 +111,7 @@ void Texture::updateFromRedBuffer(const void* data)
 
 void Texture::updateFromRGBABuffer(const void* data)
 {
-  glBindTexture(GL_TEXTURE_2D, textureObject);
+  GlState::bindTexture(GL_TEXTURE_2D, textureObject);
   glTexSubImage2D(GL_TEXTURE_2D,                           // target
                   0,                                       // level
                   0,                                       // xoffset
@@ -129,13 +132,12 @@ void Texture::createOpenGLTextureObject(int width, int height, int _channels,
 {
   // Delete texture object if already exists!
   if (textureObject != 0) {
-    glDeleteTextures(1, &textureObject);
+    GlState::deleteTextures(1, &textureObject);
   }
   glGenTextures(1, &textureObject);
-  // Store current binding
-  GLuint boundTexture = 0;
-  glGetIntegerv(GL_TEXTURE_BINDING_2D, (GLint*)&boundTexture);
-  glBindTexture(textureTarget, textureObject);
+  // Store current binding, known without asking the driver
+  GLuint boundTexture = GlState::getTexture(textureTarget);
+  GlState::bindTexture(textureTarget, textureObject);
 #ifdef VERBOSE
   std::cout << "-- created texture object: " << textureObject << std::endl;
 #endif
@@ -170,7 +172,7 @@ void Texture::createOpenGLTextureObject(int width, int height, int _channels,
                   genMipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
   glTexParameteri(textureTarget, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-  glBindTexture(textureTarget, boundTexture);
+  GlState::bindTexture(textureTarget, boundTexture);
 }
 
 void Texture::create(int width, int height) { MY_ABORT("not implemented"); }
@@ -180,18 +182,151 @@ void Texture::create(int width, int height, GLenum _sizedInternalFormat)
   resolution = {width, height};
   sizedInternalFormat = _sizedInternalFormat;
   glGenTextures(1, &textureObject);
-  glBindTexture(GL_TEXTURE_2D, textureObject);
+  GlState::bindTexture(GL_TEXTURE_2D, textureObject);
   glTexStorage2D(GL_TEXTURE_2D, 1, sizedInternalFormat, resolution.x,
                  resolution.y);
-  glBindTexture(GL_TEXTURE_2D, 0);
 }
 
 void Texture::update(GLenum format, GLenum type, void* data)
 {
-  glBindTexture(GL_TEXTURE_2D, textureObject);
+  GlState::bindTexture(GL_TEXTURE_2D, textureObject);
   glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, resolution.x, resolution.y, format,
                   type, data);
-  glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+bool writeImage(const std::string& path, int width, int height, int channels,
+                const void* pixels)
+{
+  auto extension = std::filesystem::path(path).extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  int ok = 0;
+  if (extension == ".png") {
+    ok = stbi_write_png(path.c_str(), width, height, channels, pixels,
+                        width * channels);
+  } else if (extension == ".jpg" || extension == ".jpeg") {
+    ok = stbi_write_jpg(path.c_str(), width, height, channels, pixels, 90);
+  } else if (extension == ".bmp") {
+    ok = stbi_write_bmp(path.c_str(), width, height, channels, pixels);
+  } else if (extension == ".tga") {
+    ok = stbi_write_tga(path.c_str(), width, height, channels, pixels);
+  } else {
+    std::cerr << "unsupported image extension " << path << std::endl;
+    return false;
+  }
+  if (!ok) {
+    std::cerr << "failed to write " << path << std::endl;
+  }
+  return ok != 0;
+}
+
+const char* getExtension(ImageCodec codec) noexcept
+{
+  switch (codec) {
+    case ImageCodec::PNG:
+      return ".png";
+    case ImageCodec::QOI:
+      return ".qoi";
+  }
+  return "";
+}
+
+static void appendToVector(void* context, void* data, int size)
+{
+  auto out = static_cast<std::vector<uint8_t>*>(context);
+  auto bytes = static_cast<const uint8_t*>(data);
+  out->insert(out->end(), bytes, bytes + size);
+}
+
+static void appendBigEndian(std::vector<uint8_t>& out, uint32_t value)
+{
+  out.push_back(static_cast<uint8_t>(value >> 24));
+  out.push_back(static_cast<uint8_t>(value >> 16));
+  out.push_back(static_cast<uint8_t>(value >> 8));
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+/**
+ * @brief "Quite OK Image" encoder, lossless and much faster than PNG. See
+ * https://qoiformat.org/qoi-specification.pdf
+ */
+static bool encodeQoi(int width, int height, int channels,
+                      const uint8_t* pixels, std::vector<uint8_t>& out)
+{
+  if (channels != 3 && channels != 4) {
+    return false;
+  }
+  const size_t count = static_cast<size_t>(width) * height;
+  out.reserve(out.size() + 14 + count * (channels + 1) + 8);
+  out.insert(out.end(), {'q', 'o', 'i', 'f'});
+  appendBigEndian(out, width);
+  appendBigEndian(out, height);
+  out.push_back(static_cast<uint8_t>(channels));
+  out.push_back(0);
+
+  std::array<glm::u8vec4, 64> seen{};
+  glm::u8vec4 previous = {0, 0, 0, 255};
+  int run = 0;
+  for (size_t i = 0; i < count; i++) {
+    const uint8_t* p = pixels + i * channels;
+    glm::u8vec4 pixel = {p[0], p[1], p[2], channels == 4 ? p[3] : 255};
+    if (pixel == previous) {
+      run++;
+      if (run == 62 || i == count - 1) {
+        out.push_back(static_cast<uint8_t>(0xc0 | (run - 1)));
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      out.push_back(static_cast<uint8_t>(0xc0 | (run - 1)));
+      run = 0;
+    }
+    int index = (pixel.r * 3 + pixel.g * 5 + pixel.b * 7 + pixel.a * 11) % 64;
+    if (seen[index] == pixel) {
+      out.push_back(static_cast<uint8_t>(index));
+    } else {
+      seen[index] = pixel;
+      if (pixel.a == previous.a) {
+        auto dr = static_cast<int8_t>(pixel.r - previous.r);
+        auto dg = static_cast<int8_t>(pixel.g - previous.g);
+        auto db = static_cast<int8_t>(pixel.b - previous.b);
+        int drg = dr - dg;
+        int dbg = db - dg;
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 &&
+            db <= 1) {
+          out.push_back(static_cast<uint8_t>(0x40 | (dr + 2) << 4 |
+                                             (dg + 2) << 2 | (db + 2)));
+        } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 &&
+                   dbg >= -8 && dbg <= 7) {
+          out.push_back(static_cast<uint8_t>(0x80 | (dg + 32)));
+          out.push_back(static_cast<uint8_t>((drg + 8) << 4 | (dbg + 8)));
+        } else {
+          out.insert(out.end(), {0xfe, pixel.r, pixel.g, pixel.b});
+        }
+      } else {
+        out.insert(out.end(), {0xff, pixel.r, pixel.g, pixel.b, pixel.a});
+      }
+    }
+    previous = pixel;
+  }
+  out.insert(out.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+  return true;
+}
+
+bool encodeImage(ImageCodec codec, int width, int height, int channels,
+                 const void* pixels, std::vector<uint8_t>& out)
+{
+  out.clear();
+  switch (codec) {
+    case ImageCodec::PNG:
+      return stbi_write_png_to_func(appendToVector, &out, width, height,
+                                    channels, pixels, width * channels) != 0;
+    case ImageCodec::QOI:
+      return encodeQoi(width, height, channels,
+                       static_cast<const uint8_t*>(pixels), out);
+  }
+  return false;
 }
 
 }  // namespace agt3d
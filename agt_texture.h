@@ -45,4 +45,26 @@ class Texture
   bool loaded = false;
 };
 
+enum class ImageCodec { PNG, QOI };
+
+/**
+ * @brief File extension of a codec, including the dot.
+ */
+const char* getExtension(agt3d::ImageCodec codec) noexcept;
+
+/**
+ * @brief Encode 8-bit RGB or RGBA pixels, top row first, into memory. Safe to
+ * call from several threads at once.
+ * @return false if the encoder failed, out is then undefined.
+ */
+bool encodeImage(agt3d::ImageCodec codec, int width, int height, int channels,
+                 const void* pixels, std::vector<uint8_t>& out);
+
+/**
+ * @brief Write 8-bit pixels, top row first, as PNG, JPEG, BMP or TGA
+ * depending on the extension of path.
+ */
+bool writeImage(const std::string& path, int width, int height, int channels,
+                const void* pixels);
+
 }  // namespace agt3d
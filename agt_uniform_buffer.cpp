@@ -0,0 +1,263 @@
+#include "agt_uniform_buffer.h"
+
+#include "agt_gl_state.h"
+#include "agt_material.h"
+#include "agt_stdafx.h"
+#include "agt_utils.h"
+
+namespace agt3d
+{
+
+bool bindUniformBlock(const Shader& shader, const std::string& name,
+                      GLuint binding) noexcept
+{
+  auto it = shader.uniformBlocks.find(name);
+  if (it == shader.uniformBlocks.end()) {
+    return false;
+  }
+  glUniformBlockBinding(shader.program, it->second, binding);
+  return true;
+}
+
+UniformBuffer::~UniformBuffer()
+{
+  if (buffer) {
+    GlState::deleteBuffers(1, &buffer);
+  }
+}
+
+UniformBuffer::UniformBuffer(UniformBuffer&& other) noexcept
+    : buffer(other.buffer), size(other.size)
+{
+  other.buffer = 0;
+  other.size = 0;
+}
+
+void UniformBuffer::update(const void* data, size_t _size)
+{
+  if (!buffer) {
+    glGenBuffers(1, &buffer);
+  }
+  GlState::bindBuffer(GL_UNIFORM_BUFFER, buffer);
+  if (_size != size) {
+    glBufferData(GL_UNIFORM_BUFFER, _size, data, GL_DYNAMIC_DRAW);
+    size = _size;
+  } else {
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, _size, data);
+  }
+}
+
+void UniformBuffer::bind(GLuint binding) const noexcept
+{
+  GlState::bindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+}
+
+GLuint UniformBuffer::getBuffer() const noexcept { return buffer; }
+
+size_t UniformBuffer::getSize() const noexcept { return size; }
+
+UniformRing::UniformRing(size_t _capacity) : capacity(_capacity) {}
+
+UniformRing::~UniformRing()
+{
+  if (buffer) {
+    GlState::deleteBuffers(1, &buffer);
+  }
+}
+
+void UniformRing::allocate()
+{
+  if (!buffer) {
+    glGenBuffers(1, &buffer);
+    GLint align = 0;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &align);
+    alignment = std::max<GLint>(align, 16);
+  }
+  // Orphan, draws still reading the old storage keep it alive
+  GlState::bindBuffer(GL_UNIFORM_BUFFER, buffer);
+  glBufferData(GL_UNIFORM_BUFFER, capacity, nullptr, GL_STREAM_DRAW);
+  head = 0;
+}
+
+size_t UniformRing::getStride(size_t blockSize) const noexcept
+{
+  size_t align = alignment ? alignment : 256;
+  return (blockSize + align - 1) / align * align;
+}
+
+size_t UniformRing::write(const void* blocks, size_t blockSize, size_t count)
+{
+  if (!buffer) {
+    allocate();
+  }
+  size_t stride = getStride(blockSize);
+  size_t bytes = stride * count;
+  if (bytes == 0) {
+    return head;
+  }
+  if (bytes > capacity) {
+    while (capacity < bytes) {
+      capacity *= 2;
+    }
+    allocate();
+  } else if (head + bytes > capacity) {
+    allocate();
+    wraps++;
+  }
+
+  GlState::bindBuffer(GL_UNIFORM_BUFFER, buffer);
+  auto dst = static_cast<uint8_t*>(glMapBufferRange(
+    GL_UNIFORM_BUFFER, head, bytes,
+    GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+      GL_MAP_UNSYNCHRONIZED_BIT));
+  MY_ASSERT(dst, "Can't map the uniform ring");
+  auto src = static_cast<const uint8_t*>(blocks);
+  if (stride == blockSize) {
+    memcpy(dst, src, bytes);
+  } else {
+    for (size_t i = 0; i < count; i++) {
+      memcpy(dst + i * stride, src + i * blockSize, blockSize);
+    }
+  }
+  glUnmapBuffer(GL_UNIFORM_BUFFER);
+
+  size_t offset = head;
+  head += bytes;
+  return offset;
+}
+
+void UniformRing::bind(GLuint binding, size_t offset,
+                       size_t blockSize) const noexcept
+{
+  GlState::bindBufferRange(GL_UNIFORM_BUFFER, binding, buffer, offset, blockSize);
+}
+
+GLuint UniformRing::getBuffer() const noexcept { return buffer; }
+
+size_t UniformRing::getWraps() const noexcept { return wraps; }
+
+const MaterialBlocks::Layout* MaterialBlocks::getLayout(const Shader& shader)
+{
+  auto it = layouts.find(shader.program);
+  if (it != layouts.end()) {
+    return it->second ? &*it->second : nullptr;
+  }
+
+  auto& layout = layouts[shader.program];
+  auto block = shader.uniformBlocks.find("Material");
+  if (block == shader.uniformBlocks.end()) {
+    return nullptr;
+  }
+  GLuint program = shader.program;
+  GLint size = 0;
+  GLint count = 0;
+  glGetActiveUniformBlockiv(program, block->second,
+                            GL_UNIFORM_BLOCK_DATA_SIZE, &size);
+  glGetActiveUniformBlockiv(program, block->second,
+                            GL_UNIFORM_BLOCK_ACTIVE_UNIFORMS, &count);
+  std::vector<GLint> indices(count);
+  glGetActiveUniformBlockiv(program, block->second,
+                            GL_UNIFORM_BLOCK_ACTIVE_UNIFORM_INDICES,
+                            indices.data());
+  std::vector<GLuint> uindices(indices.begin(), indices.end());
+  std::vector<GLint> offsets(count);
+  std::vector<GLint> matrixStrides(count);
+  glGetActiveUniformsiv(program, count, uindices.data(), GL_UNIFORM_OFFSET,
+                        offsets.data());
+  glGetActiveUniformsiv(program, count, uindices.data(),
+                        GL_UNIFORM_MATRIX_STRIDE, matrixStrides.data());
+
+  glUniformBlockBinding(program, block->second, materialBlockBinding);
+  layout = Layout();
+  layout->size = size;
+  const GLsizei bufSize = 256;
+  GLchar name[bufSize] = {'\0'};
+  for (GLint i = 0; i < count; i++) {
+    GLsizei length = 0;
+    glGetActiveUniformName(program, uindices[i], bufSize, &length, name);
+    std::string member(name, length);
+    // Blocks with an instance name report "Material.member"
+    auto dot = member.rfind('.');
+    if (dot != std::string::npos) {
+      member = member.substr(dot + 1);
+    }
+    layout->members.push_back({member, offsets[i], matrixStrides[i]});
+  }
+  return &*layout;
+}
+
+bool MaterialBlocks::bind(Material& material, const Shader& shader)
+{
+  const Layout* layout = getLayout(shader);
+  if (!layout) {
+    return false;
+  }
+
+  auto& entry = entries[&material];
+  if (entry.program != shader.program ||
+      entry.version != material.getParamsVersion()) {
+    scratch.assign(layout->size, 0);
+    auto& params = material.getShaderParams();
+    for (const auto& member : layout->members) {
+      auto it = params.find(member.name);
+      if (it == params.end()) {
+        continue;
+      }
+      uint8_t* dst = scratch.data() + member.offset;
+      const auto& param = it->second.second;
+      // A parameter of another type than the member must not write past the
+      // block
+      size_t extent = std::visit(
+        [&](const auto& v) -> size_t {
+          using T = std::decay_t<decltype(v)>;
+          if constexpr (std::is_same_v<T, glm::mat3> ||
+                        std::is_same_v<T, glm::mat4>) {
+            return (T::length() - 1) * member.matrixStride +
+                   sizeof(typename T::col_type);
+          }
+          return sizeof(T);
+        },
+        param);
+      if (member.offset + extent > scratch.size()) {
+        std::cerr << "MaterialBlocks: parameter " << member.name
+                  << " doesn't fit its block member" << std::endl;
+        continue;
+      }
+      if (auto v = std::get_if<float>(&param)) {
+        memcpy(dst, v, sizeof(*v));
+      } else if (auto v = std::get_if<int>(&param)) {
+        memcpy(dst, v, sizeof(*v));
+      } else if (auto v = std::get_if<glm::vec2>(&param)) {
+        memcpy(dst, v, sizeof(*v));
+      } else if (auto v = std::get_if<glm::vec3>(&param)) {
+        memcpy(dst, v, sizeof(*v));
+      } else if (auto v = std::get_if<glm::vec4>(&param)) {
+        memcpy(dst, v, sizeof(*v));
+      } else if (auto v = std::get_if<glm::mat3>(&param)) {
+        // std140 pads every column to a vec4
+        for (int c = 0; c < 3; c++) {
+          memcpy(dst + c * member.matrixStride, &(*v)[c], sizeof(glm::vec3));
+        }
+      } else if (auto v = std::get_if<glm::mat4>(&param)) {
+        for (int c = 0; c < 4; c++) {
+          memcpy(dst + c * member.matrixStride, &(*v)[c], sizeof(glm::vec4));
+        }
+      }
+    }
+    entry.buffer.update(scratch.data(), scratch.size());
+    entry.program = shader.program;
+    entry.version = material.getParamsVersion();
+    uploads++;
+  }
+  entry.buffer.bind(materialBlockBinding);
+  return true;
+}
+
+void MaterialBlocks::release(const Material* material)
+{
+  entries.erase(material);
+}
+
+size_t MaterialBlocks::getUploads() const noexcept { return uploads; }
+
+}  // namespace agt3d
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "agt_glsl_shader.h"
+
+namespace agt3d
+{
+
+class Material;
+
+/// Binding points of the uniform blocks filled by the renderer.
+static constexpr GLuint frameBlockBinding = 0;
+static constexpr GLuint materialBlockBinding = 1;
+static constexpr GLuint objectBlockBinding = 2;
+
+/**
+ * @brief Contents of "layout(std140) uniform Frame", members in this order:
+ * mat4 view, projection, viewProjection; vec4 cameraPosition, viewport,
+ * nearFar (near in x, far in y).
+ */
+struct FrameBlock {
+  glm::mat4 view = glm::mat4(1);
+  glm::mat4 projection = glm::mat4(1);
+  glm::mat4 viewProjection = glm::mat4(1);
+  glm::vec4 cameraPosition = {0, 0, 0, 1};
+  glm::vec4 viewport = {0, 0, 0, 0};
+  glm::vec4 nearFar = {0, 0, 0, 0};
+};
+static_assert(sizeof(FrameBlock) == 3 * 64 + 3 * 16);
+
+/**
+ * @brief Contents of "layout(std140) uniform Object { mat4 model; vec4 color;
+ * }".
+ */
+struct ObjectBlock {
+  glm::mat4 model = glm::mat4(1);
+  glm::vec4 color = {1, 1, 1, 1};
+};
+static_assert(sizeof(ObjectBlock) == 80);
+
+/**
+ * @brief Point the named uniform block of the program at a binding.
+ * @return false if the program has no such block.
+ */
+bool bindUniformBlock(const agt3d::Shader& shader, const std::string& name,
+                      GLuint binding) noexcept;
+
+/**
+ * @brief A GL uniform buffer, storage is created on the first update.
+ */
+class UniformBuffer
+{
+ public:
+  UniformBuffer() = default;
+  ~UniformBuffer();
+  UniformBuffer& operator=(const UniformBuffer& other) = delete;
+  UniformBuffer(UniformBuffer&) = delete;
+  UniformBuffer(UniformBuffer&& other) noexcept;
+  /**
+   * @brief Replace the contents, the storage is reallocated when the size
+   * changes.
+   */
+  void update(const void* data, size_t size);
+  void bind(GLuint binding) const noexcept;
+  GLuint getBuffer() const noexcept;
+  size_t getSize() const noexcept;
+
+ private:
+  GLuint buffer = 0;
+  size_t size = 0;
+};
+
+/**
+ * @brief Per-draw uniform blocks streamed through one buffer. Every write
+ * appends after the previous one with the blocks padded to
+ * GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, so each can be bound with
+ * glBindBufferRange. The region is mapped unsynchronized since the GPU may
+ * still read earlier regions; once the end is reached the buffer is orphaned
+ * and writing starts over at its beginning. A single write larger than the
+ * capacity grows the buffer.
+ */
+class UniformRing
+{
+ public:
+  explicit UniformRing(size_t _capacity = 256 * 1024);
+  ~UniformRing();
+  UniformRing& operator=(const UniformRing& other) = delete;
+  UniformRing(UniformRing&) = delete;
+  /**
+   * @brief Distance between consecutive blocks of a write.
+   */
+  size_t getStride(size_t blockSize) const noexcept;
+  /**
+   * @brief Upload count blocks of blockSize bytes.
+   * @return byte offset of the first block, block i is at offset + i *
+   * getStride(blockSize).
+   */
+  size_t write(const void* blocks, size_t blockSize, size_t count);
+  void bind(GLuint binding, size_t offset, size_t blockSize) const noexcept;
+  GLuint getBuffer() const noexcept;
+  /// Times the buffer was orphaned because its end was reached.
+  size_t getWraps() const noexcept;
+
+ private:
+  void allocate();
+
+ private:
+  GLuint buffer = 0;
+  size_t capacity = 0;
+  size_t head = 0;
+  size_t alignment = 0;
+  size_t wraps = 0;
+};
+
+/**
+ * @brief std140 "Material" blocks built from Material::shaderParams, one
+ * buffer per material. Member offsets come from program introspection,
+ * members are matched to parameters by name and members without a parameter
+ * are zero. The program's block is pointed at materialBlockBinding when it
+ * is first seen. A block is rebuilt when Material::getParamsVersion()
+ * changes or the material is used with another program.
+ */
+class MaterialBlocks
+{
+ public:
+  /**
+   * @brief Bind the block of the material to materialBlockBinding.
+   * @return false if the shader has no Material block.
+   */
+  bool bind(agt3d::Material& material, const agt3d::Shader& shader);
+  /**
+   * @brief Drop the block of a material, e.g. before it is destroyed.
+   */
+  void release(const agt3d::Material* material);
+  /// Number of block (re)builds.
+  size_t getUploads() const noexcept;
+
+ private:
+  struct Member {
+    std::string name;
+    GLint offset = 0;
+    GLint matrixStride = 0;
+  };
+  struct Layout {
+    GLint size = 0;
+    std::vector<Member> members;
+  };
+  const Layout* getLayout(const agt3d::Shader& shader);
+
+  struct Entry {
+    agt3d::UniformBuffer buffer;
+    GLuint program = 0;
+    uint64_t version = 0;
+  };
+  std::unordered_map<GLuint, std::optional<Layout>> layouts;
+  std::unordered_map<const agt3d::Material*, Entry> entries;
+  std::vector<uint8_t> scratch;
+  size_t uploads = 0;
+};
+
+}  // namespace agt3d
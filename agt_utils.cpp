@@ -20,6 +20,120 @@ void checkOpenGLErrors() noexcept
   }
 }
 
+size_t getGlTypeSize(GLenum type) noexcept
+{
+  switch (type) {
+    case GL_BYTE:
+    case GL_UNSIGNED_BYTE:
+      return 1;
+    case GL_SHORT:
+    case GL_UNSIGNED_SHORT:
+    case GL_HALF_FLOAT:
+      return 2;
+    case GL_INT:
+    case GL_UNSIGNED_INT:
+    case GL_FLOAT:
+    case GL_FIXED:
+      return 4;
+    case GL_DOUBLE:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+static constexpr uint64_t prime64_1 = 11400714785074694791ULL;
+static constexpr uint64_t prime64_2 = 14029467366897019727ULL;
+static constexpr uint64_t prime64_3 = 1609587929392839161ULL;
+static constexpr uint64_t prime64_4 = 9650029242287828579ULL;
+static constexpr uint64_t prime64_5 = 2870177450012600261ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r) noexcept
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t* p) noexcept
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t read32(const uint8_t* p) noexcept
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t input) noexcept
+{
+  acc += input * prime64_2;
+  acc = rotl64(acc, 31);
+  return acc * prime64_1;
+}
+
+static inline uint64_t hashMerge(uint64_t acc, uint64_t val) noexcept
+{
+  acc ^= hashRound(0, val);
+  return acc * prime64_1 + prime64_4;
+}
+
+uint64_t hash64(const void* data, size_t len, uint64_t seed) noexcept
+{
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  const uint8_t* end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    uint64_t v1 = seed + prime64_1 + prime64_2;
+    uint64_t v2 = seed + prime64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - prime64_1;
+    const uint8_t* limit = end - 32;
+    do {
+      v1 = hashRound(v1, read64(p));
+      v2 = hashRound(v2, read64(p + 8));
+      v3 = hashRound(v3, read64(p + 16));
+      v4 = hashRound(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = hashMerge(h, v1);
+    h = hashMerge(h, v2);
+    h = hashMerge(h, v3);
+    h = hashMerge(h, v4);
+  } else {
+    h = seed + prime64_5;
+  }
+
+  h += static_cast<uint64_t>(len);
+
+  while (p + 8 <= end) {
+    h ^= hashRound(0, read64(p));
+    h = rotl64(h, 27) * prime64_1 + prime64_4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= static_cast<uint64_t>(read32(p)) * prime64_1;
+    h = rotl64(h, 23) * prime64_2 + prime64_3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= (*p) * prime64_5;
+    h = rotl64(h, 11) * prime64_1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= prime64_2;
+  h ^= h >> 29;
+  h *= prime64_3;
+  h ^= h >> 32;
+  return h;
+}
+
 std::vector<std::string> getFilesInFolder(const std::string& path) noexcept
 {
   std::vector<std::string> list;
@@ -7,9 +7,25 @@ namespace agt3d
 class ObjectInstance;
 
 void checkOpenGLErrors() noexcept;
+/**
+ * @brief Size in bytes of a single component of the given GL data type.
+ * @param type GL_FLOAT, GL_UNSIGNED_BYTE, ...
+ * @return size in bytes, 0 for unknown types.
+ */
+size_t getGlTypeSize(GLenum type) noexcept;
 
 std::vector<std::string> getFilesInFolder(const std::string& path) noexcept;
 
+/**
+ * @brief 64-bit non-cryptographic hash of a memory block (xxHash64). Chain
+ * several blocks by passing the previous result as the seed.
+ * @param data memory block.
+ * @param len size in bytes.
+ * @param seed start value.
+ * @return hash value.
+ */
+uint64_t hash64(const void* data, size_t len, uint64_t seed = 0) noexcept;
+
 /**
  * @brief TODO: Please relocate me to the agt3d core project when done.
 */